@@ -10,15 +10,20 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
-#include <math.h>
 #include "cloudgen.h"
 #include "main.h"
 
 static uint16_t rand_value;
 
-static double lerp(double a, double b, double numerator, double denominator)
+// Interpolate between a and b using the current random value
+static uint16_t lerp16(uint16_t a, uint16_t b)
 {
-    return a + numerator * (b - a) / denominator;
+    return a + (uint32_t)(b - a) * rand_value / UINT16_MAX;
+}
+
+static uint32_t lerp32(uint32_t a, uint32_t b)
+{
+    return a + (uint64_t)(b - a) * rand_value / UINT16_MAX;
 }
 
 static int8_t wrap(int8_t i)
@@ -48,7 +53,7 @@ ISR(WDT_vect)
 void cloudgen_init(struct cloudgen *cloud)
 {
     for (uint8_t i = 0; i < 4; i++)
-        cloud->points[i] = cloud->initial_intensity;
+        cloud->points[i] = cloud->parameters.initial_intensity;
 
     // Use the watchdog timer to trigger an interrupt every 16ms.
     // This interval is measured using a separate oscillator to the main clock
@@ -60,34 +65,47 @@ void cloudgen_init(struct cloudgen *cloud)
     TCCR2B = _BV(CS20);
 }
 
-double cloudgen_step(struct cloudgen *cloud, double dt)
+// Advance the cloud model by the given number of elapsed ticks.
+// Returns the current transparency as a fraction of CLOUD_UNITY
+uint16_t cloudgen_step(struct cloudgen *cloud, uint8_t ticks)
 {
     if (!cloud->enabled)
-        return 1;
+        return CLOUD_UNITY;
 
-    cloud->accumulated_time += dt;
+    struct cloud_parameters *p = &cloud->parameters;
+    cloud->accumulated_time += CLOUD_TICK * ticks;
 
-    if (cloud->accumulated_time > cloud->next_period)
+    // A catch-up step may cross more than one control point,
+    // but never generates more points than the ticks that elapsed
+    for (uint8_t i = 0; i < ticks && cloud->accumulated_time > cloud->next_period; i++)
     {
         // Generate new control point value
-        double next = lerp(cloud->min_intensity, cloud->max_intensity, rand_value, UINT16_MAX);
+        uint16_t next = lerp16(p->min_intensity, p->max_intensity);
 
         // Weight heavily towards the previous point
-        cloud->points[cloud->start] = (2 * cloud->points[wrap(cloud->start + 3)] + next) / 3;
+        cloud->points[cloud->start] = (2 * (uint32_t)cloud->points[wrap(cloud->start + 3)] + next) / 3;
 
         // Increment control point
         cloud->start = wrap(cloud->start + 1);
 
         cloud->accumulated_time -= cloud->next_period;
-        cloud->next_period = lerp(cloud->min_period, cloud->max_period, rand_value, UINT16_MAX);
+        cloud->next_period = lerp32(p->min_period, p->max_period);
+
+        // Divisor that maps the accumulated time onto a 0.12 fixed-point fraction of the period
+        cloud->period_scale = (cloud->next_period >> 12) + 1;
     }
 
     // Evaluate the catmull-rom spline
-    double t = cloud->accumulated_time / cloud->next_period;
-    double p0 = cloud->points[wrap(cloud->start + 0)];
-    double p1 = cloud->points[wrap(cloud->start + 1)];
-    double p2 = cloud->points[wrap(cloud->start + 2)];
-    double p3 = cloud->points[wrap(cloud->start + 3)];
-
-    return p1 + 0.5f*t*(p2 - p0 + t*((2*p0 - 5*p1 + 4*p2 - p3) + t*(3*p1 - 3*p2 + p3 - p0)));
-}
\ No newline at end of file
+    int32_t t = cloud->accumulated_time / cloud->period_scale;
+    int32_t p0 = cloud->points[wrap(cloud->start + 0)];
+    int32_t p1 = cloud->points[wrap(cloud->start + 1)];
+    int32_t p2 = cloud->points[wrap(cloud->start + 2)];
+    int32_t p3 = cloud->points[wrap(cloud->start + 3)];
+
+    int32_t value = ((3*p1 - 3*p2 + p3 - p0) * t) >> 12;
+    value = (((2*p0 - 5*p1 + 4*p2 - p3) + value) * t) >> 12;
+    value = (((p2 - p0) + value) * t) >> 12;
+    value = p1 + value / 2;
+
+    return value < 0 ? 0 : value;
+}
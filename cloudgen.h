@@ -11,6 +11,6 @@
 #include "main.h"
 
 void cloudgen_init(struct cloudgen *cloud);
-double cloudgen_step(struct cloudgen *cloud, double dt);
+uint16_t cloudgen_step(struct cloudgen *cloud, uint8_t ticks);
 
 #endif
\ No newline at end of file
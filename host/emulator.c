@@ -0,0 +1,502 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+//
+// Emulated lightbox exposed as a pseudo-terminal.
+//
+// Each emulated device runs the unmodified firmware in its own process.
+// The timer and UART interrupts are delivered as signals from POSIX timers:
+// the tick timer fires every TICK_INTERVAL, and the UART timer fires once per
+// character time at the configured baud rate, moving at most one byte in each
+// direction between the firmware and the pty master.  The firmware's sei() and
+// cli() block and unblock these signals (see hal.c), so interrupts preempt the
+// main loop much as they do on the hardware.
+//
+// The tick timer is re-armed after each tick for OCR0A + 1 counts, so that
+// the firmware can lengthen or shorten individual ticks.  With -c, each
+// device's crystal runs fast or slow by a random error within the given ppm,
+// which scales the tick length and timer0 counts against wall time.
+//
+// The tool (or anything else) can then open the printed pty path, or the
+// symlink created with -l, as if it were a real serial port.
+//
+// Like the Arduino auto-reset circuit, opening the port resets the device if
+// DTR was dropped when it was last closed (HUPCL, which is also the power-on
+// state).  The device process exits and the parent starts a fresh one on the
+// same pty, with the EEPROM kept in memory shared between them.
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "hal.h"
+#include "main.h"
+
+#define MAX_DEVICES 64
+
+// 8N1 framing sends ten bits per byte
+#define BITS_PER_BYTE 10
+
+#define TICK_SIGNAL (SIGRTMIN)
+#define UART_SIGNAL (SIGRTMIN + 1)
+
+// Exit status used by a device process to request a restart
+#define RESET_STATUS 100
+
+int lightbox_main(void);
+
+static uint32_t baud = 9600;
+static double error_rate = 0;
+static uint32_t seed = 0x20140420;
+static const char *link_prefix = NULL;
+static uint32_t boot_delay_ms = 0;
+static double crystal_ppm = 0;
+
+// Per-device state, only used inside the device process
+static int master = -1;
+static uint32_t random_state;
+static struct timespec last_tick;
+static timer_t tick_timer;
+static double crystal_error;
+
+// Open and close events for the pty slave, the number of processes that
+// have it open, and whether DTR was dropped when the last one closed it
+static int port_watch = -1;
+static uint16_t port_openers;
+static bool dtr_dropped;
+
+static pid_t children[MAX_DEVICES];
+static int masters[MAX_DEVICES];
+static char paths[MAX_DEVICES][1024];
+static uint8_t *eeproms[MAX_DEVICES];
+static double crystal_errors[MAX_DEVICES];
+static char links[MAX_DEVICES][1024];
+static uint16_t device_count = 1;
+static volatile sig_atomic_t stopping = 0;
+
+static uint32_t xorshift32()
+{
+    uint32_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return random_state = x;
+}
+
+// Corrupt a single random bit with probability error_rate
+static uint8_t line_error(uint8_t b)
+{
+    if (error_rate > 0 && xorshift32() < error_rate * UINT32_MAX)
+        b ^= 1 << (xorshift32() & 7);
+    return b;
+}
+
+// Opening the port asserts DTR, which resets the device if the last close dropped it
+static void check_reset()
+{
+    char buf[sizeof(struct inotify_event) * 16];
+    ssize_t length;
+    while ((length = read(port_watch, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+        {
+            uint32_t mask = ((struct inotify_event *)p)->mask;
+            if ((mask & IN_OPEN) && port_openers++ == 0 && dtr_dropped)
+                _exit(RESET_STATUS);
+
+            if ((mask & IN_CLOSE) && port_openers > 0 && --port_openers == 0)
+            {
+                struct termios tio;
+                dtr_dropped = tcgetattr(master, &tio) == 0 && (tio.c_cflag & HUPCL);
+            }
+        }
+    }
+}
+
+// Wall time taken by the given number of timer0 counts
+static double counts_interval(double counts)
+{
+    return counts * TICK_PRESCALER / F_CPU / (1 + crystal_error);
+}
+
+// Counts in the current tick.  The nominal length is used until the firmware has configured timer0
+static uint16_t tick_counts()
+{
+    return (TIMSK0 & _BV(OCIE0A)) ? OCR0A + 1 : TICK_TIMER_COUNTS;
+}
+
+static struct timespec add_interval(struct timespec t, double interval)
+{
+    long ns = t.tv_nsec + (long)(interval * 1e9);
+    t.tv_sec += ns / 1000000000L;
+    t.tv_nsec = ns % 1000000000L;
+    return t;
+}
+
+// Arm the tick timer for the compare match that ends the current tick
+static void schedule_tick()
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value = add_interval(last_tick, counts_interval(tick_counts()));
+    timer_settime(tick_timer, TIMER_ABSTIME, &its, NULL);
+}
+
+static void tick_handler(int sig)
+{
+    (void)sig;
+    hal_isr_enter();
+
+    // Measure from the scheduled time, so that signal latency doesn't accumulate
+    last_tick = add_interval(last_tick, counts_interval(tick_counts()));
+
+    // The watchdog runs from its own oscillator, which the cloud
+    // generator samples through timer2 as a source of randomness
+    if (WDTCSR & _BV(WDIE))
+    {
+        TCNT2 = (uint8_t)xorshift32();
+        WDT_vect();
+    }
+
+    if (TIMSK0 & _BV(OCIE0A))
+    {
+        TCNT0 = 0;
+        TIMER0_COMPA_vect();
+    }
+
+    schedule_tick();
+    hal_isr_exit();
+}
+
+static void uart_handler(int sig)
+{
+    (void)sig;
+    hal_isr_enter();
+
+    // Keep timer0 roughly in step with wall time for read_tick_count
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double counts = ((now.tv_sec - last_tick.tv_sec) + (now.tv_nsec - last_tick.tv_nsec) * 1e-9) / counts_interval(1);
+    TCNT0 = counts < 0 ? 0 : counts < tick_counts() - 1 ? (uint8_t)counts : tick_counts() - 1;
+
+    check_reset();
+
+    if (UCSR0B & _BV(UDRIE0))
+    {
+        USART_UDRE_vect();
+
+        // The byte is lost if nobody is listening, as on the real hardware.
+        // The pty would otherwise hold it for the next process to open the port
+        uint8_t b = line_error(UDR0);
+        if (port_openers > 0)
+        {
+            ssize_t ret = write(master, &b, 1);
+            (void)ret;
+        }
+    }
+
+    uint8_t b;
+    if ((UCSR0B & _BV(RXCIE0)) && read(master, &b, 1) == 1)
+    {
+        UDR0 = line_error(b);
+        USART_RX_vect();
+    }
+
+    hal_isr_exit();
+}
+
+static int start_timer(int sig, void (*handler)(int), double interval, sigset_t *mask, timer_t *timer)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sa.sa_mask = *mask;
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(sig, &sa, NULL) == -1)
+        return 1;
+
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = sig;
+    if (timer_create(CLOCK_MONOTONIC, &sev, timer) == -1)
+        return 1;
+
+    struct itimerspec its;
+    its.it_interval.tv_sec = (time_t)interval;
+    its.it_interval.tv_nsec = (long)((interval - its.it_interval.tv_sec) * 1e9);
+    its.it_value = its.it_interval;
+    return timer_settime(*timer, 0, &its, NULL) == -1;
+}
+
+// Run the firmware against the pty master.  Never returns.
+static void run_device(uint16_t index, bool reset)
+{
+    master = masters[index];
+    for (uint16_t i = 0; i < device_count; i++)
+        if (i != index && masters[i] != -1)
+            close(masters[i]);
+
+    random_state = seed + index;
+    if (random_state == 0)
+        random_state = 1;
+    crystal_error = crystal_errors[index];
+
+    hal_reset();
+    hal_set_eeprom(eeproms[index]);
+
+    // The parent's shutdown handlers and signal mask are inherited across the fork
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    // The bootloader discards anything that arrives before it starts the firmware
+    if (reset && boot_delay_ms)
+    {
+        nanosleep(&(struct timespec){ boot_delay_ms / 1000, (boot_delay_ms % 1000) * 1000000L }, NULL);
+        tcflush(master, TCIFLUSH);
+    }
+
+    // A device powers on with DTR low, and is reset by the port being opened.
+    // After a reset, the pty reports a hangup if the port has since been closed
+    struct pollfd p = { .fd = master };
+    port_openers = reset && !(poll(&p, 1, 0) == 1 && (p.revents & POLLHUP));
+    dtr_dropped = true;
+    port_watch = inotify_init1(IN_NONBLOCK);
+    if (port_watch == -1 || inotify_add_watch(port_watch, paths[index], IN_OPEN | IN_CLOSE) == -1)
+    {
+        fprintf(stderr, "Device %u: failed to watch %s: %s\n", index, paths[index], strerror(errno));
+        exit(1);
+    }
+
+    // Interrupt routines run with all other interrupts disabled
+    sigset_t irq;
+    sigemptyset(&irq);
+    sigaddset(&irq, TICK_SIGNAL);
+    sigaddset(&irq, UART_SIGNAL);
+    hal_set_irq_signals(&irq);
+
+    clock_gettime(CLOCK_MONOTONIC, &last_tick);
+    // The tick timer is re-armed as a one-shot timer by each tick
+    timer_t uart_timer;
+    if (start_timer(TICK_SIGNAL, tick_handler, counts_interval(TICK_TIMER_COUNTS), &irq, &tick_timer) ||
+        start_timer(UART_SIGNAL, uart_handler, (double)BITS_PER_BYTE / baud, &irq, &uart_timer))
+    {
+        fprintf(stderr, "Device %u: failed to start timers: %s\n", index, strerror(errno));
+        exit(1);
+    }
+
+    exit(lightbox_main());
+}
+
+static int open_pty(char *path, size_t length)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1)
+        return -1;
+
+    // Raw mode, so that the pty doesn't echo or translate the firmware output
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == -1)
+        return -1;
+    cfmakeraw(&tio);
+    if (tcsetattr(fd, TCSANOW, &tio) == -1)
+        return -1;
+
+    // Non-blocking, so that the interrupt handlers never stall
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+        return -1;
+
+    snprintf(path, length, "%s", ptsname(fd));
+    return fd;
+}
+
+static pid_t start_device(uint16_t index, bool reset)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+        run_device(index, reset);
+    return pid;
+}
+
+static void stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+// Devices are restarted or reaped from the main loop
+static void child(int sig)
+{
+    (void)sig;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n devices] [-b baud] [-e error-rate] [-s seed] [-l link-prefix] [-d boot-delay] [-c ppm]\n", name);
+    fprintf(stderr, "  -n  number of devices to emulate (default 1)\n");
+    fprintf(stderr, "  -b  baud rate used to throttle the emulated UART (default 9600)\n");
+    fprintf(stderr, "  -e  probability of corrupting each byte sent or received (default 0)\n");
+    fprintf(stderr, "  -s  random seed for the cloud generator and line errors\n");
+    fprintf(stderr, "  -l  create symlinks <link-prefix>0, <link-prefix>1, ... to the ptys\n");
+    fprintf(stderr, "  -d  ms spent in the bootloader after each reset (default 0)\n");
+    fprintf(stderr, "  -c  give each crystal a random frequency error within +/- ppm (default 0)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:e:s:l:d:c:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': device_count = atoi(optarg); break;
+            case 'b': baud = atoi(optarg); break;
+            case 'e': error_rate = atof(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            case 'l': link_prefix = optarg; break;
+            case 'd': boot_delay_ms = atoi(optarg); break;
+            case 'c': crystal_ppm = atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (device_count == 0 || device_count > MAX_DEVICES || baud == 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = child;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // Only handle signals while waiting in sigsuspend, so none can be missed
+    sigset_t mask, wait_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &wait_mask);
+
+    // Crystal errors are drawn from the seed, so the same devices can be emulated again
+    random_state = seed ? seed : 1;
+    for (uint16_t i = 0; i < device_count; i++)
+    {
+        masters[i] = -1;
+        crystal_errors[i] = crystal_ppm * 1e-6 * (2.0 * xorshift32() / UINT32_MAX - 1);
+    }
+
+    uint16_t started = 0;
+    for (; started < device_count; started++)
+    {
+        char *path = paths[started];
+        int fd = open_pty(path, sizeof(paths[started]));
+        if (fd == -1)
+        {
+            fprintf(stderr, "Failed to create pty: %s\n", strerror(errno));
+            break;
+        }
+
+        masters[started] = fd;
+        eeproms[started] = mmap(NULL, HAL_EEPROM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (eeproms[started] == MAP_FAILED)
+        {
+            fprintf(stderr, "Failed to allocate EEPROM: %s\n", strerror(errno));
+            break;
+        }
+        memset(eeproms[started], 0xFF, HAL_EEPROM_SIZE);
+
+        if (link_prefix)
+        {
+            snprintf(links[started], sizeof(links[started]), "%s%u", link_prefix, started);
+            unlink(links[started]);
+            if (symlink(path, links[started]) == -1)
+                fprintf(stderr, "Failed to link %s: %s\n", links[started], strerror(errno));
+        }
+
+        printf("Device %u: %s%s%s", started, path, link_prefix ? " -> " : "",
+               link_prefix ? links[started] : "");
+        if (crystal_ppm != 0)
+            printf(" (crystal %+.1f ppm)", crystal_errors[started] * 1e6);
+        printf("\n");
+        fflush(stdout);
+
+        pid_t pid = start_device(started, false);
+        if (pid < 0)
+        {
+            fprintf(stderr, "Failed to start device: %s\n", strerror(errno));
+            break;
+        }
+
+        children[started] = pid;
+    }
+
+    // Run until interrupted, or until a device exits unexpectedly
+    while (started == device_count && !stopping)
+    {
+        sigsuspend(&wait_mask);
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for (uint16_t i = 0; i < started; i++)
+            {
+                if (children[i] != pid)
+                    continue;
+
+                children[i] = 0;
+                if (WIFEXITED(status) && WEXITSTATUS(status) == RESET_STATUS)
+                    children[i] = start_device(i, true);
+
+                if (children[i] <= 0)
+                {
+                    fprintf(stderr, "Device %u stopped\n", i);
+                    stopping = 1;
+                }
+            }
+        }
+    }
+
+    for (uint16_t i = 0; i < started; i++)
+    {
+        if (children[i] > 0)
+        {
+            kill(children[i], SIGTERM);
+            waitpid(children[i], NULL, 0);
+        }
+
+        if (link_prefix)
+            unlink(links[i]);
+    }
+
+    return started == device_count ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <stdbool.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include "hal.h"
+
+volatile uint8_t DDRB, DDRC, DDRD;
+volatile uint8_t PORTB, PORTC, PORTD;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, TIMSK0, TIFR0;
+volatile uint8_t TCCR1A, TCCR1B;
+volatile uint16_t TCNT1, OCR1A, OCR1B;
+volatile uint8_t TCCR2B, TCNT2;
+volatile uint8_t MCUSR, WDTCSR;
+volatile uint8_t UBRR0H, UBRR0L, UCSR0A, UCSR0B, UDR0;
+
+// The ATmega328p has 1kB of EEPROM, which reads as 0xFF when erased
+static uint8_t eeprom_storage[HAL_EEPROM_SIZE];
+static uint8_t *eeprom = eeprom_storage;
+static volatile uint8_t interrupts_enabled;
+
+// Signals that stand in for interrupts; empty unless interrupts are asynchronous
+static sigset_t irq_signals;
+static bool irq_async;
+
+// Number of interrupt routines run, and the count when sleep was enabled
+static volatile uint32_t isr_count;
+static uint32_t sleep_count;
+
+void hal_reset()
+{
+    eeprom = eeprom_storage;
+    memset(eeprom, 0xFF, HAL_EEPROM_SIZE);
+    interrupts_enabled = 0;
+    sigemptyset(&irq_signals);
+    irq_async = false;
+}
+
+void hal_set_eeprom(uint8_t *storage)
+{
+    eeprom = storage;
+}
+
+void hal_set_irq_signals(const sigset_t *signals)
+{
+    irq_signals = *signals;
+    irq_async = true;
+    sigprocmask(interrupts_enabled ? SIG_UNBLOCK : SIG_BLOCK, &irq_signals, NULL);
+}
+
+// The hardware disables interrupts while an interrupt routine runs.
+// The signal mask is restored by the kernel when the handler returns.
+void hal_isr_enter()
+{
+    interrupts_enabled = 0;
+    isr_count++;
+}
+
+void hal_isr_exit()
+{
+    interrupts_enabled = 1;
+}
+
+uint16_t hal_drain_uart(uint8_t *buf, uint16_t length)
+{
+    // Run the transmit interrupt until the firmware disables it
+    uint16_t count = 0;
+    while (UCSR0B & _BV(UDRIE0))
+    {
+        USART_UDRE_vect();
+        if (buf && count < length)
+            buf[count] = UDR0;
+        count++;
+    }
+
+    return count;
+}
+
+// The hardware runs the instruction following sei() before any pending
+// interrupt, so firmware can enable interrupts and sleep without missing
+// a wakeup.  The shim instead notes the interrupts that have run since
+// sleep was enabled, and doesn't sleep if there were any.
+void sleep_enable()
+{
+    sleep_count = isr_count;
+}
+
+void sleep_cpu()
+{
+    // Nothing can wake a synchronous harness
+    if (!irq_async)
+        return;
+
+    sigset_t unblocked;
+    sigprocmask(SIG_BLOCK, &irq_signals, &unblocked);
+    if (isr_count == sleep_count)
+        sigsuspend(&unblocked);
+    sigprocmask(SIG_SETMASK, &unblocked, NULL);
+}
+
+uint8_t shim_irq_save()
+{
+    sigprocmask(SIG_BLOCK, &irq_signals, NULL);
+    uint8_t state = interrupts_enabled;
+    interrupts_enabled = 0;
+    return state;
+}
+
+void shim_irq_restore(uint8_t state)
+{
+    interrupts_enabled = state;
+    if (state)
+        sigprocmask(SIG_UNBLOCK, &irq_signals, NULL);
+}
+
+void sei()
+{
+    interrupts_enabled = 1;
+    sigprocmask(SIG_UNBLOCK, &irq_signals, NULL);
+}
+
+void cli()
+{
+    sigprocmask(SIG_BLOCK, &irq_signals, NULL);
+    interrupts_enabled = 0;
+}
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+    return eeprom[(uintptr_t)addr % HAL_EEPROM_SIZE];
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+    eeprom[(uintptr_t)addr % HAL_EEPROM_SIZE] = value;
+}
+
+uint16_t eeprom_read_word(const uint16_t *addr)
+{
+    uint16_t value;
+    eeprom_read_block(&value, addr, sizeof(value));
+    return value;
+}
+
+void eeprom_update_word(uint16_t *addr, uint16_t value)
+{
+    eeprom_update_block(&value, addr, sizeof(value));
+}
+
+void eeprom_read_block(void *dst, const void *addr, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        ((uint8_t *)dst)[i] = eeprom_read_byte((const uint8_t *)addr + i);
+}
+
+void eeprom_update_block(const void *src, void *addr, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        eeprom_update_byte((uint8_t *)addr + i, ((const uint8_t *)src)[i]);
+}
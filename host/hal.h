@@ -0,0 +1,35 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef LIGHTBOX_HOST_HAL_H
+#define LIGHTBOX_HOST_HAL_H
+
+#include <signal.h>
+#include <stdint.h>
+
+#define HAL_EEPROM_SIZE 1024
+
+// Restore the emulated hardware to its power-on state
+void hal_reset();
+
+// Use the given HAL_EEPROM_SIZE bytes as the EEPROM, e.g. to keep
+// its contents across a reset.  hal_reset restores the private copy
+void hal_set_eeprom(uint8_t *storage);
+
+// Run the UART transmit interrupt until the firmware output queue is empty.
+// Up to length bytes are copied into buf (which may be NULL).
+// Returns the total number of bytes that were sent.
+uint16_t hal_drain_uart(uint8_t *buf, uint16_t length);
+
+// Deliver interrupts asynchronously as the given signals.
+// sei() and cli() then unblock and block these signals, and the signal
+// handlers must bracket the interrupt routines with hal_isr_enter/exit.
+void hal_set_irq_signals(const sigset_t *signals);
+void hal_isr_enter();
+void hal_isr_exit();
+
+#endif
@@ -0,0 +1,82 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+//
+// Checks the tool's handling of firmware that predates 16-bit simulation ids.
+// Such firmware answers REQUEST_MODES with an 8-bit total and active id, and
+// sends 8-bit ids in SIMULATION_TYPE and SET_MODE.  The tool's protocol code
+// is built separately from the firmware, as their packet definitions clash.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "legacy.h"
+#include "tool/protocol.h"
+
+// Frame data as the device would send it and parse it one byte at a time.
+// Returns true if a single complete packet was parsed
+static bool parse(struct timer_packet *p, uint8_t type, const void *data, uint8_t length)
+{
+    uint8_t buf[MAX_DATA_LENGTH + PACKET_OVERHEAD];
+    size_t total = packet_encode(buf, type, data, length);
+
+    memset(p, 0, sizeof(struct timer_packet));
+    p->state = HEADERA;
+    for (size_t i = 0; i < total; i++)
+        if (packet_parse_byte(p, buf[i]))
+            return i == total - 1;
+
+    return false;
+}
+
+static bool report(const char *name, bool pass)
+{
+    printf("%-40s  %s\n", name, pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+int check_legacy_packets()
+{
+    struct timer_packet p;
+    bool pass = true;
+
+    // The active id must not pick up garbage from the following bytes
+    uint8_t count[] = { 12, 7 };
+    pass &= report("Legacy SIMULATION_COUNT", parse(&p, SIMULATION_COUNT, count, sizeof(count)) &&
+                   p.length == sizeof(struct packet_simulation_count) &&
+                   p.data.count.total == 12 && p.data.count.active == 7);
+
+    struct packet_simulation_count wide = { .total = 300, .active = 258 };
+    pass &= report("Current SIMULATION_COUNT", parse(&p, SIMULATION_COUNT, &wide, sizeof(wide)) &&
+                   p.data.count.total == 300 && p.data.count.active == 258);
+
+    uint8_t mode[] = { 9 };
+    pass &= report("Legacy SET_MODE", parse(&p, SET_MODE, mode, sizeof(mode)) &&
+                   p.length == sizeof(struct packet_set_mode) && p.data.set_simulation.id == 9);
+
+    // The legacy SIMULATION_TYPE is the current layout with a one byte id
+    struct packet_simulation sim;
+    memset(&sim, 0, sizeof(sim));
+    sim.exptime = 5000;
+    sim.name_length = snprintf(sim.name, sizeof(sim.name), "Crab pulsar");
+    sim.desc_length = snprintf(sim.desc, sizeof(sim.desc), "Pulsed output");
+
+    uint8_t legacy[sizeof(struct packet_simulation) - 1];
+    legacy[0] = 8;
+    memcpy(legacy + 1, (uint8_t *)&sim + sizeof(sim.id), sizeof(legacy) - 1);
+    pass &= report("Legacy SIMULATION_TYPE", parse(&p, SIMULATION_TYPE, legacy, sizeof(legacy)) &&
+                   p.length == sizeof(struct packet_simulation) && p.data.simulation.id == 8 &&
+                   p.data.simulation.exptime == 5000 && strcmp(p.data.simulation.name, "Crab pulsar") == 0 &&
+                   p.data.simulation.desc_length == sim.desc_length &&
+                   strcmp(p.data.simulation.desc, "Pulsed output") == 0);
+
+    sim.id = 258;
+    pass &= report("Current SIMULATION_TYPE", parse(&p, SIMULATION_TYPE, &sim, sizeof(sim)) &&
+                   p.data.simulation.id == 258 && p.data.simulation.exptime == 5000);
+
+    return pass ? 0 : 1;
+}
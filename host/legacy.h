@@ -0,0 +1,15 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef LIGHTBOX_HOST_LEGACY_H
+#define LIGHTBOX_HOST_LEGACY_H
+
+// Feed replies in the 8-bit simulation id format through the tool's packet
+// parser and check that they are widened correctly.  Returns 0 on success
+int check_legacy_packets();
+
+#endif
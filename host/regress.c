@@ -0,0 +1,1232 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+//
+// Golden light-curve regression suite.
+//
+// Each built-in simulation is rendered for a fixed span using the firmware
+// sources and a deterministic cloud seed.  The PWM register values are
+// compared against the stored golden curves, reporting the maximum deviation
+// and the phase drift estimated from the lag that best realigns the curves.
+// Each render is timed so engine speedups and regressions show up together.
+//
+// With -o the timer0 interrupt is periodically swallowed as if the previous
+// update had overrun, checking that the firmware catches up without losing
+// phase.  Cloudy simulations are skipped in this mode because the cloud
+// generator samples its random source at the time of each update.  Two
+// consecutive interrupts are then swallowed, which is beyond what the overrun
+// flag can record: the firmware must report the overrun and lose exactly
+// one tick.  simc's catch-up budget keeps this from happening on the device.
+//
+// With -a the eclipse outputs are instead compared against an independent
+// double precision evaluation of the eclipse geometry, using analytic
+// overlap areas and integrating the limb darkening profile by parts.
+//
+// With -b the host batch renderer is checked against its double precision
+// reference, and the clear-sky outputs against the firmware, over a span
+// that crosses the 32-bit phase wrap.  The throughput of the reference,
+// scalar and vector paths is reported in samples per second.
+//
+// With -e the closed-form exposure means are checked against the mean of the
+// rendered updates, for exposures of the recommended length at random start
+// times, and the analytic cloud means against the held cloud generator output.
+// The closed form integrates the continuous model, so the difference allowed
+// for each exposure is widened by the largest step between the held updates.
+//
+// With -l each simulation is played in a looping playlist with the one that
+// follows it in the catalog, with the playlist task delayed by up to three
+// updates.  The clear-sky outputs are compared against the batch renderer
+// started from each exact entry boundary.
+//
+// With -g each simulation is rendered with its specialized update, with the
+// generic engine, and handing over from one to the other half way through,
+// which must all produce identical outputs.  Parameter changes that the
+// device rejects must leave the specialized update running.  The fastest of
+// several renders with each is reported to show the per-simulation speedup.
+//
+// With -s the device runs with a crystal error that depends on the simulation,
+// and is sent a SYNC beacon every few seconds of simulated time, one of which
+// is delayed on the way and another followed by a stray '\n' that overwrites
+// its arrival time.  The error between the device and shared clocks must
+// settle within a few timer counts, and the clear-sky outputs must match the
+// batch renderer at the shared tick, so that devices running the same
+// simulation stay in phase.
+//
+// With -k the tool's packet parser is fed replies from firmware that predates
+// 16-bit simulation ids, which must be widened to the current layout, and the
+// firmware is sent SET_MODE requests from hosts that send 8-bit ids.
+//
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "hal.h"
+#include "legacy.h"
+#include "main.h"
+#include "playlist.h"
+#include "render.h"
+#include "sync.h"
+#include "usb.h"
+
+// Number of timer ticks to render, and the stride between golden samples
+#define RENDER_TICKS 6144
+#define SAMPLE_STRIDE 8
+#define SAMPLE_COUNT (RENDER_TICKS / SAMPLE_STRIDE)
+
+// Largest lag (in samples) searched for phase drift
+#define MAX_LAG 16
+
+// RMS error (in PWM counts) expected from output rounding alone
+#define QUANTIZATION_NOISE 0.5
+
+// Default pass criteria: PWM counts and timer ticks
+#define DEFAULT_TOLERANCE 2
+#define DEFAULT_DRIFT_TOLERANCE 2.0
+
+// Steps used to integrate the limb darkening profile of the analytic reference
+#define REFERENCE_STEPS 4000
+
+// Seed for the random sequence sampled by the cloud generator
+#define CLOUD_SEED 0x20140420
+
+// Ticks rendered by the batch benchmark (about 4.75 hours), in blocks
+#define BATCH_TICKS ((uint32_t)1 << 20)
+#define BATCH_BLOCK 65536
+
+// Exposures checked for each simulation, and the largest difference (in PWM
+// counts) between the closed-form means and the mean of the held outputs
+#define EXPOSURE_COUNT 10000
+#define EXPOSURE_TOLERANCE 0.05
+
+// Largest difference between the analytic and held cloud transparency means
+#define CLOUD_TOLERANCE 1e-4
+
+// Ticks played by the playlist check, and the duration of its two entries
+#define PLAYLIST_TICKS 2048
+#define PLAYLIST_FIRST 300
+#define PLAYLIST_SECOND 211
+
+// Renders timed with each update by the specialized check
+#define SPECIALIZED_RENDERS 20
+
+// Beacons sent by the synchronization check, their interval in ticks, and
+// the ticks between the first beacon and the shared epoch
+#define SYNC_BEACONS 40
+#define SYNC_INTERVAL 122
+#define SYNC_LEAD 61
+
+// Largest crystal error, in ppm, and the beacon that is delayed by SYNC_DELAY counts
+#define SYNC_MAX_PPM 200
+#define SYNC_DELAYED 20
+#define SYNC_DELAY 40
+
+// Beacon followed by a stray '\n' before it is parsed, which must be ignored
+#define SYNC_NOISY 30
+
+// Beacons ignored while the frequency correction settles, and the largest
+// error (in timer counts) allowed after that
+#define SYNC_SETTLE 8
+#define SYNC_TOLERANCE 2
+
+struct curve
+{
+    uint16_t samples[SAMPLE_COUNT][CHANNEL_COUNT];
+};
+
+struct result
+{
+    uint16_t max_deviation;
+    double drift;
+    double tick_us;
+};
+
+static const char *golden_dir = "golden";
+static bool update = false;
+static uint16_t tolerance = DEFAULT_TOLERANCE;
+static double drift_tolerance = DEFAULT_DRIFT_TOLERANCE;
+static uint16_t overrun_interval = 0;
+static bool analytic = false;
+static bool batch = false;
+static bool exposures = false;
+static bool playlist = false;
+static bool specialized = false;
+static bool synchronized = false;
+static bool legacy = false;
+
+// Render with the generic engine instead of the specialized update,
+// or switch to it half way through the render
+static bool generic = false;
+static bool handover = false;
+
+static uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static double elapsed_us(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec)*1e6 + (end->tv_nsec - start->tv_nsec)/1e3;
+}
+
+// Whether the interrupt for tick t is missed when simulating overruns.
+// Sampled ticks are never missed so that the output can be compared directly
+static bool overrun(uint16_t t)
+{
+    return overrun_interval && t % overrun_interval == overrun_interval - 1 && t % SAMPLE_STRIDE != 0;
+}
+
+// Two consecutive interrupts swallowed after this many ticks, out of DOUBLE_OVERRUN_TICKS
+#define DOUBLE_OVERRUN_TICK 100
+#define DOUBLE_OVERRUN_TICKS 200
+
+// Returns true if a swallowed pair of interrupts is reported as one overrun, losing one tick
+static bool check_double_overrun(uint16_t id)
+{
+    hal_reset();
+    select_simulation(id);
+    hal_drain_uart(NULL, 0);
+
+    uint8_t counts;
+    uint16_t reported = stats.tick_overruns;
+    uint32_t start = read_tick_count(&counts);
+    for (uint16_t t = 0; t < DOUBLE_OVERRUN_TICKS; t++)
+    {
+        if (t == DOUBLE_OVERRUN_TICK || t == DOUBLE_OVERRUN_TICK + 1)
+            continue;
+
+        TIFR0 = t + 1 == DOUBLE_OVERRUN_TICK ? _BV(OCF0A) : 0;
+        TIMER0_COMPA_vect();
+        TIFR0 = 0;
+    }
+
+    uint32_t elapsed = read_tick_count(&counts) - start;
+    if (stats.tick_overruns - reported != 1 || elapsed != DOUBLE_OVERRUN_TICKS - 1)
+    {
+        printf("Two swallowed interrupts: expected 1 overrun and %u ticks, firmware reported %u and %u\n",
+               DOUBLE_OVERRUN_TICKS - 1, stats.tick_overruns - reported, elapsed);
+        return false;
+    }
+
+    return true;
+}
+
+static double render(uint16_t id, struct curve *c)
+{
+    hal_reset();
+    select_simulation(id);
+    if (generic)
+        use_generic_update();
+    hal_drain_uart(NULL, 0);
+
+    uint32_t seed = CLOUD_SEED;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint16_t t = 0; t < RENDER_TICKS; t++)
+    {
+        if (handover && t == RENDER_TICKS / 2)
+            use_generic_update();
+
+        // The watchdog and timer0 interrupts both fire every ~16ms
+        TCNT2 = (uint8_t)xorshift32(&seed);
+        WDT_vect();
+        if (overrun(t))
+            continue;
+
+        // Raise the compare flag during the update that precedes a missed tick
+        TIFR0 = overrun(t + 1) ? _BV(OCF0A) : 0;
+        TIMER0_COMPA_vect();
+        TIFR0 = 0;
+
+        if (t % SAMPLE_STRIDE == 0)
+        {
+            c->samples[t / SAMPLE_STRIDE][0] = OCR1B;
+            c->samples[t / SAMPLE_STRIDE][1] = OCR1A;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return elapsed_us(&start, &end) / RENDER_TICKS;
+}
+
+static void golden_path(char *buf, size_t length, uint16_t id)
+{
+    snprintf(buf, length, "%s/simulation-%u.txt", golden_dir, id);
+}
+
+static int write_golden(uint16_t id, struct curve *c)
+{
+    char path[1024];
+    golden_path(path, sizeof(path), id);
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", path);
+        return 1;
+    }
+
+    struct simulation_parameters params;
+    read_simulation(id, &params);
+    fprintf(f, "# %s\n", params.name);
+    fprintf(f, "# tick ch0 ch1 (%u ticks of %gs)\n", RENDER_TICKS, TICK_INTERVAL);
+    for (uint16_t i = 0; i < SAMPLE_COUNT; i++)
+        fprintf(f, "%u %u %u\n", i*SAMPLE_STRIDE, c->samples[i][0], c->samples[i][1]);
+
+    fclose(f);
+    return 0;
+}
+
+static int read_golden(uint16_t id, struct curve *c)
+{
+    char path[1024];
+    golden_path(path, sizeof(path), id);
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return 1;
+    }
+
+    char line[256];
+    uint16_t i = 0;
+    while (i < SAMPLE_COUNT && fgets(line, sizeof(line), f))
+    {
+        unsigned tick, a, b;
+        if (line[0] == '#')
+            continue;
+
+        if (sscanf(line, "%u %u %u", &tick, &a, &b) != 3 || tick != i*SAMPLE_STRIDE)
+            break;
+
+        c->samples[i][0] = a;
+        c->samples[i++][1] = b;
+    }
+
+    fclose(f);
+    if (i != SAMPLE_COUNT)
+    {
+        fprintf(stderr, "Malformed golden curve %s\n", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Estimate the lag (in ticks) that best aligns the rendered channel with the golden channel.
+// The lag minimising the squared difference is refined with a parabolic fit.
+static double phase_drift(struct curve *golden, struct curve *rendered, uint8_t channel)
+{
+    double error[2*MAX_LAG + 1];
+    int8_t best = -MAX_LAG;
+    for (int8_t lag = -MAX_LAG; lag <= MAX_LAG; lag++)
+    {
+        double sum = 0;
+        for (int16_t i = MAX_LAG; i < SAMPLE_COUNT - MAX_LAG; i++)
+        {
+            double d = (double)golden->samples[i][channel] - rendered->samples[i + lag][channel];
+            sum += d*d;
+        }
+
+        error[lag + MAX_LAG] = sum;
+        if (sum < error[best + MAX_LAG] || (sum == error[best + MAX_LAG] && abs(lag) < abs(best)))
+            best = lag;
+    }
+
+    // Ignore realignments that don't improve the RMS error by more than the
+    // PWM quantization noise: slowly varying curves carry no phase information
+    double n = SAMPLE_COUNT - 2*MAX_LAG;
+    if (sqrt(error[MAX_LAG]/n) - sqrt(error[best + MAX_LAG]/n) < QUANTIZATION_NOISE)
+        return 0;
+
+    double offset = best;
+    if (best > -MAX_LAG && best < MAX_LAG)
+    {
+        double a = error[best + MAX_LAG - 1];
+        double b = error[best + MAX_LAG];
+        double c = error[best + MAX_LAG + 1];
+        double denom = a - 2*b + c;
+        if (denom > 0)
+            offset += 0.5*(a - c)/denom;
+    }
+
+    return offset*SAMPLE_STRIDE;
+}
+
+static void compare(struct curve *golden, struct curve *rendered, struct result *r)
+{
+    r->max_deviation = 0;
+    r->drift = 0;
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+    {
+        for (uint16_t i = 0; i < SAMPLE_COUNT; i++)
+        {
+            uint16_t d = abs(golden->samples[i][j] - rendered->samples[i][j]);
+            if (d > r->max_deviation)
+                r->max_deviation = d;
+        }
+
+        double drift = phase_drift(golden, rendered, j);
+        if (fabs(drift) > fabs(r->drift))
+            r->drift = drift;
+    }
+}
+
+// PWM count expected from an eclipse output after the given number of updates
+static double reference_output(const struct output_definition *o, uint32_t updates)
+{
+    uint32_t phase = o->increment * updates;
+    double blocked = 0;
+    for (uint8_t j = 0; j < o->mode_count; j++)
+    {
+        const struct eclipse_definition *e = (const struct eclipse_definition *)o->modes + j;
+        double distance = fabs((int32_t)(phase - e->offset) / 4294967296.0);
+        double half_width = e->half_width / 4294967296.0;
+        if (distance >= half_width)
+            continue;
+
+        double k = e->radius / 32768.0;
+        double b = e->impact / 32768.0;
+        double x = distance / half_width;
+        double z = sqrt(b*b + x*x*((1 + k)*(1 + k) - b*b));
+        blocked += render_eclipse_blocked(k, z, e->u1 / 16384.0, e->u2 / 16384.0, REFERENCE_STEPS);
+    }
+
+    return o->level * (1 - fmin(blocked, 1)) / (1 << OUTPUT_SHIFT);
+}
+
+static int run_analytic(uint16_t id)
+{
+    struct simulation_parameters params;
+    read_simulation(id, &params);
+    const struct simulation_definition *d = params.definition;
+
+    bool eclipse = false;
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        eclipse |= d->outputs[j].type == Eclipse && !d->outputs[j].cloudy;
+
+    if (!eclipse)
+    {
+        printf("%3u  %-40s  %8s  %9s  %8s  SKIP\n", id, params.name, "-", "-", "-");
+        return 0;
+    }
+
+    struct curve rendered;
+    double tick_us = render(id, &rendered);
+
+    // Samples are taken after the update at each sampled tick
+    double max_deviation = 0;
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+    {
+        const struct output_definition *o = &d->outputs[j];
+        if (o->type != Eclipse || o->cloudy)
+            continue;
+
+        for (uint16_t i = 0; i < SAMPLE_COUNT; i++)
+        {
+            double deviation = fabs(rendered.samples[i][j] - reference_output(o, i*SAMPLE_STRIDE + 1));
+            if (deviation > max_deviation)
+                max_deviation = deviation;
+        }
+    }
+
+    bool pass = max_deviation <= tolerance;
+    printf("%3u  %-40s  %8.2f  %9s  %8.3f  %s\n", id, params.name, max_deviation, "-",
+           tick_us, pass ? "PASS" : "FAIL");
+
+    return pass ? 0 : 1;
+}
+
+// Render with the given plan, returning the largest deviation from the reference
+static double render_batch(struct render_plan *plan, float *reference[CHANNEL_COUNT], double *seconds)
+{
+    float *out[CHANNEL_COUNT];
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        out[j] = calloc(BATCH_TICKS, sizeof(float));
+
+    // Start just before the phases wrap
+    uint64_t first = ((uint64_t)1 << 32) - BATCH_TICKS / 2;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < BATCH_TICKS; i += BATCH_BLOCK)
+    {
+        float *block[CHANNEL_COUNT];
+        for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+            block[j] = out[j] + i;
+        render_block(plan, first + i, BATCH_BLOCK, block);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *seconds = elapsed_us(&start, &end) / 1e6;
+
+    double max_deviation = 0;
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+    {
+        for (uint32_t i = 0; i < BATCH_TICKS; i++)
+            if (fabs(out[j][i] - reference[j][i]) > max_deviation)
+                max_deviation = fabs(out[j][i] - reference[j][i]);
+        free(out[j]);
+    }
+
+    return max_deviation;
+}
+
+static int run_batch(uint16_t id)
+{
+    struct simulation_parameters params;
+    read_simulation(id, &params);
+    const struct simulation_definition *d = params.definition;
+
+    render_use_simd(false);
+    struct render_plan *scalar = render_plan_new(d);
+    render_use_simd(true);
+    struct render_plan *simd = render_plan_new(d);
+
+    float *reference[CHANNEL_COUNT];
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        reference[j] = calloc(BATCH_TICKS, sizeof(float));
+
+    if (!scalar || !simd || !reference[0] || !reference[1])
+    {
+        printf("%3u  %-40s  Allocation failure\n", id, params.name);
+        return 1;
+    }
+
+    uint64_t first = ((uint64_t)1 << 32) - BATCH_TICKS / 2;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    render_block_reference(simd, first, BATCH_TICKS, reference);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double reference_seconds = elapsed_us(&start, &end) / 1e6;
+
+    double scalar_seconds, simd_seconds;
+    double deviation = fmax(render_batch(scalar, reference, &scalar_seconds),
+                            render_batch(simd, reference, &simd_seconds));
+
+    // Compare the clear-sky outputs with the firmware.
+    // Samples are taken after the update at each sampled tick
+    struct curve rendered;
+    render(id, &rendered);
+
+    float *model[CHANNEL_COUNT];
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        model[j] = reference[j];
+    render_block_reference(simd, 0, RENDER_TICKS + 1, model);
+
+    double firmware_deviation = -1;
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+    {
+        if (d->cloud && d->outputs[j].cloudy)
+            continue;
+
+        for (uint16_t i = 0; i < SAMPLE_COUNT; i++)
+            firmware_deviation = fmax(firmware_deviation, fabs(rendered.samples[i][j] - model[j][i*SAMPLE_STRIDE + 1]));
+    }
+
+    bool pass = deviation <= RENDER_TOLERANCE && firmware_deviation <= tolerance;
+    double samples = (double)BATCH_TICKS * CHANNEL_COUNT / 1e6;
+    if (firmware_deviation < 0)
+        printf("%3u  %-40s  %7s", id, params.name, "-");
+    else
+        printf("%3u  %-40s  %7.2f", id, params.name, firmware_deviation);
+    printf("  %8.5f  %7.1f  %7.1f  %7.1f  %s\n", deviation, samples / reference_seconds,
+           samples / scalar_seconds, samples / simd_seconds, pass ? "PASS" : "FAIL");
+
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        free(reference[j]);
+    render_plan_free(scalar);
+    render_plan_free(simd);
+
+    return pass ? 0 : 1;
+}
+
+// Mean of the outputs held from update first + i to first + i + 1
+// over an exposure of length updates, starting start updates after first.
+// step is set to the largest change between consecutive updates from the
+// one before the exposure to the one after, which must also be in values
+static double held_mean(const float *values, double start, double length, double *step)
+{
+    double end = start + length;
+    double sum = 0;
+    for (uint32_t i = (uint32_t)start; i < end; i++)
+        sum += values[i] * (fmin(end, i + 1) - fmax(start, i));
+
+    *step = 0;
+    for (int64_t i = (int64_t)start; i <= (int64_t)end + 1; i++)
+        *step = fmax(*step, fabs(values[i] - values[i - 1]));
+
+    return sum / length;
+}
+
+static int run_exposures(uint16_t id)
+{
+    struct simulation_parameters params;
+    read_simulation(id, &params);
+    const struct simulation_definition *d = params.definition;
+    double length = params.exptime / 1000.0 / TICK_INTERVAL;
+    uint32_t ticks = (uint32_t)length + 4;
+
+    struct render_plan *plan = render_plan_new(d);
+    double *starts = calloc(EXPOSURE_COUNT, sizeof(double));
+    double (*predicted)[CHANNEL_COUNT] = calloc(EXPOSURE_COUNT, sizeof(double[CHANNEL_COUNT]));
+    float *held[CHANNEL_COUNT];
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        held[j] = calloc(ticks, sizeof(float));
+
+    if (!plan || !starts || !predicted || !held[0] || !held[1])
+    {
+        printf("%3u  %-40s  Allocation failure\n", id, params.name);
+        return 1;
+    }
+
+    // Exposures start at random fractional updates anywhere in the phase cycle
+    uint32_t random = CLOUD_SEED;
+    for (uint32_t i = 0; i < EXPOSURE_COUNT; i++)
+        starts[i] = xorshift32(&random) + xorshift32(&random) / 4294967296.0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < EXPOSURE_COUNT; i++)
+        render_exposure(plan, starts[i], length, predicted[i]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double predicted_us = elapsed_us(&start, &end) / EXPOSURE_COUNT;
+
+    double deviation = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < EXPOSURE_COUNT; i++)
+    {
+        double first = floor(starts[i]) - 1;
+        render_block(plan, (uint64_t)first, ticks, held);
+        for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        {
+            // The held output can't follow features narrower than an update, which
+            // shifts the mean by up to the largest step between updates over the exposure
+            double step;
+            double mean = held_mean(held[j], starts[i] - first, length, &step);
+            deviation = fmax(deviation, fabs(predicted[i][j] - mean) - step / length);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double rendered_us = elapsed_us(&start, &end) / EXPOSURE_COUNT;
+
+    // Consecutive exposures of the same cloud realization
+    double cloud_deviation = -1;
+    if (d->cloud)
+    {
+        uint32_t count = (uint32_t)ceil(EXPOSURE_COUNT * length) + 3;
+        float *transparency = calloc(count, sizeof(float));
+        if (!transparency)
+        {
+            printf("%3u  %-40s  Allocation failure\n", id, params.name);
+            return 1;
+        }
+
+        struct render_cloud analytic, sampled;
+        render_cloud_init(&analytic, d->cloud, CLOUD_SEED);
+        render_cloud_init(&sampled, d->cloud, CLOUD_SEED);
+        render_cloud_block(&sampled, count - 1, transparency + 1);
+        transparency[0] = transparency[1];
+
+        cloud_deviation = 0;
+        for (uint32_t i = 0; i < EXPOSURE_COUNT; i++)
+        {
+            double mean = render_cloud_mean(&analytic, i * length, length);
+            double step;
+            cloud_deviation = fmax(cloud_deviation, fabs(mean - held_mean(transparency + 1, i * length, length, &step)));
+        }
+
+        free(transparency);
+    }
+
+    bool pass = deviation <= EXPOSURE_TOLERANCE && cloud_deviation <= CLOUD_TOLERANCE;
+    printf("%3u  %-40s  %7.1f  %8.5f", id, params.name, params.exptime / 1000.0, deviation);
+    if (cloud_deviation < 0)
+        printf("  %9s", "-");
+    else
+        printf("  %9.2e", cloud_deviation);
+    printf("  %9.3f  %9.1f  %s\n", predicted_us, rendered_us, pass ? "PASS" : "FAIL");
+
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        free(held[j]);
+    free(starts);
+    free(predicted);
+    render_plan_free(plan);
+
+    return pass ? 0 : 1;
+}
+
+static int run_playlist(uint16_t id)
+{
+    struct simulation_parameters params;
+    read_simulation(id, &params);
+
+    uint16_t next = id % simulation_count + 1;
+    struct playlist_entry entries[2] =
+    {
+        { .simulation = id, .duration = PLAYLIST_FIRST },
+        { .simulation = next, .duration = PLAYLIST_SECOND },
+    };
+
+    // Render each entry from its start, with room for the delayed task
+    struct render_plan *plans[2];
+    float *model[2][CHANNEL_COUNT];
+    bool clear[2][CHANNEL_COUNT];
+    uint32_t length = PLAYLIST_FIRST + 8;
+    for (uint8_t k = 0; k < 2; k++)
+    {
+        struct simulation_parameters p;
+        read_simulation(entries[k].simulation, &p);
+        const struct simulation_definition *d = p.definition;
+        plans[k] = render_plan_new(d);
+        for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        {
+            model[k][j] = calloc(length, sizeof(float));
+            if (!plans[k] || !model[k][j])
+            {
+                printf("%3u  %-40s  Allocation failure\n", id, params.name);
+                return 1;
+            }
+            clear[k][j] = !d->cloud || !d->outputs[j].cloudy;
+        }
+
+        render_block(plans[k], 0, length, model[k]);
+    }
+
+    hal_reset();
+    if (!playlist_store(PLAYLIST_LOOP, 2, entries) || !playlist_start(0))
+    {
+        printf("%3u  %-40s  Failed to start playlist\n", id, params.name);
+        return 1;
+    }
+
+    // Entry that is loaded, the tick count at which it started, and the
+    // tick count at which the following entry should start
+    uint8_t delay = id % 4;
+    uint8_t loaded = 0;
+    uint32_t start = 0;
+    uint32_t end = PLAYLIST_FIRST;
+    uint16_t switches = 0;
+    double deviation = 0;
+    bool pass = true;
+
+    uint32_t seed = CLOUD_SEED;
+    for (uint32_t t = 1; t <= PLAYLIST_TICKS; t++)
+    {
+        TCNT2 = (uint8_t)xorshift32(&seed);
+        WDT_vect();
+        TIMER0_COMPA_vect();
+
+        uint16_t out[CHANNEL_COUNT] = { OCR1B, OCR1A };
+        for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+            if (clear[loaded][j])
+                deviation = fmax(deviation, fabs(out[j] - model[loaded][j][t - start]));
+
+        // Run the task that the boundary update posted, after the delay
+        if (t == end + delay)
+        {
+            playlist_tick();
+            switches++;
+            loaded ^= 1;
+            start = end;
+            end += entries[loaded].duration;
+            pass &= active_simulation == entries[loaded].simulation;
+        }
+        hal_drain_uart(NULL, 0);
+    }
+
+    pass &= deviation <= tolerance;
+    printf("%3u  %-40s  %4u  %5u  %8.2f  %8u  %s\n", id, params.name, next, delay,
+           deviation, switches, pass ? "PASS" : "FAIL");
+
+    for (uint8_t k = 0; k < 2; k++)
+    {
+        for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+            free(model[k][j]);
+        render_plan_free(plans[k]);
+    }
+
+    return pass ? 0 : 1;
+}
+
+// Render with the specialized update or the generic engine in a child
+// process, so that the cloud generator starts from the same random state.
+// Returns the fastest time per tick of several renders, or a negative value on error
+static double render_forked(uint16_t id, bool use_generic, bool use_handover, struct curve *c)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+        return -1;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        generic = use_generic;
+        handover = use_handover;
+        double best = render(id, c);
+        for (uint8_t i = 1; i < SPECIALIZED_RENDERS; i++)
+        {
+            struct curve discard;
+            best = fmin(best, render(id, &discard));
+        }
+
+        bool written = write(fds[1], c, sizeof(struct curve)) == sizeof(struct curve) &&
+            write(fds[1], &best, sizeof(double)) == sizeof(double);
+        exit(written ? 0 : 1);
+    }
+
+    close(fds[1]);
+    double best = -1;
+    bool read_ok = pid > 0 && read(fds[0], c, sizeof(struct curve)) == sizeof(struct curve) &&
+        read(fds[0], &best, sizeof(double)) == sizeof(double);
+    close(fds[0]);
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) || !read_ok)
+        return -1;
+
+    return best;
+}
+
+// Whether SET_PARAM requests that must be rejected leave the specialized update running
+static bool rejections_keep_update(uint16_t id)
+{
+    hal_reset();
+    select_simulation(id);
+    hal_drain_uart(NULL, 0);
+
+    bool pass = !using_generic_update();
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+    {
+        pass &= !set_parameter(j, ParamLevel, 0, -1);
+        pass &= !set_parameter(j, ParamLevel, 0, OUTPUT_MAX + 1);
+        pass &= !set_parameter(j, ParamCurrent, 0, -1);
+        pass &= !set_parameter(j, ParamAmplitude, MAX_MODES, 1000000);
+        pass &= !set_parameter(j, ParamAmplitude, 0, INT32_MAX);
+        pass &= !set_parameter(j, ParamCloudMaxIntensity + 1, 0, 0);
+    }
+
+    return pass && !using_generic_update();
+}
+
+static int run_specialized(uint16_t id)
+{
+    struct simulation_parameters params;
+    read_simulation(id, &params);
+
+    struct curve fast, reference, switched;
+    double fast_us = render_forked(id, false, false, &fast);
+    double reference_us = render_forked(id, true, false, &reference);
+    double switched_us = render_forked(id, false, true, &switched);
+    if (fast_us < 0 || reference_us < 0 || switched_us < 0)
+    {
+        printf("%3u  %-40s  Render failed\n", id, params.name);
+        return 1;
+    }
+
+    uint16_t mismatches = 0;
+    for (uint16_t i = 0; i < SAMPLE_COUNT; i++)
+        for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+            mismatches += (fast.samples[i][j] != reference.samples[i][j]) +
+                (switched.samples[i][j] != reference.samples[i][j]);
+
+    bool kept = rejections_keep_update(id);
+    bool pass = !mismatches && kept;
+    printf("%3u  %-40s  %10u  %8.3f  %8.3f  %7.2f  %s\n", id, params.name, mismatches,
+           reference_us, fast_us, reference_us / fast_us,
+           pass ? "PASS" : kept ? "FAIL" : "FAIL (rejected change switched engine)");
+
+    return pass ? 0 : 1;
+}
+
+static void receive_byte(uint8_t b)
+{
+    UDR0 = b;
+    USART_RX_vect();
+}
+
+// Deliver a framed packet to the UART, without running the usb task
+static void receive_packet(uint8_t type, const uint8_t *data, uint8_t length)
+{
+    uint8_t checksum = 0;
+    receive_byte('$');
+    receive_byte('$');
+    receive_byte(type);
+    receive_byte(length);
+    for (uint8_t i = 0; i < length; i++)
+    {
+        checksum ^= data[i];
+        receive_byte(data[i]);
+    }
+    receive_byte(checksum);
+    receive_byte('\r');
+    receive_byte('\n');
+}
+
+// Deliver a SYNC beacon to the UART, optionally followed by a stray '\n',
+// and return the state and error from the reply
+static uint8_t send_beacon(uint8_t flags, uint16_t id, int64_t shared, bool noise, int32_t *error)
+{
+    int64_t ticks = shared >= 0 ? shared / TICK_TIMER_COUNTS : -((-shared + TICK_TIMER_COUNTS - 1) / TICK_TIMER_COUNTS);
+    uint8_t data[8] = { flags, (uint8_t)id, (uint8_t)(id >> 8) };
+    uint32_t t = (uint32_t)ticks;
+    memcpy(&data[3], &t, sizeof(t));
+    data[7] = shared - ticks * TICK_TIMER_COUNTS;
+
+    receive_packet('V', data, sizeof(data));
+    if (noise)
+        receive_byte('\n');
+    usb_tick();
+
+    // The reply may follow a SET_MODE notification
+    uint8_t out[256];
+    uint16_t length = hal_drain_uart(out, sizeof(out));
+    for (uint16_t i = 0; i + 13 <= length; i++)
+    {
+        if (out[i] == '$' && out[i + 1] == '$' && out[i + 2] == 'W')
+        {
+            memcpy(error, &out[i + 4], sizeof(*error));
+            return out[i + 12];
+        }
+    }
+
+    return 0xFF;
+}
+
+static int run_sync(uint16_t id)
+{
+    struct simulation_parameters params;
+    read_simulation(id, &params);
+    const struct simulation_definition *d = params.definition;
+
+    uint32_t length = SYNC_BEACONS * SYNC_INTERVAL + 1;
+    struct render_plan *plan = render_plan_new(d);
+    float *model[CHANNEL_COUNT];
+    bool clear[CHANNEL_COUNT];
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+    {
+        model[j] = calloc(length, sizeof(float));
+        if (!plan || !model[j])
+        {
+            printf("%3u  %-40s  Allocation failure\n", id, params.name);
+            return 1;
+        }
+        clear[j] = !d->cloud || !d->outputs[j].cloudy;
+    }
+    render_block(plan, 0, length, model);
+
+    // Device counts per shared count
+    double ppm = SYNC_MAX_PPM * ((id % 5) / 2.0 - 1);
+    double rate = 1 + ppm * 1e-6;
+
+    hal_reset();
+    usb_initialize();
+    select_simulation(id);
+    hal_drain_uart(NULL, 0);
+    OCR0A = TICK_TIMER_COUNTS - 1;
+    TIFR0 = 0;
+
+    // Times are measured in timer counts from the shared epoch, and the
+    // device powers on at an arbitrary point before the first beacon
+    double last_tick = -(SYNC_LEAD + 100) * TICK_TIMER_COUNTS - 123.4 * id;
+    uint16_t beacon = 0;
+    double deviation = 0;
+    int32_t max_error = 0;
+    uint8_t state = 0;
+    bool pass = true;
+
+    uint32_t seed = CLOUD_SEED;
+    while (beacon < SYNC_BEACONS)
+    {
+        int64_t shared = beacon == 0 ? -SYNC_LEAD * TICK_TIMER_COUNTS : (int64_t)(beacon - 1) * SYNC_INTERVAL * TICK_TIMER_COUNTS;
+        double arrival = shared + (beacon == SYNC_DELAYED ? SYNC_DELAY : 0);
+        double next_tick = last_tick + (OCR0A + 1) / rate;
+
+        if (arrival < next_tick)
+        {
+            TCNT0 = (uint8_t)((arrival - last_tick) * rate);
+            int32_t error = 0;
+            state = send_beacon(beacon == 0 ? SYNC_START : 0, id, shared, beacon == SYNC_NOISY, &error);
+            if (beacon == SYNC_DELAYED || beacon == SYNC_NOISY)
+                pass &= state == SYNC_IGNORED;
+            else if (beacon > SYNC_SETTLE)
+            {
+                pass &= state == SYNC_LOCKED;
+                if (abs(error) > abs(max_error))
+                    max_error = error;
+            }
+
+            beacon++;
+            continue;
+        }
+
+        last_tick = next_tick;
+        TCNT0 = 0;
+        TCNT2 = (uint8_t)xorshift32(&seed);
+        WDT_vect();
+        TIMER0_COMPA_vect();
+
+        // The outputs are held until the first update after the shared epoch
+        uint8_t counts;
+        int32_t t = read_tick_count(&counts);
+        if (t <= 0 || t >= (int32_t)length)
+            continue;
+
+        uint16_t out[CHANNEL_COUNT] = { OCR1B, OCR1A };
+        for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+            if (clear[j])
+                deviation = fmax(deviation, fabs(out[j] - model[j][t]));
+    }
+
+    pass &= deviation <= tolerance && abs(max_error) <= SYNC_TOLERANCE;
+    printf("%3u  %-40s  %+6.0f  %9d  %8.2f  %s\n", id, params.name, ppm,
+           max_error, deviation, pass ? "PASS" : "FAIL");
+
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        free(model[j]);
+    render_plan_free(plan);
+
+    return pass ? 0 : 1;
+}
+
+static int run(uint16_t id)
+{
+    if (analytic)
+        return run_analytic(id);
+
+    if (batch)
+        return run_batch(id);
+
+    if (exposures)
+        return run_exposures(id);
+
+    if (playlist)
+        return run_playlist(id);
+
+    if (specialized)
+        return run_specialized(id);
+
+    if (synchronized)
+        return run_sync(id);
+
+    struct simulation_parameters params;
+    read_simulation(id, &params);
+    const char *name = params.name;
+
+    if (overrun_interval && params.definition->cloud)
+    {
+        printf("%3u  %-40s  %8s  %9s  %8s  SKIP\n", id, name, "-", "-", "-");
+        return 0;
+    }
+
+    struct curve rendered;
+    struct result r;
+    r.tick_us = render(id, &rendered);
+
+    if (update)
+    {
+        int ret = write_golden(id, &rendered);
+        printf("%3u  %-40s  %8s  %9s  %8.3f  %s\n", id, name, "-", "-", r.tick_us,
+               ret ? "ERROR" : "UPDATED");
+        return ret;
+    }
+
+    struct curve golden;
+    if (read_golden(id, &golden))
+    {
+        printf("%3u  %-40s  %8s  %9s  %8.3f  ERROR\n", id, name, "-", "-", r.tick_us);
+        return 1;
+    }
+
+    compare(&golden, &rendered, &r);
+    bool pass = r.max_deviation <= tolerance && fabs(r.drift) <= drift_tolerance;
+
+    // Every missed tick must be reported by the firmware
+    uint16_t missed = 0;
+    for (uint16_t t = 0; t < RENDER_TICKS; t++)
+        if (overrun(t))
+            missed++;
+
+    if (stats.tick_overruns != missed)
+    {
+        printf("Expected %u tick overruns, firmware reported %u\n", missed, stats.tick_overruns);
+        pass = false;
+    }
+
+    if (overrun_interval)
+        pass &= check_double_overrun(id);
+    printf("%3u  %-40s  %8u  %9.3f  %8.3f  %s\n", id, name, r.max_deviation,
+           r.drift*TICK_INTERVAL, r.tick_us, pass ? "PASS" : "FAIL");
+
+    return pass ? 0 : 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-u] [-a] [-b] [-e] [-l] [-g] [-s] [-k] [-d golden-dir] [-t tolerance] [-p drift-ticks] [-o interval] [id ...]\n", name);
+    fprintf(stderr, "  -u  rewrite the golden curves instead of comparing against them\n");
+    fprintf(stderr, "  -a  compare eclipse outputs against the analytic reference\n");
+    fprintf(stderr, "  -b  check and benchmark the host batch renderer\n");
+    fprintf(stderr, "  -e  check and benchmark the closed-form exposure means\n");
+    fprintf(stderr, "  -l  check the playlist entry boundaries\n");
+    fprintf(stderr, "  -g  check and benchmark the specialized updates against the generic engine\n");
+    fprintf(stderr, "  -s  check the clock synchronization against drifting crystals\n");
+    fprintf(stderr, "  -k  check the tool's handling of replies from 8-bit id firmware\n");
+    fprintf(stderr, "  -o  simulate an update overrun every interval ticks\n");
+}
+
+// Select a simulation with a SET_MODE of the given length, after a
+// REQUEST_DETAILS that leaves a stale high byte in the packet buffer.
+// Returns the simulation that is then active
+static uint16_t receive_set_mode(uint16_t id, uint8_t length)
+{
+    hal_reset();
+    usb_initialize();
+    select_simulation(3);
+
+    uint8_t stale[2] = { 0, 1 };
+    receive_packet('G', stale, sizeof(stale));
+    usb_tick();
+
+    uint8_t data[2] = { (uint8_t)id, (uint8_t)(id >> 8) };
+    receive_packet('B', data, length);
+    usb_tick();
+    hal_drain_uart(NULL, 0);
+
+    return active_simulation;
+}
+
+// The firmware must accept an 8-bit SET_MODE from older hosts,
+// and ignore one with no id at all
+static int check_legacy_set_mode()
+{
+    bool narrow = receive_set_mode(9, 1) == 9;
+    bool current = receive_set_mode(10, 2) == 10;
+    bool empty = receive_set_mode(9, 0) == 3;
+    printf("%-40s  %s\n", "Firmware legacy SET_MODE", narrow ? "PASS" : "FAIL");
+    printf("%-40s  %s\n", "Firmware current SET_MODE", current ? "PASS" : "FAIL");
+    printf("%-40s  %s\n", "Firmware empty SET_MODE", empty ? "PASS" : "FAIL");
+
+    return narrow && current && empty ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "uabelgskd:t:p:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u': update = true; break;
+            case 'a': analytic = true; break;
+            case 'b': batch = true; break;
+            case 'e': exposures = true; break;
+            case 'l': playlist = true; break;
+            case 'g': specialized = true; break;
+            case 's': synchronized = true; break;
+            case 'k': legacy = true; break;
+            case 'd': golden_dir = optarg; break;
+            case 't': tolerance = atoi(optarg); break;
+            case 'p': drift_tolerance = atof(optarg); break;
+            case 'o': overrun_interval = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (legacy)
+        return check_legacy_packets() | check_legacy_set_mode();
+
+    uint16_t *ids = calloc(simulation_count + argc, sizeof(uint16_t));
+    uint16_t count = 0;
+    if (optind < argc)
+    {
+        for (int i = optind; i < argc; i++)
+        {
+            int id = atoi(argv[i]);
+            if (id <= 0 || id > simulation_count)
+            {
+                fprintf(stderr, "Invalid simulation id: %s\n", argv[i]);
+                return 2;
+            }
+            ids[count++] = id;
+        }
+    }
+    else
+        for (uint16_t i = 1; i <= simulation_count; i++)
+            ids[count++] = i;
+
+    if (batch)
+    {
+        printf("Batch renderer: %s, tolerance %g PWM counts, rates in Msamples/s\n",
+               render_use_simd(true), RENDER_TOLERANCE);
+        printf("%3s  %-40s  %7s  %8s  %7s  %7s  %7s  %s\n", "id", "simulation", "fw dev",
+               "max dev", "libm", "scalar", "simd", "status");
+    }
+    else if (exposures)
+    {
+        printf("Exposure means: %u exposures, tolerance %g PWM counts, %g cloud transparency\n",
+               EXPOSURE_COUNT, EXPOSURE_TOLERANCE, CLOUD_TOLERANCE);
+        printf("%3s  %-40s  %7s  %8s  %9s  %9s  %9s  %s\n", "id", "simulation", "exp (s)",
+               "max dev", "cloud dev", "us/exp", "us/render", "status");
+    }
+    else if (playlist)
+    {
+        printf("Playlist: %u and %u ticks looped for %u ticks, tolerance %u PWM counts\n",
+               PLAYLIST_FIRST, PLAYLIST_SECOND, PLAYLIST_TICKS, tolerance);
+        printf("%3s  %-40s  %4s  %5s  %8s  %8s  %s\n", "id", "simulation", "next", "delay",
+               "max dev", "switches", "status");
+    }
+    else if (specialized)
+    {
+        printf("Specialized updates: fastest of %u renders of %u ticks, times in us/tick\n",
+               SPECIALIZED_RENDERS, RENDER_TICKS);
+        printf("%3s  %-40s  %10s  %8s  %8s  %7s  %s\n", "id", "simulation", "mismatches",
+               "generic", "special", "speedup", "status");
+    }
+    else if (synchronized)
+    {
+        printf("Synchronization: %u beacons every %u ticks, tolerance %u timer counts and %u PWM counts\n",
+               SYNC_BEACONS, SYNC_INTERVAL, SYNC_TOLERANCE, tolerance);
+        printf("%3s  %-40s  %6s  %9s  %8s  %s\n", "id", "simulation", "ppm", "max error", "max dev", "status");
+    }
+    else
+        printf("%3s  %-40s  %8s  %9s  %8s  %s\n", "id", "simulation", "max dev", "drift (s)", "us/tick", "status");
+
+    // Render each simulation in a fresh process so that the cloud generator's
+    // random state is identical regardless of which simulations are selected
+    uint16_t failed = 0;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+            exit(run(ids[i]));
+
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+            failed++;
+    }
+
+    if (failed)
+        printf("%u of %u simulations failed\n", failed, count);
+
+    free(ids);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,906 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+//
+// Bulk light curve rendering for long host-side simulations.
+//
+// A catalog definition is unpacked into a plan that stores the sinusoidal
+// modes and gaussian pulses of every channel in parallel arrays.  Blocks are
+// rendered a chunk of ticks at a time, adding each term across the whole
+// chunk, so that sin and exp are evaluated for eight (AVX2) or four (NEON)
+// ticks at once using polynomial approximations.  The same approximations
+// are used one tick at a time when vector instructions aren't available.
+//
+// Phases advance by the firmware's 32-bit increments and wrap on overflow,
+// so arbitrarily long renders keep their phase exactly.  Ramps, tables and
+// eclipses are cheap and are rendered by plain loops.  The crystal trim and
+// cloud attenuation are not applied.
+//
+// Exposure means are evaluated from the antiderivative of each term, so the
+// cost is independent of the exposure time.  Tables and eclipse profiles are
+// linearly interpolated, so they are integrated exactly from cumulative sums.
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "render.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#   include <immintrin.h>
+#   define HAVE_AVX2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#   include <arm_neon.h>
+#   define HAVE_NEON
+#endif
+
+// Ticks rendered at a time, sized so that both channels stay in the L1 cache
+#define CHUNK_TICKS 1024
+
+// Samples in each tabulated eclipse profile, and the steps used to integrate them
+#define ECLIPSE_PROFILE_SIZE 512
+#define ECLIPSE_PROFILE_STEPS 1000
+
+// Pulses are truncated at the edge of the firmware lookup table
+#define PULSE_LIMIT ((float)GAUSSIAN_TABLE_SIZE / GAUSSIAN_TABLE_SCALE)
+
+// Converts a signed 32-bit phase into radians, or a signed 0.31 pulse offset into cycles
+#define PHASE_RADIANS (2 * M_PI / 4294967296.0)
+#define OFFSET_CYCLES (1 / 2147483648.0)
+
+// Taylor coefficients for sin(y) with |y| <= pi/2 and exp(r) with |r| <= ln(2)/2
+#define S3 (-1.0f / 6)
+#define S5 (1.0f / 120)
+#define S7 (-1.0f / 5040)
+#define S9 (1.0f / 362880)
+#define S11 (-1.0f / 39916800)
+#define E2 (1.0f / 2)
+#define E3 (1.0f / 6)
+#define E4 (1.0f / 24)
+#define E5 (1.0f / 120)
+#define E6 (1.0f / 720)
+#define LOG2E 1.44269504f
+#define LN2_HI 0.693145751953125f
+#define LN2_LO 1.42860677e-06f
+
+typedef void (*sine_kernel)(float *out, uint32_t phase, uint32_t increment, float amplitude, uint32_t count);
+typedef void (*pulse_kernel)(float *out, uint32_t phase, uint32_t increment, uint32_t offset,
+                             float width, float amplitude, uint32_t count);
+
+struct render_eclipse
+{
+    uint32_t offset;
+    uint32_t half_width;
+
+    // Fraction of the flux blocked at evenly spaced times from mid-eclipse to last contact,
+    // and its integral from mid-eclipse to each sample in units of the sample spacing
+    double profile[ECLIPSE_PROFILE_SIZE + 1];
+    double integral[ECLIPSE_PROFILE_SIZE + 1];
+};
+
+struct render_plan
+{
+    sine_kernel sine;
+    pulse_kernel pulse;
+
+    // Sinusoidal modes of every channel, with amplitudes in output units
+    uint32_t sine_count;
+    uint8_t *sine_channel;
+    uint32_t *sine_phase;
+    uint32_t *sine_increment;
+    float *sine_amplitude;
+
+    // Gaussian pulses of every channel.  Widths are the reciprocal
+    // of the pulse width in cycles, and amplitudes are in output units
+    uint32_t pulse_count;
+    uint8_t *pulse_channel;
+    uint32_t *pulse_offset;
+    float *pulse_width;
+    float *pulse_amplitude;
+
+    // Per-channel parameters, in output units
+    enum variability_type type[CHANNEL_COUNT];
+    double level[CHANNEL_COUNT];
+    uint32_t increment[CHANNEL_COUNT];
+
+    // Decoded wavetable samples in output units, and the integral
+    // up to each sample in units of the sample spacing
+    uint8_t table_bits[CHANNEL_COUNT];
+    double *table[CHANNEL_COUNT];
+    double *table_integral[CHANNEL_COUNT];
+
+    uint8_t eclipse_count[CHANNEL_COUNT];
+    struct render_eclipse eclipses[CHANNEL_COUNT][MAX_ECLIPSES];
+};
+
+static bool simd_enabled = true;
+
+// sin(2*pi*x) for a phase x expressed as a signed 32-bit fraction of a cycle
+static inline float sin_cycles(int32_t p)
+{
+    // Reflect phases more than a quarter cycle from zero: sin(pi - y) = sin(y)
+    if ((int32_t)((uint32_t)p + 0x40000000UL) < 0)
+        p = (int32_t)(0x80000000UL - (uint32_t)p);
+
+    float y = p * (float)PHASE_RADIANS;
+    float y2 = y * y;
+    return y * (1 + y2 * (S3 + y2 * (S5 + y2 * (S7 + y2 * (S9 + y2 * S11)))));
+}
+
+// exp(v) for -126 < v <= 0
+static inline float exp_negative(float v)
+{
+    float n = rintf(v * LOG2E);
+    float r = v - n * LN2_HI - n * LN2_LO;
+    float e = 1 + r * (1 + r * (E2 + r * (E3 + r * (E4 + r * (E5 + r * E6)))));
+
+    union { uint32_t i; float f; } scale = { .i = (uint32_t)((int32_t)n + 127) << 23 };
+    return e * scale.f;
+}
+
+static void sine_scalar(float *out, uint32_t phase, uint32_t increment, float amplitude, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++, phase += increment)
+        out[i] += amplitude * sin_cycles((int32_t)phase);
+}
+
+static void pulse_scalar(float *out, uint32_t phase, uint32_t increment, uint32_t offset,
+                         float width, float amplitude, uint32_t count)
+{
+    // Pulses don't wrap around the end of the period
+    float scale = width * (float)OFFSET_CYCLES;
+    for (uint32_t i = 0; i < count; i++, phase += increment)
+    {
+        float x = fabsf((float)(int32_t)((phase >> 1) - (offset >> 1))) * scale;
+        if (x < PULSE_LIMIT)
+            out[i] += amplitude * exp_negative(-x * x);
+    }
+}
+
+#ifdef HAVE_AVX2
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static inline __m256 sin_cycles_avx2(__m256i p)
+{
+    __m256i outer = _mm256_srai_epi32(_mm256_add_epi32(p, _mm256_set1_epi32(0x40000000)), 31);
+    __m256i reflected = _mm256_sub_epi32(_mm256_set1_epi32(INT32_MIN), p);
+    p = _mm256_blendv_epi8(p, reflected, outer);
+
+    __m256 y = _mm256_mul_ps(_mm256_cvtepi32_ps(p), _mm256_set1_ps((float)PHASE_RADIANS));
+    __m256 y2 = _mm256_mul_ps(y, y);
+    __m256 s = _mm256_fmadd_ps(y2, _mm256_set1_ps(S11), _mm256_set1_ps(S9));
+    s = _mm256_fmadd_ps(s, y2, _mm256_set1_ps(S7));
+    s = _mm256_fmadd_ps(s, y2, _mm256_set1_ps(S5));
+    s = _mm256_fmadd_ps(s, y2, _mm256_set1_ps(S3));
+    s = _mm256_fmadd_ps(s, y2, _mm256_set1_ps(1));
+    return _mm256_mul_ps(s, y);
+}
+
+AVX2 static inline __m256 exp_negative_avx2(__m256 v)
+{
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(v, _mm256_set1_ps(LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_HI), v);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_LO), r);
+
+    __m256 e = _mm256_fmadd_ps(r, _mm256_set1_ps(E6), _mm256_set1_ps(E5));
+    e = _mm256_fmadd_ps(e, r, _mm256_set1_ps(E4));
+    e = _mm256_fmadd_ps(e, r, _mm256_set1_ps(E3));
+    e = _mm256_fmadd_ps(e, r, _mm256_set1_ps(E2));
+    e = _mm256_fmadd_ps(e, r, _mm256_set1_ps(1));
+    e = _mm256_fmadd_ps(e, r, _mm256_set1_ps(1));
+
+    __m256i exponent = _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127));
+    return _mm256_mul_ps(e, _mm256_castsi256_ps(_mm256_slli_epi32(exponent, 23)));
+}
+
+// Phases of eight consecutive ticks, and the step to the next eight
+AVX2 static inline __m256i lane_phases_avx2(uint32_t phase, uint32_t increment, __m256i *step)
+{
+    *step = _mm256_set1_epi32((int32_t)(increment * 8));
+    __m256i lanes = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int32_t)increment));
+    return _mm256_add_epi32(_mm256_set1_epi32((int32_t)phase), lanes);
+}
+
+AVX2 static void sine_avx2(float *out, uint32_t phase, uint32_t increment, float amplitude, uint32_t count)
+{
+    __m256i step;
+    __m256i p = lane_phases_avx2(phase, increment, &step);
+    __m256 a = _mm256_set1_ps(amplitude);
+
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 o = _mm256_loadu_ps(out + i);
+        _mm256_storeu_ps(out + i, _mm256_fmadd_ps(a, sin_cycles_avx2(p), o));
+        p = _mm256_add_epi32(p, step);
+    }
+
+    sine_scalar(out + i, phase + increment * i, increment, amplitude, count - i);
+}
+
+AVX2 static void pulse_avx2(float *out, uint32_t phase, uint32_t increment, uint32_t offset,
+                            float width, float amplitude, uint32_t count)
+{
+    __m256i step;
+    __m256i p = lane_phases_avx2(phase, increment, &step);
+    __m256i center = _mm256_set1_epi32((int32_t)(offset >> 1));
+    __m256 scale = _mm256_set1_ps(width * (float)OFFSET_CYCLES);
+    __m256 limit = _mm256_set1_ps(PULSE_LIMIT);
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 a = _mm256_set1_ps(amplitude);
+
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i d = _mm256_sub_epi32(_mm256_srli_epi32(p, 1), center);
+        __m256 x = _mm256_mul_ps(_mm256_andnot_ps(sign, _mm256_cvtepi32_ps(d)), scale);
+        __m256 e = exp_negative_avx2(_mm256_mul_ps(_mm256_xor_ps(x, sign), x));
+        e = _mm256_and_ps(e, _mm256_cmp_ps(x, limit, _CMP_LT_OQ));
+
+        __m256 o = _mm256_loadu_ps(out + i);
+        _mm256_storeu_ps(out + i, _mm256_fmadd_ps(a, e, o));
+        p = _mm256_add_epi32(p, step);
+    }
+
+    pulse_scalar(out + i, phase + increment * i, increment, offset, width, amplitude, count - i);
+}
+#endif
+
+#ifdef HAVE_NEON
+static inline float32x4_t sin_cycles_neon(int32x4_t p)
+{
+    uint32x4_t outer = vcltq_s32(vaddq_s32(p, vdupq_n_s32(0x40000000)), vdupq_n_s32(0));
+    int32x4_t reflected = vsubq_s32(vdupq_n_s32(INT32_MIN), p);
+    p = vbslq_s32(outer, reflected, p);
+
+    float32x4_t y = vmulq_n_f32(vcvtq_f32_s32(p), (float)PHASE_RADIANS);
+    float32x4_t y2 = vmulq_f32(y, y);
+    float32x4_t s = vfmaq_f32(vdupq_n_f32(S9), y2, vdupq_n_f32(S11));
+    s = vfmaq_f32(vdupq_n_f32(S7), s, y2);
+    s = vfmaq_f32(vdupq_n_f32(S5), s, y2);
+    s = vfmaq_f32(vdupq_n_f32(S3), s, y2);
+    s = vfmaq_f32(vdupq_n_f32(1), s, y2);
+    return vmulq_f32(s, y);
+}
+
+static inline float32x4_t exp_negative_neon(float32x4_t v)
+{
+    float32x4_t n = vrndnq_f32(vmulq_n_f32(v, LOG2E));
+    float32x4_t r = vfmsq_f32(v, n, vdupq_n_f32(LN2_HI));
+    r = vfmsq_f32(r, n, vdupq_n_f32(LN2_LO));
+
+    float32x4_t e = vfmaq_f32(vdupq_n_f32(E5), r, vdupq_n_f32(E6));
+    e = vfmaq_f32(vdupq_n_f32(E4), e, r);
+    e = vfmaq_f32(vdupq_n_f32(E3), e, r);
+    e = vfmaq_f32(vdupq_n_f32(E2), e, r);
+    e = vfmaq_f32(vdupq_n_f32(1), e, r);
+    e = vfmaq_f32(vdupq_n_f32(1), e, r);
+
+    int32x4_t exponent = vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127));
+    return vmulq_f32(e, vreinterpretq_f32_s32(vshlq_n_s32(exponent, 23)));
+}
+
+// Phases of four consecutive ticks, and the step to the next four
+static inline uint32x4_t lane_phases_neon(uint32_t phase, uint32_t increment, uint32x4_t *step)
+{
+    static const uint32_t lanes[4] = { 0, 1, 2, 3 };
+    *step = vdupq_n_u32(increment * 4);
+    return vmlaq_n_u32(vdupq_n_u32(phase), vld1q_u32(lanes), increment);
+}
+
+static void sine_neon(float *out, uint32_t phase, uint32_t increment, float amplitude, uint32_t count)
+{
+    uint32x4_t step;
+    uint32x4_t p = lane_phases_neon(phase, increment, &step);
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t s = sin_cycles_neon(vreinterpretq_s32_u32(p));
+        vst1q_f32(out + i, vfmaq_n_f32(vld1q_f32(out + i), s, amplitude));
+        p = vaddq_u32(p, step);
+    }
+
+    sine_scalar(out + i, phase + increment * i, increment, amplitude, count - i);
+}
+
+static void pulse_neon(float *out, uint32_t phase, uint32_t increment, uint32_t offset,
+                       float width, float amplitude, uint32_t count)
+{
+    uint32x4_t step;
+    uint32x4_t p = lane_phases_neon(phase, increment, &step);
+    uint32x4_t center = vdupq_n_u32(offset >> 1);
+    float scale = width * (float)OFFSET_CYCLES;
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        int32x4_t d = vreinterpretq_s32_u32(vsubq_u32(vshrq_n_u32(p, 1), center));
+        float32x4_t x = vmulq_n_f32(vabsq_f32(vcvtq_f32_s32(d)), scale);
+        float32x4_t e = exp_negative_neon(vnegq_f32(vmulq_f32(x, x)));
+        uint32x4_t inside = vcltq_f32(x, vdupq_n_f32(PULSE_LIMIT));
+        e = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(e), inside));
+
+        vst1q_f32(out + i, vfmaq_n_f32(vld1q_f32(out + i), e, amplitude));
+        p = vaddq_u32(p, step);
+    }
+
+    pulse_scalar(out + i, phase + increment * i, increment, offset, width, amplitude, count - i);
+}
+#endif
+
+const char *render_use_simd(bool enabled)
+{
+    simd_enabled = enabled;
+#if defined(HAVE_AVX2)
+    __builtin_cpu_init();
+    if (enabled && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return "avx2";
+#elif defined(HAVE_NEON)
+    if (enabled)
+        return "neon";
+#endif
+    return "scalar";
+}
+
+// Area of overlap between circles of radius r and k with centers separated by z
+static double overlap_area(double r, double k, double z)
+{
+    if (z >= r + k)
+        return 0;
+
+    if (z <= fabs(r - k))
+        return M_PI * fmin(r, k) * fmin(r, k);
+
+    double a = acos((z*z + r*r - k*k) / (2*z*r));
+    double b = acos((z*z + k*k - r*r) / (2*z*k));
+    double c = sqrt((-z + r + k) * (z + r - k) * (z - r + k) * (z + r + k));
+    return r*r*a + k*k*b - c/2;
+}
+
+// Writing the intensity as I(mu), with mu = sqrt(1 - r^2), the blocked flux is
+// I(0) A(1) + integral_0^1 A(r(mu)) dI/dmu dmu, where A(r) is the area of
+// the disk that overlaps the central region of radius r.
+double render_eclipse_blocked(double k, double z, double u1, double u2, int steps)
+{
+    double flux = (1 - u1 - u2) * overlap_area(1, k, z);
+    double dmu = 1.0 / steps;
+    for (int i = 0; i < steps; i++)
+    {
+        double mu = (i + 0.5) * dmu;
+        flux += overlap_area(sqrt(1 - mu*mu), k, z) * (u1 + 2*u2*(1 - mu)) * dmu;
+    }
+
+    return flux / (M_PI * (1 - u1/3 - u2/6));
+}
+
+static void load_eclipse(struct render_eclipse *e, const struct eclipse_definition *d)
+{
+    e->offset = d->offset;
+    e->half_width = d->half_width;
+
+    double k = d->radius / 32768.0;
+    double b = d->impact / 32768.0;
+    double chord = (1 + k) * (1 + k) - b * b;
+    for (int i = 0; i <= ECLIPSE_PROFILE_SIZE; i++)
+    {
+        double x = (double)i / ECLIPSE_PROFILE_SIZE;
+        e->profile[i] = render_eclipse_blocked(k, sqrt(b * b + x * x * chord),
+                                               d->u1 / 16384.0, d->u2 / 16384.0, ECLIPSE_PROFILE_STEPS);
+    }
+
+    e->integral[0] = 0;
+    for (int i = 0; i < ECLIPSE_PROFILE_SIZE; i++)
+        e->integral[i + 1] = e->integral[i] + (e->profile[i] + e->profile[i + 1]) / 2;
+}
+
+// Decode the zigzag varint delta stream into samples in output units
+static double *load_table(const uint8_t *data, uint8_t bits)
+{
+    uint16_t count = (uint16_t)1 << bits;
+    double *table = calloc(count, sizeof(double));
+    if (!table)
+        return NULL;
+
+    int32_t value = 0;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        uint16_t encoded = 0;
+        uint8_t shift = 0;
+        uint8_t b;
+        do
+        {
+            b = *data++;
+            encoded |= (uint16_t)(b & 0x7F) << shift;
+            shift += 7;
+        } while (b & 0x80);
+
+        value += (encoded >> 1) ^ -(int16_t)(encoded & 1);
+        table[i] = value << WAVETABLE_SHIFT;
+    }
+
+    return table;
+}
+
+struct render_plan *render_plan_new(const struct simulation_definition *d)
+{
+    struct render_plan *plan = calloc(1, sizeof(struct render_plan));
+    if (!plan)
+        return NULL;
+
+    plan->sine = sine_scalar;
+    plan->pulse = pulse_scalar;
+    const char *isa = render_use_simd(simd_enabled);
+#if defined(HAVE_AVX2)
+    if (strcmp(isa, "avx2") == 0)
+    {
+        plan->sine = sine_avx2;
+        plan->pulse = pulse_avx2;
+    }
+#elif defined(HAVE_NEON)
+    if (strcmp(isa, "neon") == 0)
+    {
+        plan->sine = sine_neon;
+        plan->pulse = pulse_neon;
+    }
+#endif
+
+    uint32_t sines = 0, pulses = 0;
+    for (uint8_t c = 0; c < CHANNEL_COUNT; c++)
+    {
+        if (d->outputs[c].type == Sinusoidal)
+            sines += d->outputs[c].mode_count;
+        if (d->outputs[c].type == Gaussian)
+            pulses += d->outputs[c].mode_count;
+    }
+
+    plan->sine_channel = calloc(sines + 1, sizeof(uint8_t));
+    plan->sine_phase = calloc(sines + 1, sizeof(uint32_t));
+    plan->sine_increment = calloc(sines + 1, sizeof(uint32_t));
+    plan->sine_amplitude = calloc(sines + 1, sizeof(float));
+    plan->pulse_channel = calloc(pulses + 1, sizeof(uint8_t));
+    plan->pulse_offset = calloc(pulses + 1, sizeof(uint32_t));
+    plan->pulse_width = calloc(pulses + 1, sizeof(float));
+    plan->pulse_amplitude = calloc(pulses + 1, sizeof(float));
+    if (!plan->sine_channel || !plan->sine_phase || !plan->sine_increment || !plan->sine_amplitude ||
+        !plan->pulse_channel || !plan->pulse_offset || !plan->pulse_width || !plan->pulse_amplitude)
+        goto error;
+
+    for (uint8_t c = 0; c < CHANNEL_COUNT; c++)
+    {
+        const struct output_definition *o = &d->outputs[c];
+        plan->type[c] = o->type;
+        plan->level[c] = o->level;
+        plan->increment[c] = o->increment;
+
+        switch (o->type)
+        {
+            case Sinusoidal:
+                for (uint8_t j = 0; j < o->mode_count; j++)
+                {
+                    const struct sinusoid *m = (const struct sinusoid *)o->modes + j;
+                    uint32_t k = plan->sine_count++;
+                    plan->sine_channel[k] = c;
+                    plan->sine_phase[k] = m->phase;
+                    plan->sine_increment[k] = m->increment;
+                    plan->sine_amplitude[k] = m->amplitude;
+                }
+                break;
+            case Gaussian:
+                for (uint8_t j = 0; j < o->mode_count; j++)
+                {
+                    const struct gaussian *g = (const struct gaussian *)o->modes + j;
+                    uint32_t k = plan->pulse_count++;
+                    plan->pulse_channel[k] = c;
+                    plan->pulse_offset[k] = g->offset;
+                    plan->pulse_width[k] = g->inverse_width / 256.0f;
+                    plan->pulse_amplitude[k] = g->amplitude;
+                }
+                break;
+            case Table:
+                plan->table_bits[c] = o->mode_count;
+                plan->table[c] = load_table(o->modes, o->mode_count);
+                plan->table_integral[c] = calloc(((size_t)1 << o->mode_count) + 1, sizeof(double));
+                if (!plan->table[c] || !plan->table_integral[c])
+                    goto error;
+
+                // The last sample interpolates towards the first
+                for (uint32_t i = 0, count = (uint32_t)1 << o->mode_count; i < count; i++)
+                    plan->table_integral[c][i + 1] = plan->table_integral[c][i] +
+                        (plan->table[c][i] + plan->table[c][(i + 1) & (count - 1)]) / 2;
+                break;
+            case Eclipse:
+                plan->eclipse_count[c] = o->mode_count;
+                for (uint8_t j = 0; j < o->mode_count; j++)
+                    load_eclipse(&plan->eclipses[c][j], (const struct eclipse_definition *)o->modes + j);
+                break;
+            case Constant:
+            case Ramp:
+                break;
+        }
+    }
+
+    return plan;
+
+error:
+    render_plan_free(plan);
+    return NULL;
+}
+
+void render_plan_free(struct render_plan *plan)
+{
+    free(plan->sine_channel);
+    free(plan->sine_phase);
+    free(plan->sine_increment);
+    free(plan->sine_amplitude);
+    free(plan->pulse_channel);
+    free(plan->pulse_offset);
+    free(plan->pulse_width);
+    free(plan->pulse_amplitude);
+    for (uint8_t c = 0; c < CHANNEL_COUNT; c++)
+    {
+        free(plan->table[c]);
+        free(plan->table_integral[c]);
+    }
+    free(plan);
+}
+
+double render_random(uint64_t *state)
+{
+    // splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return ((z ^ (z >> 31)) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void render_cloud_init(struct render_cloud *cloud, const struct cloud_parameters *parameters, uint64_t seed)
+{
+    cloud->parameters = *parameters;
+    cloud->random = seed;
+    for (uint8_t i = 0; i < 4; i++)
+        cloud->points[i] = (double)parameters->initial_intensity / CLOUD_UNITY;
+
+    // The first update generates a control point, as in the firmware
+    cloud->start = 0;
+    cloud->position = 0;
+    cloud->period = 0;
+}
+
+// Generate the next control point and move to the following segment
+static void cloud_advance(struct render_cloud *cloud)
+{
+    // Weight the new control point heavily towards the previous point
+    const struct cloud_parameters *p = &cloud->parameters;
+    double range = p->max_intensity - p->min_intensity;
+    double next = (p->min_intensity + range * render_random(&cloud->random)) / CLOUD_UNITY;
+    memmove(cloud->points, cloud->points + 1, 3 * sizeof(double));
+    cloud->points[3] = (2 * cloud->points[2] + next) / 3;
+
+    cloud->start += cloud->period;
+    cloud->position -= cloud->period;
+    double period = p->min_period + (double)(p->max_period - p->min_period) * render_random(&cloud->random);
+    cloud->period = period / CLOUD_TICK;
+}
+
+void render_cloud_block(struct render_cloud *cloud, uint32_t count, float *out)
+{
+    const double *points = cloud->points;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        cloud->position += 1;
+        if (cloud->position > cloud->period)
+            cloud_advance(cloud);
+
+        // Evaluate the catmull-rom spline
+        double t = cloud->position / cloud->period;
+        double value = (3*points[1] - 3*points[2] + points[3] - points[0]) * t;
+        value = ((2*points[0] - 5*points[1] + 4*points[2] - points[3]) + value) * t;
+        value = ((points[2] - points[0]) + value) * t;
+        value = points[1] + value / 2;
+        out[i] = value < 0 ? 0 : value;
+    }
+}
+
+// Integral of the catmull-rom spline of the current segment from 0 to t
+static double cloud_integral(const double *points, double t)
+{
+    double value = (3*points[1] - 3*points[2] + points[3] - points[0]) * t / 4;
+    value = ((2*points[0] - 5*points[1] + 4*points[2] - points[3]) / 3 + value) * t;
+    value = ((points[2] - points[0]) / 2 + value) * t;
+    return (points[1] + value / 2) * t;
+}
+
+double render_cloud_mean(struct render_cloud *cloud, double start, double length)
+{
+    // Output n is the spline evaluated n + 1 updates after initialization
+    double from = start + 0.5;
+    double to = from + length;
+    double sum = 0;
+    while (from < to)
+    {
+        double end = cloud->start + cloud->period;
+        if (from >= end)
+        {
+            cloud_advance(cloud);
+            continue;
+        }
+
+        double until = to < end ? to : end;
+        sum += (cloud_integral(cloud->points, (until - cloud->start) / cloud->period) -
+                cloud_integral(cloud->points, (from - cloud->start) / cloud->period)) * cloud->period;
+        from = until;
+    }
+
+    return sum / length;
+}
+
+// Intensity of a ramp, table or eclipse output, in output units
+static double channel_level(const struct render_plan *plan, uint8_t c, uint32_t phase)
+{
+    double level = plan->level[c];
+    switch (plan->type[c])
+    {
+        case Ramp:
+            return level * phase / 4294967296.0;
+        case Table:
+        {
+            uint8_t bits = plan->table_bits[c];
+            uint32_t index = phase >> (32 - bits);
+            uint32_t next = (index + 1) & (((uint32_t)1 << bits) - 1);
+            double frac = (uint32_t)(phase << bits) / 4294967296.0;
+            return plan->table[c][index] + (plan->table[c][next] - plan->table[c][index]) * frac;
+        }
+        case Eclipse:
+        {
+            // Eclipses may straddle the start of the period
+            double blocked = 0;
+            for (uint8_t j = 0; j < plan->eclipse_count[c]; j++)
+            {
+                const struct render_eclipse *e = &plan->eclipses[c][j];
+                int32_t offset = phase - e->offset;
+                uint32_t distance = offset < 0 ? -(uint32_t)offset : (uint32_t)offset;
+                if (distance >= e->half_width)
+                    continue;
+
+                double x = (double)distance / e->half_width * ECLIPSE_PROFILE_SIZE;
+                uint16_t i = (uint16_t)x;
+                blocked += e->profile[i] + (e->profile[i + 1] - e->profile[i]) * (x - i);
+            }
+
+            return level * (1 - fmin(blocked, 1));
+        }
+        case Gaussian:
+            return 0;
+        default:
+            return level;
+    }
+}
+
+// Sum of the gaussian pulses of channel c, in output units
+static double pulse_level(const struct render_plan *plan, uint8_t c, uint32_t phase)
+{
+    double level = 0;
+    for (uint32_t k = 0; k < plan->pulse_count; k++)
+    {
+        if (plan->pulse_channel[k] != c)
+            continue;
+
+        int32_t offset = (phase >> 1) - (plan->pulse_offset[k] >> 1);
+        double x = fabs(offset * OFFSET_CYCLES) * plan->pulse_width[k];
+        if (x < PULSE_LIMIT)
+            level += plan->pulse_amplitude[k] * exp(-x * x);
+    }
+
+    return level;
+}
+
+// Clamp to the PWM range and convert from output units to PWM counts
+static float pwm_counts(double level)
+{
+    if (level < 0)
+        level = 0;
+    if (level > OUTPUT_MAX)
+        level = OUTPUT_MAX;
+    return level / (1 << OUTPUT_SHIFT);
+}
+
+void render_block(const struct render_plan *plan, uint64_t first, uint32_t count, float *out[CHANNEL_COUNT])
+{
+    for (uint32_t done = 0; done < count; done += CHUNK_TICKS)
+    {
+        uint32_t n = count - done < CHUNK_TICKS ? count - done : CHUNK_TICKS;
+
+        // Phases repeat every 2^32 updates
+        uint32_t update = (uint32_t)(first + done);
+
+        float *o[CHANNEL_COUNT];
+        for (uint8_t c = 0; c < CHANNEL_COUNT; c++)
+        {
+            o[c] = out[c] + done;
+            enum variability_type type = plan->type[c];
+            if (type == Constant || type == Sinusoidal || type == Gaussian)
+            {
+                float level = type == Gaussian ? 0 : plan->level[c];
+                for (uint32_t i = 0; i < n; i++)
+                    o[c][i] = level;
+            }
+            else
+                for (uint32_t i = 0; i < n; i++)
+                    o[c][i] = channel_level(plan, c, plan->increment[c] * (update + i));
+        }
+
+        for (uint32_t k = 0; k < plan->sine_count; k++)
+        {
+            uint32_t increment = plan->sine_increment[k];
+            plan->sine(o[plan->sine_channel[k]], plan->sine_phase[k] + increment * update,
+                       increment, plan->sine_amplitude[k], n);
+        }
+
+        for (uint32_t k = 0; k < plan->pulse_count; k++)
+        {
+            uint8_t c = plan->pulse_channel[k];
+            uint32_t increment = plan->increment[c];
+            plan->pulse(o[c], increment * update, increment, plan->pulse_offset[k],
+                        plan->pulse_width[k], plan->pulse_amplitude[k], n);
+        }
+
+        // Clamp to the PWM range and convert to PWM counts
+        for (uint8_t c = 0; c < CHANNEL_COUNT; c++)
+        {
+            for (uint32_t i = 0; i < n; i++)
+            {
+                float v = o[c][i] < 0 ? 0 : o[c][i];
+                v = v > OUTPUT_MAX ? OUTPUT_MAX : v;
+                o[c][i] = v * (1.0f / (1 << OUTPUT_SHIFT));
+            }
+        }
+    }
+}
+
+void render_block_reference(const struct render_plan *plan, uint64_t first, uint32_t count, float *out[CHANNEL_COUNT])
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t update = (uint32_t)(first + i);
+        for (uint8_t c = 0; c < CHANNEL_COUNT; c++)
+        {
+            uint32_t phase = plan->increment[c] * update;
+            double level = channel_level(plan, c, phase);
+
+            for (uint32_t k = 0; k < plan->sine_count; k++)
+            {
+                if (plan->sine_channel[k] != c)
+                    continue;
+
+                int32_t p = plan->sine_phase[k] + plan->sine_increment[k] * update;
+                level += plan->sine_amplitude[k] * sin(p * PHASE_RADIANS);
+            }
+
+            out[c][i] = pwm_counts(level + pulse_level(plan, c, phase));
+        }
+    }
+}
+
+// Integral of a linearly interpolated eclipse profile from mid-eclipse
+// to a distance d cycles, for an eclipse lasting 2h cycles
+static double eclipse_integral(const struct render_eclipse *e, double h, double d)
+{
+    double x = d / h * ECLIPSE_PROFILE_SIZE;
+    if (x >= ECLIPSE_PROFILE_SIZE)
+        return e->integral[ECLIPSE_PROFILE_SIZE] * h / ECLIPSE_PROFILE_SIZE;
+
+    uint16_t i = (uint16_t)x;
+    double s = x - i;
+    double partial = e->profile[i] * s + (e->profile[i + 1] - e->profile[i]) * s * s / 2;
+    return (e->integral[i] + partial) * h / ECLIPSE_PROFILE_SIZE;
+}
+
+// Integral of the base level and pulses of channel c from phase 0 to x cycles,
+// in output units multiplied by cycles
+static double channel_integral(const struct render_plan *plan, uint8_t c, double x)
+{
+    double cycles = floor(x);
+    double u = x - cycles;
+    double level = plan->level[c];
+    switch (plan->type[c])
+    {
+        case Ramp:
+            return level * (cycles + u * u) / 2;
+        case Table:
+        {
+            uint32_t count = (uint32_t)1 << plan->table_bits[c];
+            const double *table = plan->table[c];
+            const double *integral = plan->table_integral[c];
+            double s = u * count;
+            uint32_t i = (uint32_t)s;
+            if (i >= count)
+                i = count - 1;
+            s -= i;
+
+            double a = table[i], b = table[(i + 1) & (count - 1)];
+            return (cycles * integral[count] + integral[i] + a * s + (b - a) * s * s / 2) / count;
+        }
+        case Eclipse:
+        {
+            // Each eclipse is integrated from half a cycle before its midpoint
+            double blocked = 0;
+            for (uint8_t j = 0; j < plan->eclipse_count[c]; j++)
+            {
+                const struct render_eclipse *e = &plan->eclipses[c][j];
+                double h = e->half_width / 4294967296.0;
+                double y = x - e->offset / 4294967296.0;
+                double n = floor(y + 0.5);
+                double r = y - n;
+                blocked += 2 * n * eclipse_integral(e, h, h) + copysign(eclipse_integral(e, h, fabs(r)), r);
+            }
+
+            return level * (x - blocked);
+        }
+        case Gaussian:
+        {
+            // Pulses are truncated at PULSE_LIMIT widths and don't wrap around the end of the period
+            double sum = 0;
+            for (uint32_t k = 0; k < plan->pulse_count; k++)
+            {
+                if (plan->pulse_channel[k] != c)
+                    continue;
+
+                double w = plan->pulse_width[k];
+                double o = plan->pulse_offset[k] / 4294967296.0;
+                double first = erf(fmax(-w * o, -PULSE_LIMIT));
+                double last = erf(fmin(w * (1 - o), PULSE_LIMIT));
+                double partial = erf(fmax(fmin(w * (u - o), PULSE_LIMIT), -PULSE_LIMIT));
+                sum += plan->pulse_amplitude[k] * sqrt(M_PI) / (2 * w) * (cycles * (last - first) + partial - first);
+            }
+
+            return sum;
+        }
+        default:
+            return level * x;
+    }
+}
+
+// Phase in cycles after a fractional number of updates
+static double phase_cycles(uint32_t phase, uint32_t increment, double update)
+{
+    double whole = floor(update);
+    phase += increment * (uint32_t)(int64_t)fmod(whole, 4294967296.0);
+    return (phase + increment * (update - whole)) / 4294967296.0;
+}
+
+void render_exposure(const struct render_plan *plan, double start, double length, double out[CHANNEL_COUNT])
+{
+    // The output held from update n to n + 1 is the model evaluated at update n,
+    // so the exposure is centered on the continuous model half an update earlier
+    start -= 0.5;
+
+    for (uint8_t c = 0; c < CHANNEL_COUNT; c++)
+    {
+        uint32_t increment = plan->increment[c];
+        if (increment == 0)
+            out[c] = channel_level(plan, c, 0) + pulse_level(plan, c, 0);
+        else
+        {
+            double x = phase_cycles(0, increment, start);
+            double cycles = increment / 4294967296.0 * length;
+            out[c] = (channel_integral(plan, c, x + cycles) - channel_integral(plan, c, x)) / cycles;
+        }
+    }
+
+    // Mean of a*sin(theta) over [theta, theta + delta] is a*sin(theta + delta/2)*sinc(delta/2)
+    for (uint32_t k = 0; k < plan->sine_count; k++)
+    {
+        double theta = 2 * M_PI * phase_cycles(plan->sine_phase[k], plan->sine_increment[k], start);
+        double half = M_PI * plan->sine_increment[k] / 4294967296.0 * length;
+        double sinc = half > 0 ? sin(half) / half : 1;
+        out[plan->sine_channel[k]] += plan->sine_amplitude[k] * sin(theta + half) * sinc;
+    }
+
+    for (uint8_t c = 0; c < CHANNEL_COUNT; c++)
+        out[c] /= 1 << OUTPUT_SHIFT;
+}
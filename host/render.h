@@ -0,0 +1,84 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef LIGHTBOX_HOST_RENDER_H
+#define LIGHTBOX_HOST_RENDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "main.h"
+
+// Largest difference between render_block and render_block_reference, in PWM counts
+#define RENDER_TOLERANCE 0.01
+
+struct render_plan;
+
+// Unpack a catalog definition for bulk rendering.
+// Returns NULL if memory can't be allocated.  Plans are never modified
+// after they are created, so may be shared between threads
+struct render_plan *render_plan_new(const struct simulation_definition *d);
+void render_plan_free(struct render_plan *plan);
+
+// Render the clear-sky intensity of each channel after updates
+// first .. first + count - 1, in PWM counts.  out[i] must hold count values
+void render_block(const struct render_plan *plan, uint64_t first, uint32_t count, float *out[CHANNEL_COUNT]);
+
+// As render_block, but evaluating every term with libm in double precision
+void render_block_reference(const struct render_plan *plan, uint64_t first, uint32_t count, float *out[CHANNEL_COUNT]);
+
+// Choose whether render_block may use vector instructions (default true)
+// and return the name of the instruction set that it will use
+const char *render_use_simd(bool enabled);
+
+// Host model of the cloud generator.  The firmware draws its random numbers
+// from the watchdog clock jitter, which is replaced here by a seeded sequence
+struct render_cloud
+{
+    struct cloud_parameters parameters;
+    uint64_t random;
+
+    // Transparency at the last four control points, as fractions of unity.
+    // The current segment runs from points[1] to points[2]
+    double points[4];
+
+    // Ticks from initialization to points[1], since points[1], and between points[1] and points[2]
+    double start;
+    double position;
+    double period;
+};
+
+void render_cloud_init(struct render_cloud *cloud, const struct cloud_parameters *parameters, uint64_t seed);
+
+// Advance by count updates, storing the transparency after each
+void render_cloud_block(struct render_cloud *cloud, uint32_t count, float *out);
+
+// Mean transparency over an exposure of length updates, starting start updates
+// after initialization, using the analytic integral of the spline.  Output n of
+// render_cloud_block is held from update n to n + 1, and the two functions give
+// the same realization for a given seed.  Exposures must not start before the
+// previous one, and can't be mixed with render_cloud_block on the same cloud.
+// The spline is not clamped at zero transparency, and length must be positive
+double render_cloud_mean(struct render_cloud *cloud, double start, double length);
+
+// Mean clear-sky intensity of each channel in PWM counts over an exposure of
+// length updates, starting start updates after update 0.  The output after
+// each update is held until the next, and start may be fractional or beyond
+// the 2^32 update phase cycle.  The sinusoids, pulses, ramps, tables and
+// eclipses are integrated in closed form, treating the held output as the
+// continuous model delayed by half an update, and the result is not clamped
+// to the PWM range.  length must be positive
+void render_exposure(const struct render_plan *plan, double start, double length, double out[CHANNEL_COUNT]);
+
+// Uniformly distributed random numbers in [0, 1) from a 64-bit state
+double render_random(uint64_t *state);
+
+// Fraction of the light from a star with quadratic limb darkening that is
+// blocked by a disk of radius k at separation z, integrated in the given
+// number of steps over the limb darkening profile
+double render_eclipse_blocked(double k, double z, double u1, double u2, int steps);
+
+#endif
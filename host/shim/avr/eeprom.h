@@ -0,0 +1,24 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+// EEPROM accessors backed by a RAM array in hal.c.
+
+#ifndef LIGHTBOX_SHIM_AVR_EEPROM_H
+#define LIGHTBOX_SHIM_AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <avr/io.h>
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+void eeprom_update_byte(uint8_t *addr, uint8_t value);
+uint16_t eeprom_read_word(const uint16_t *addr);
+void eeprom_update_word(uint16_t *addr, uint16_t value);
+void eeprom_read_block(void *dst, const void *addr, size_t length);
+void eeprom_update_block(const void *src, void *addr, size_t length);
+
+#endif
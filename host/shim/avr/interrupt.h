@@ -0,0 +1,29 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+// Interrupt service routines become ordinary functions that the host
+// harness calls directly to simulate the corresponding hardware event.
+
+#ifndef LIGHTBOX_SHIM_AVR_INTERRUPT_H
+#define LIGHTBOX_SHIM_AVR_INTERRUPT_H
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+
+void TIMER0_COMPA_vect(void);
+void WDT_vect(void);
+void USART_UDRE_vect(void);
+void USART_RX_vect(void);
+
+uint8_t shim_irq_save(void);
+void shim_irq_restore(uint8_t state);
+void sei(void);
+void cli(void);
+
+#endif
@@ -0,0 +1,67 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+// Host stand-in for the avr-libc register definitions.
+// Each special function register is a plain variable (defined in hal.c) so
+// that the firmware sources can be compiled and exercised on a PC.
+
+#ifndef LIGHTBOX_SHIM_AVR_IO_H
+#define LIGHTBOX_SHIM_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+// Ports
+extern volatile uint8_t DDRB, DDRC, DDRD;
+extern volatile uint8_t PORTB, PORTC, PORTD;
+
+// Timer0
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, TIMSK0, TIFR0;
+#define WGM00 0
+#define WGM01 1
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define TOIE0 0
+#define OCIE0A 1
+#define TOV0 0
+#define OCF0A 1
+
+// Timer1
+extern volatile uint8_t TCCR1A, TCCR1B;
+extern volatile uint16_t TCNT1, OCR1A, OCR1B;
+#define WGM10 0
+#define WGM11 1
+#define COM1B1 5
+#define COM1A1 7
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+
+// Timer2
+extern volatile uint8_t TCCR2B, TCNT2;
+#define CS20 0
+
+// Watchdog
+extern volatile uint8_t MCUSR, WDTCSR;
+#define WDE 3
+#define WDCE 4
+#define WDIE 6
+
+// USART0
+extern volatile uint8_t UBRR0H, UBRR0L, UCSR0A, UCSR0B, UDR0;
+#define U2X0 1
+#define DOR0 3
+#define UDRE0 5
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define RXCIE0 7
+
+#endif
@@ -0,0 +1,21 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+// Sleeping waits for the next interrupt signal (see hal.c)
+
+#ifndef LIGHTBOX_SHIM_AVR_SLEEP_H
+#define LIGHTBOX_SHIM_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE 0
+
+#define set_sleep_mode(mode) ((void)(mode))
+#define sleep_disable()
+
+void sleep_enable(void);
+void sleep_cpu(void);
+
+#endif
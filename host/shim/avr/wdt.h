@@ -0,0 +1,11 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef LIGHTBOX_SHIM_AVR_WDT_H
+#define LIGHTBOX_SHIM_AVR_WDT_H
+
+#endif
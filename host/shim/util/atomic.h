@@ -0,0 +1,21 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef LIGHTBOX_SHIM_UTIL_ATOMIC_H
+#define LIGHTBOX_SHIM_UTIL_ATOMIC_H
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#define ATOMIC_BLOCK(type) \
+    for (uint8_t shim_state = shim_irq_save(), shim_todo = 1; shim_todo; \
+         shim_irq_restore(shim_state), shim_todo = 0)
+
+#endif
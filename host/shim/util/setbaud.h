@@ -0,0 +1,13 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+// Baud rate register values are irrelevant on the host.
+// No include guard: avr-libc allows this header to be included repeatedly.
+
+#define UBRRH_VALUE 0
+#define UBRRL_VALUE ((F_CPU + 8UL * (BAUD)) / (16UL * (BAUD)) - 1UL)
+#define USE_2X 0
@@ -0,0 +1,1408 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+//
+// Simulation compiler.
+//
+// Reads the declarative simulation specs listed in a catalog file and
+// generates catalog.c containing the flash-resident simulation catalog, with
+// precomputed fixed-point phase increments, amplitudes in output units and
+// cloud parameters.  The per-tick cycle cost and RAM footprint of each
+// simulation is estimated, and generation fails if any simulation would
+// exceed the timer interrupt budget.
+//
+// With -u a specialized update function is also generated for each
+// simulation, which the firmware includes in place of the generic engine.
+// The mode loops are unrolled, constant clear-sky channels are never
+// touched, the cloud generator is only stepped for cloudy simulations, and
+// channels with the same waveform share one evaluation, which each scales
+// or offsets by its own level.  The state stays in RAM, so the trimmed
+// increments and live parameter changes still apply.
+//
+// Spec format: one "key value..." pair per line, '#' starts a comment.
+// Top level keys:   name, desc, exptime (ms), external (true/false)
+// "cloud" section:  min_period, max_period (s),
+//                   min_intensity, max_intensity, initial_intensity (0-1)
+// "output <n>":     current (disabled/5uA/50uA/500uA/5mA), duty (0-1),
+//                   cloudy (true/false),
+//                   type (constant/sinusoidal/gaussian/ramp/table/eclipse),
+//                   period (s; gaussian, ramp, table and eclipse),
+//                   mode <freq (Hz)> <amplitude (mma)> <phase> (sinusoidal),
+//                   modes <file> [time scale] (sinusoidal; one mode per line),
+//                   pulse <amplitude> <offset> <width> (gaussian),
+//                   table <file> [samples] (table; see below),
+//                   eclipse <offset> <depth> <duration (s)> <impact> [<u1> <u2>] (eclipse)
+//
+// Eclipses are described by the phase of mid-eclipse, the depth as the ratio
+// of the eclipsing and eclipsed areas (i.e. the square of the radius ratio),
+// the total duration from first to last contact, the impact parameter in
+// units of the eclipsed star's radius, and optional quadratic limb darkening
+// coefficients.  The firmware tabulates each eclipse profile at load time.
+//
+// Table light curves are read from CSV files with one "phase, intensity"
+// point per line, where intensity is relative to the duty cycle.  The curve
+// is resampled to a power-of-two number of evenly spaced phases (default
+// 256), and stored as a delta-encoded stream that the firmware decodes as
+// it plays.
+//
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "main.h"
+#include "sync.h"
+
+#ifndef F_CPU
+#   define F_CPU 16000000UL
+#endif
+
+// Simulation IDs are sent as 16-bit values; flash space is the practical limit
+#define MAX_SIMULATIONS 1000
+#define MAX_LINE 1024
+#define MAX_TEXT 256
+
+// Wavetable sizes, as a power of two
+#define MIN_TABLE_BITS 4
+#define MAX_TABLE_BITS 12
+#define DEFAULT_TABLE_BITS 8
+
+// Zigzag varint deltas of WAVETABLE_MAX fit in two bytes
+#define MAX_TABLE_BYTES (2 << MAX_TABLE_BITS)
+
+//
+// Approximate avr-gcc -Os cycle costs of the fixed-point engine.
+// These are deliberately pessimistic, and only need to be good enough
+// to catch simulations that are grossly too expensive.
+//
+#define ISR_CYCLES 150
+#define OUTPUT_CYCLES 100
+#define CONSTANT_CYCLES 10
+#define SINUSOID_MODE_CYCLES 180
+#define GAUSSIAN_CYCLES 60
+#define GAUSSIAN_MODE_CYCLES 250
+#define RAMP_CYCLES 80
+#define CLOUD_STEP_CYCLES 900
+#define CLOUD_SEGMENT_CYCLES 2500
+#define TABLE_CYCLES 250
+#define TABLE_SAMPLE_CYCLES 60
+#define ECLIPSE_CYCLES 60
+#define ECLIPSE_MODE_CYCLES 300
+
+// The timer interrupt blocks the USART receive interrupt.  The receiver
+// buffers two characters, so the default budget is two character times.
+#define DEFAULT_BUDGET ((uint32_t)(20 * F_CPU / 9600))
+
+// Most ticks advanced by a single update, matching update_outputs
+#define MAX_CATCHUP_TICKS UINT8_MAX
+
+// The overrun flag can only record one missed tick, so a tick is lost if an
+// update is still running when the tick after the missed one ends.  Catch-up
+// updates must finish within the shortest (slewed) tick, which leaves at
+// least a whole tick for the latency of the other interrupts and critical
+// sections, none of which run for more than a few hundred cycles
+#define CATCHUP_BUDGET ((uint32_t)(TICK_TIMER_COUNTS - SYNC_MAX_SHORTEN) * TICK_PRESCALER)
+
+//
+// Sizes of the engine structures on the AVR, which doesn't pad
+//
+#define AVR_POINTER_SIZE 2
+#define AVR_SINUSOID_SIZE 10
+#define AVR_GAUSSIAN_SIZE 8
+#define AVR_TABLE_SIZE (2 * AVR_POINTER_SIZE + 15)
+#define AVR_ECLIPSE_DEFINITION_SIZE 16
+#define AVR_ECLIPSE_SIZE (13 + 2 * (ECLIPSE_TABLE_SIZE + 1))
+#define AVR_OUTPUT_HEADER_SIZE 5
+#define AVR_CLOUD_PARAMETERS_SIZE 14
+#define AVR_CLOUDGEN_SIZE (1 + AVR_CLOUD_PARAMETERS_SIZE + 13 + 8)
+#define AVR_OUTPUT_DEFINITION_SIZE (10 + AVR_POINTER_SIZE)
+#define AVR_OUTPUT_SIZE (AVR_OUTPUT_HEADER_SIZE + 9 + MAX_ECLIPSES * AVR_ECLIPSE_SIZE)
+#define AVR_SIMULATION_PARAMETERS_SIZE (3 * AVR_POINTER_SIZE + 3)
+
+struct spec_mode
+{
+    // Sinusoids: frequency, amplitude (mma), phase
+    // Gaussians: amplitude, offset, width
+    // Eclipses: offset, depth, duration, impact, u1, u2
+    double a, b, c, d, e, f;
+};
+
+struct spec_output
+{
+    bool defined;
+    enum current_value current;
+    double duty;
+    bool cloudy;
+    enum variability_type type;
+    double period;
+    uint8_t mode_count;
+    struct spec_mode modes[MAX_MODES];
+
+    // Table light curve points, and the number of bits of resampled table
+    double *points;
+    int point_count;
+    uint8_t table_bits;
+
+    // Index into the generated mode tables
+    int table;
+};
+
+struct spec
+{
+    char path[MAX_LINE];
+    char ident[MAX_LINE];
+    char name[MAX_TEXT];
+    char desc[MAX_TEXT];
+    uint16_t exptime;
+    bool external;
+
+    bool cloudy;
+    double min_period;
+    double max_period;
+    double min_intensity;
+    double max_intensity;
+    double initial_intensity;
+
+    struct spec_output outputs[CHANNEL_COUNT];
+};
+
+// Generated mode tables, shared between simulations with identical contents
+struct table
+{
+    enum variability_type type;
+    char *body;
+
+    // Number of array elements: modes, or bytes for wavetables
+    uint16_t length;
+    int first_user;
+};
+
+static struct spec specs[MAX_SIMULATIONS];
+static int spec_count;
+static struct table tables[MAX_SIMULATIONS * CHANNEL_COUNT];
+static int table_count;
+
+static const char *current_path;
+static int current_line;
+
+static void fail(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    if (current_path)
+        fprintf(stderr, "%s:%d: ", current_path, current_line);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+static char *trim(char *s)
+{
+    char *comment = strchr(s, '#');
+    if (comment)
+        *comment = '\0';
+
+    while (isspace((unsigned char)*s))
+        s++;
+
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+
+    return s;
+}
+
+// Split "key rest" into its key and (trimmed) remainder
+static char *split_key(char *line, char **rest)
+{
+    char *key = line;
+    while (*line && !isspace((unsigned char)*line))
+        line++;
+
+    if (*line)
+        *line++ = '\0';
+
+    while (isspace((unsigned char)*line))
+        line++;
+
+    *rest = line;
+    return key;
+}
+
+static double parse_double(const char *value)
+{
+    char *end;
+    errno = 0;
+    double d = strtod(value, &end);
+    if (errno || end == value || *end != '\0')
+        fail("invalid number '%s'", value);
+    return d;
+}
+
+static bool parse_bool(const char *value)
+{
+    if (!strcmp(value, "true") || !strcmp(value, "yes"))
+        return true;
+    if (!strcmp(value, "false") || !strcmp(value, "no"))
+        return false;
+    fail("invalid boolean '%s'", value);
+    return false;
+}
+
+static enum current_value parse_current(const char *value)
+{
+    if (!strcmp(value, "disabled")) return cDisabled;
+    if (!strcmp(value, "5uA")) return c5uA;
+    if (!strcmp(value, "50uA")) return c50uA;
+    if (!strcmp(value, "500uA")) return c500uA;
+    if (!strcmp(value, "5mA")) return c5mA;
+    fail("invalid current '%s'", value);
+    return cDisabled;
+}
+
+static enum variability_type parse_type(const char *value)
+{
+    if (!strcmp(value, "constant")) return Constant;
+    if (!strcmp(value, "sinusoidal")) return Sinusoidal;
+    if (!strcmp(value, "gaussian")) return Gaussian;
+    if (!strcmp(value, "ramp")) return Ramp;
+    if (!strcmp(value, "table")) return Table;
+    if (!strcmp(value, "eclipse")) return Eclipse;
+    fail("invalid variability type '%s'", value);
+    return Constant;
+}
+
+static void parse_triple(const char *value, struct spec_mode *m)
+{
+    char extra;
+    if (sscanf(value, "%lf %lf %lf %c", &m->a, &m->b, &m->c, &extra) != 3)
+        fail("expected three numbers, got '%s'", value);
+}
+
+static void add_mode(struct spec_output *o, const char *value)
+{
+    if (o->mode_count == MAX_MODES)
+        fail("too many modes (maximum is %d)", MAX_MODES);
+    parse_triple(value, &o->modes[o->mode_count++]);
+}
+
+static void add_eclipse(struct spec_output *o, const char *value)
+{
+    if (o->mode_count == MAX_ECLIPSES)
+        fail("too many eclipses (maximum is %d)", MAX_ECLIPSES);
+
+    struct spec_mode *m = &o->modes[o->mode_count++];
+    char extra;
+    int n = sscanf(value, "%lf %lf %lf %lf %lf %lf %c", &m->a, &m->b, &m->c, &m->d, &m->e, &m->f, &extra);
+    if (n != 4 && n != 6)
+        fail("expected offset, depth, duration, impact and optional limb darkening coefficients, got '%s'", value);
+}
+
+static void join_path(char *buf, size_t length, const char *base, const char *file)
+{
+    const char *slash = strrchr(base, '/');
+    if (file[0] == '/' || !slash)
+        snprintf(buf, length, "%s", file);
+    else
+        snprintf(buf, length, "%.*s/%s", (int)(slash - base), base, file);
+}
+
+static void load_modes(struct spec_output *o, const char *spec_path, const char *value)
+{
+    char file[MAX_TEXT];
+    double scale = 1;
+    int n = sscanf(value, "%255s %lf", file, &scale);
+    if (n < 1)
+        fail("expected a mode table filename");
+
+    char path[MAX_LINE];
+    join_path(path, sizeof(path), spec_path, file);
+
+    const char *parent_path = current_path;
+    int parent_line = current_line;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        fail("unable to open mode table '%s'", path);
+
+    current_path = path;
+    current_line = 0;
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), f))
+    {
+        current_line++;
+        char *l = trim(line);
+        if (!*l)
+            continue;
+
+        add_mode(o, l);
+        o->modes[o->mode_count - 1].a *= scale;
+    }
+
+    fclose(f);
+    current_path = parent_path;
+    current_line = parent_line;
+}
+
+static int compare_points(const void *a, const void *b)
+{
+    double pa = *(const double *)a;
+    double pb = *(const double *)b;
+    return (pa > pb) - (pa < pb);
+}
+
+// Read a CSV light curve of (phase, intensity) points
+static void load_table(struct spec_output *o, const char *spec_path, const char *value)
+{
+    char file[MAX_TEXT];
+    int samples = 1 << DEFAULT_TABLE_BITS;
+    int n = sscanf(value, "%255s %d", file, &samples);
+    if (n < 1)
+        fail("expected a light curve filename");
+
+    o->table_bits = 0;
+    for (int i = MIN_TABLE_BITS; i <= MAX_TABLE_BITS; i++)
+        if (samples == 1 << i)
+            o->table_bits = i;
+
+    if (!o->table_bits)
+        fail("table samples must be a power of two between %d and %d", 1 << MIN_TABLE_BITS, 1 << MAX_TABLE_BITS);
+
+    char path[MAX_LINE];
+    join_path(path, sizeof(path), spec_path, file);
+
+    const char *parent_path = current_path;
+    int parent_line = current_line;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        fail("unable to open light curve '%s'", path);
+
+    current_path = path;
+    current_line = 0;
+    int capacity = 0;
+    free(o->points);
+    o->points = NULL;
+    o->point_count = 0;
+
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), f))
+    {
+        current_line++;
+        char *l = trim(line);
+        if (!*l)
+            continue;
+
+        double phase, intensity;
+        char extra;
+        if (sscanf(l, "%lf%*[ \t,;]%lf %c", &phase, &intensity, &extra) != 2)
+        {
+            // Allow a column header
+            if (o->point_count == 0 && isalpha((unsigned char)*l))
+                continue;
+            fail("expected a phase and intensity, got '%s'", l);
+        }
+
+        if (intensity < 0)
+            fail("intensity must not be negative");
+
+        if (o->point_count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 256;
+            o->points = realloc(o->points, capacity * 2 * sizeof(double));
+            if (!o->points)
+                fail("allocation failure");
+        }
+
+        o->points[2 * o->point_count] = phase - floor(phase);
+        o->points[2 * o->point_count + 1] = intensity;
+        o->point_count++;
+    }
+
+    fclose(f);
+    if (o->point_count < 2)
+        fail("light curve needs at least two points");
+
+    qsort(o->points, o->point_count, 2 * sizeof(double), compare_points);
+    current_path = parent_path;
+    current_line = parent_line;
+}
+
+static void parse_spec(struct spec *s, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        current_path = NULL;
+        fail("unable to open spec '%s'", path);
+    }
+
+    snprintf(s->path, sizeof(s->path), "%s", path);
+
+    // Identifier is the file basename without extension
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    snprintf(s->ident, sizeof(s->ident), "%s", base);
+    char *dot = strrchr(s->ident, '.');
+    if (dot)
+        *dot = '\0';
+    for (char *c = s->ident; *c; c++)
+        if (!isalnum((unsigned char)*c))
+            *c = '_';
+
+    current_path = path;
+    current_line = 0;
+
+    // Section being parsed: -2 = top level, -1 = cloud, otherwise output index
+    int section = -2;
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), f))
+    {
+        current_line++;
+        char *l = trim(line);
+        if (!*l)
+            continue;
+
+        char *value;
+        char *key = split_key(l, &value);
+
+        if (!strcmp(key, "cloud"))
+        {
+            s->cloudy = true;
+            section = -1;
+        }
+        else if (!strcmp(key, "output"))
+        {
+            int index = (int)parse_double(value);
+            if (index < 0 || index >= CHANNEL_COUNT)
+                fail("invalid output %s", value);
+            section = index;
+            s->outputs[index].defined = true;
+        }
+        else if (section == -2)
+        {
+            if (!strcmp(key, "name"))
+                snprintf(s->name, sizeof(s->name), "%s", value);
+            else if (!strcmp(key, "desc"))
+                snprintf(s->desc, sizeof(s->desc), "%s", value);
+            else if (!strcmp(key, "exptime"))
+            {
+                double exptime = parse_double(value);
+                if (exptime < 0 || exptime > UINT16_MAX)
+                    fail("exptime out of range");
+                s->exptime = (uint16_t)exptime;
+            }
+            else if (!strcmp(key, "external"))
+                s->external = parse_bool(value);
+            else
+                fail("unknown key '%s'", key);
+        }
+        else if (section == -1)
+        {
+            double v = parse_double(value);
+            if (!strcmp(key, "min_period"))
+                s->min_period = v;
+            else if (!strcmp(key, "max_period"))
+                s->max_period = v;
+            else if (!strcmp(key, "min_intensity"))
+                s->min_intensity = v;
+            else if (!strcmp(key, "max_intensity"))
+                s->max_intensity = v;
+            else if (!strcmp(key, "initial_intensity"))
+                s->initial_intensity = v;
+            else
+                fail("unknown cloud key '%s'", key);
+        }
+        else
+        {
+            struct spec_output *o = &s->outputs[section];
+            if (!strcmp(key, "current"))
+                o->current = parse_current(value);
+            else if (!strcmp(key, "duty"))
+                o->duty = parse_double(value);
+            else if (!strcmp(key, "cloudy"))
+                o->cloudy = parse_bool(value);
+            else if (!strcmp(key, "type"))
+                o->type = parse_type(value);
+            else if (!strcmp(key, "period"))
+                o->period = parse_double(value);
+            else if (!strcmp(key, "mode") || !strcmp(key, "pulse"))
+                add_mode(o, value);
+            else if (!strcmp(key, "modes"))
+                load_modes(o, path, value);
+            else if (!strcmp(key, "table"))
+                load_table(o, path, value);
+            else if (!strcmp(key, "eclipse"))
+                add_eclipse(o, value);
+            else
+                fail("unknown output key '%s'", key);
+        }
+    }
+    fclose(f);
+
+    // Validate
+    current_line = 0;
+    if (!s->name[0])
+        fail("missing name");
+    if (strlen(s->name) > 40 || strlen(s->desc) > 150)
+        fail("name or description is too long");
+
+    if (s->cloudy)
+    {
+        if (s->min_period <= 0 || s->max_period < s->min_period)
+            fail("invalid cloud periods");
+        if (s->min_intensity < 0 || s->max_intensity < s->min_intensity || s->max_intensity > 1 ||
+            s->initial_intensity < 0 || s->initial_intensity > 1)
+            fail("invalid cloud intensities");
+    }
+
+    for (int i = 0; i < CHANNEL_COUNT; i++)
+    {
+        struct spec_output *o = &s->outputs[i];
+        if (o->duty < 0 || o->duty > 1)
+            fail("output %d: duty must be between 0 and 1", i);
+
+        if ((o->type == Gaussian || o->type == Ramp || o->type == Table || o->type == Eclipse) && o->period <= 0)
+            fail("output %d: missing period", i);
+
+        if ((o->type == Constant || o->type == Ramp || o->type == Table) && o->mode_count)
+            fail("output %d: %s outputs don't take modes", i,
+                 o->type == Ramp ? "ramp" : o->type == Table ? "table" : "constant");
+
+        if (o->type == Eclipse && !o->mode_count)
+            fail("output %d: missing eclipse", i);
+
+        if ((o->type == Table) != (o->point_count > 0))
+            fail("output %d: %s", i, o->type == Table ? "missing light curve table" : "only table outputs take a light curve");
+    }
+}
+
+//
+// Fixed-point conversions
+//
+
+static double output_level(struct spec_output *o)
+{
+    return o->duty * OUTPUT_MAX;
+}
+
+static uint32_t cycle_fraction(double cycles)
+{
+    cycles -= floor(cycles);
+    return (uint32_t)llround(cycles * 4294967296.0);
+}
+
+static uint32_t phase_increment(double freq)
+{
+    double increment = freq * TICK_INTERVAL;
+    if (increment < 0 || increment >= 0.5)
+        fail("frequency %g Hz is above the update rate Nyquist limit", freq);
+    return (uint32_t)llround(increment * 4294967296.0);
+}
+
+static uint32_t cloud_ticks(double seconds)
+{
+    double ticks = seconds / TICK_INTERVAL * CLOUD_TICK;
+    if (ticks > UINT32_MAX / 2)
+        fail("cloud period %gs is too long", seconds);
+    return (uint32_t)llround(ticks);
+}
+
+static uint16_t cloud_intensity(double intensity)
+{
+    return (uint16_t)lround(intensity * CLOUD_UNITY);
+}
+
+static int add_table(enum variability_type type, const char *body, uint16_t length, int user)
+{
+    for (int i = 0; i < table_count; i++)
+        if (tables[i].type == type && !strcmp(tables[i].body, body))
+            return i;
+
+    tables[table_count] = (struct table) {
+        .type = type,
+        .body = strdup(body),
+        .length = length,
+        .first_user = user
+    };
+
+    return table_count++;
+}
+
+// Linearly interpolate the light curve at the given phase, wrapping around the period
+static double table_intensity(struct spec_output *o, double phase)
+{
+    const double *p = o->points;
+    int n = o->point_count;
+    int i = 0;
+    while (i < n && p[2 * i] <= phase)
+        i++;
+
+    // Points either side of phase, with phases unwrapped around it
+    double x0 = i > 0 ? p[2 * (i - 1)] : p[2 * (n - 1)] - 1;
+    double y0 = i > 0 ? p[2 * (i - 1) + 1] : p[2 * (n - 1) + 1];
+    double x1 = i < n ? p[2 * i] : p[0] + 1;
+    double y1 = i < n ? p[2 * i + 1] : p[1];
+    if (x1 <= x0)
+        return y0;
+
+    return y0 + (y1 - y0) * (phase - x0) / (x1 - x0);
+}
+
+// Resample the light curve and encode it as zigzag varint deltas.
+// Returns the number of bytes written to data
+static uint16_t encode_table(struct spec_output *o, int output, uint8_t *data)
+{
+    uint16_t samples = 1 << o->table_bits;
+    uint16_t length = 0;
+    long previous = 0;
+    double level = output_level(o);
+    for (uint16_t i = 0; i < samples; i++)
+    {
+        long value = lround(table_intensity(o, (double)i / samples) * level / (1 << WAVETABLE_SHIFT));
+        if (value > WAVETABLE_MAX)
+            fail("output %d: light curve exceeds the maximum output", output);
+
+        long delta = value - previous;
+        uint16_t encoded = delta < 0 ? (uint16_t)(-2 * delta - 1) : (uint16_t)(2 * delta);
+        previous = value;
+        do
+        {
+            data[length++] = (encoded & 0x7F) | (encoded > 0x7F ? 0x80 : 0);
+            encoded >>= 7;
+        } while (encoded);
+    }
+
+    return length;
+}
+
+static void build_tables(int index)
+{
+    struct spec *s = &specs[index];
+    current_path = s->path;
+    current_line = 0;
+
+    for (int i = 0; i < CHANNEL_COUNT; i++)
+    {
+        struct spec_output *o = &s->outputs[i];
+        o->table = -1;
+        if (o->type == Table)
+        {
+            uint8_t data[MAX_TABLE_BYTES];
+            uint16_t length = encode_table(o, i, data);
+
+            char body[6 * MAX_TABLE_BYTES + MAX_TABLE_BYTES / 2];
+            size_t n = 0;
+            for (uint16_t j = 0; j < length; j++)
+                n += snprintf(body + n, sizeof(body) - n, "%s0x%02X,%s", j % 12 ? " " : "    ",
+                              data[j], j % 12 == 11 || j == length - 1 ? "\n" : "");
+
+            o->table = add_table(Table, body, length, index);
+            continue;
+        }
+
+        if (!o->mode_count)
+            continue;
+
+        char body[MAX_MODES * MAX_LINE];
+        size_t n = 0;
+        double level = output_level(o);
+        for (uint8_t j = 0; j < o->mode_count; j++)
+        {
+            struct spec_mode *m = &o->modes[j];
+            if (o->type == Sinusoidal)
+            {
+                long amplitude = lround(m->b / 1000 * level);
+                if (amplitude < INT16_MIN || amplitude > INT16_MAX)
+                    fail("output %d: mode amplitude %g mma is too large", i, m->b);
+
+                n += snprintf(body + n, sizeof(body) - n,
+                              "    { .increment = %10uUL, .phase = %10uUL, .amplitude = %6ld },\n",
+                              phase_increment(m->a), cycle_fraction(m->c), amplitude);
+            }
+            else if (o->type == Eclipse)
+            {
+                double k = sqrt(m->b);
+                double half_width = m->c / o->period / 2;
+                if (m->b <= 0 || k >= 2)
+                    fail("output %d: eclipse depth must be between 0 and 4", i);
+                if (half_width < TICK_INTERVAL / o->period || half_width >= 0.5)
+                    fail("output %d: eclipse duration must be between one tick and the period", i);
+                if (m->d < 0 || m->d >= 1 + k || m->d >= 2)
+                    fail("output %d: eclipse impact parameter must be between 0 and 1 + radius ratio", i);
+                if (fabs(m->e) >= 2 || fabs(m->f) >= 2 || m->e + m->f > 1)
+                    fail("output %d: invalid limb darkening coefficients", i);
+                if (m->a < 0 || m->a >= 1)
+                    fail("output %d: eclipse offset must be between 0 and 1", i);
+
+                n += snprintf(body + n, sizeof(body) - n,
+                              "    { .offset = %10uUL, .half_width = %10uUL, .radius = %5ld, .impact = %5ld, .u1 = %6ld, .u2 = %6ld },\n",
+                              cycle_fraction(m->a), cycle_fraction(half_width), lround(k * 32768),
+                              lround(m->d * 32768), lround(m->e * 16384), lround(m->f * 16384));
+            }
+            else
+            {
+                long amplitude = lround(m->a * level);
+                long inverse_width = m->c > 0 ? lround(256 / m->c) : 0;
+                if (amplitude < 0 || amplitude > UINT16_MAX)
+                    fail("output %d: pulse amplitude %g exceeds the maximum output", i, m->a);
+                if (inverse_width <= 0 || inverse_width > UINT16_MAX)
+                    fail("output %d: pulse width %g is out of range", i, m->c);
+                if (m->b < 0 || m->b >= 1)
+                    fail("output %d: pulse offset must be between 0 and 1", i);
+
+                n += snprintf(body + n, sizeof(body) - n,
+                              "    { .offset = %10uUL, .inverse_width = %5ld, .amplitude = %5ld },\n",
+                              cycle_fraction(m->b), inverse_width, amplitude);
+            }
+        }
+
+        o->table = add_table(o->type, body, o->mode_count, index);
+    }
+}
+
+// Cloudy outputs are only attenuated if the simulation has clouds
+static bool attenuated(struct spec *s, struct spec_output *o)
+{
+    return s->cloudy && o->cloudy;
+}
+
+// Index of an earlier output with the same waveform, which the specialized
+// update evaluates once for both, or -1.  The level is applied per channel,
+// but the amplitudes are part of the mode table.  Wavetables keep
+// per-channel decoder state, so are never shared
+static int shared_output(struct spec *s, int index)
+{
+    struct spec_output *o = &s->outputs[index];
+    if (o->type == Constant || o->type == Table)
+        return -1;
+
+    for (int i = 0; i < index; i++)
+    {
+        struct spec_output *p = &s->outputs[i];
+        if (p->type == o->type && p->table == o->table && p->period == o->period && shared_output(s, i) < 0)
+            return i;
+    }
+
+    return -1;
+}
+
+//
+// Cost estimates
+//
+
+// Cycles used to evaluate one output, excluding the cloud attenuation
+static uint32_t output_cycles(struct spec_output *o)
+{
+    switch (o->type)
+    {
+        case Sinusoidal: return o->mode_count * SINUSOID_MODE_CYCLES;
+        case Gaussian: return GAUSSIAN_CYCLES + o->mode_count * GAUSSIAN_MODE_CYCLES;
+        case Ramp: return RAMP_CYCLES;
+        case Eclipse: return ECLIPSE_CYCLES + o->mode_count * ECLIPSE_MODE_CYCLES;
+        case Table:
+        {
+            // Samples decoded per tick, rounded up
+            double samples = ldexp(phase_increment(1 / o->period), o->table_bits - 32);
+            return TABLE_CYCLES + (uint32_t)ceil(samples) * TABLE_SAMPLE_CYCLES;
+        }
+        default: return CONSTANT_CYCLES;
+    }
+}
+
+// Cycles used by the generic engine.  This is the worst case, because
+// a parameter change may replace the specialized update with it
+static uint32_t estimate_cycles(struct spec *s)
+{
+    uint32_t cycles = ISR_CYCLES;
+    if (s->cloudy)
+        cycles += CLOUD_STEP_CYCLES + CLOUD_SEGMENT_CYCLES;
+
+    for (int i = 0; i < CHANNEL_COUNT; i++)
+        cycles += OUTPUT_CYCLES + output_cycles(&s->outputs[i]);
+
+    return cycles;
+}
+
+// Cycles used by the specialized update
+static uint32_t estimate_specialized_cycles(struct spec *s)
+{
+    uint32_t cycles = ISR_CYCLES;
+    if (s->cloudy)
+        cycles += CLOUD_STEP_CYCLES + CLOUD_SEGMENT_CYCLES;
+
+    for (int i = 0; i < CHANNEL_COUNT; i++)
+    {
+        struct spec_output *o = &s->outputs[i];
+        if (o->type == Constant && !attenuated(s, o))
+            continue;
+
+        // A shared waveform is evaluated once, and only the level applied again
+        cycles += OUTPUT_CYCLES;
+        if (shared_output(s, i) < 0)
+            cycles += output_cycles(o);
+    }
+
+    return cycles;
+}
+
+// Cycles used by the generic engine to catch up MAX_CATCHUP_TICKS in one
+// update.  Wavetables decode at most one full table however far the phase
+// advances, and the cloud generator crosses at most one control point per tick
+static uint32_t estimate_catchup_cycles(struct spec *s)
+{
+    uint32_t cycles = ISR_CYCLES;
+    if (s->cloudy)
+    {
+        uint32_t period = cloud_ticks(s->min_period);
+        uint64_t points = period ? (uint64_t)MAX_CATCHUP_TICKS * CLOUD_TICK / period + 1 : MAX_CATCHUP_TICKS;
+        if (points > MAX_CATCHUP_TICKS)
+            points = MAX_CATCHUP_TICKS;
+        cycles += CLOUD_STEP_CYCLES + points * CLOUD_SEGMENT_CYCLES;
+    }
+
+    for (int i = 0; i < CHANNEL_COUNT; i++)
+    {
+        struct spec_output *o = &s->outputs[i];
+        cycles += OUTPUT_CYCLES;
+        if (o->type != Table)
+        {
+            cycles += output_cycles(o);
+            continue;
+        }
+
+        double samples = ldexp(phase_increment(1 / o->period), o->table_bits - 32) * MAX_CATCHUP_TICKS;
+        samples = fmin(ceil(samples), (double)(1 << o->table_bits));
+        cycles += TABLE_CYCLES + (uint32_t)samples * TABLE_SAMPLE_CYCLES;
+    }
+
+    return cycles;
+}
+
+// RAM used by the active state of a simulation (the engine itself reserves space for the worst case)
+static uint16_t estimate_ram(struct spec *s)
+{
+    uint16_t bytes = s->cloudy ? AVR_CLOUDGEN_SIZE : 1;
+    for (int i = 0; i < CHANNEL_COUNT; i++)
+    {
+        struct spec_output *o = &s->outputs[i];
+        bytes += AVR_OUTPUT_HEADER_SIZE;
+        switch (o->type)
+        {
+            case Constant: break;
+            case Sinusoidal: bytes += 1 + o->mode_count * AVR_SINUSOID_SIZE; break;
+            case Gaussian: bytes += 9 + o->mode_count * AVR_GAUSSIAN_SIZE; break;
+            case Ramp: bytes += 8; break;
+            case Table: bytes += AVR_TABLE_SIZE; break;
+            case Eclipse: bytes += 9 + o->mode_count * AVR_ECLIPSE_SIZE; break;
+        }
+    }
+
+    return bytes;
+}
+
+// Flash used by a simulation's catalog entry, strings and tables.
+// Shared mode tables are counted against their first user.
+static uint16_t estimate_flash(int index)
+{
+    struct spec *s = &specs[index];
+    uint16_t bytes = AVR_SIMULATION_PARAMETERS_SIZE + strlen(s->name) + strlen(s->desc) + 2;
+    bytes += AVR_POINTER_SIZE + CHANNEL_COUNT * AVR_OUTPUT_DEFINITION_SIZE;
+    if (s->cloudy)
+        bytes += AVR_CLOUD_PARAMETERS_SIZE;
+
+    for (int i = 0; i < CHANNEL_COUNT; i++)
+    {
+        struct spec_output *o = &s->outputs[i];
+        if (o->table < 0 || tables[o->table].first_user != index)
+            continue;
+
+        if (o->type == Table)
+            bytes += tables[o->table].length;
+        else if (o->type == Eclipse)
+            bytes += o->mode_count * AVR_ECLIPSE_DEFINITION_SIZE;
+        else
+            bytes += o->mode_count * (o->type == Sinusoidal ? AVR_SINUSOID_SIZE : AVR_GAUSSIAN_SIZE);
+    }
+
+    return bytes;
+}
+
+//
+// Code generation
+//
+
+static void write_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static const char *current_name(enum current_value c)
+{
+    switch (c)
+    {
+        case c5uA: return "c5uA";
+        case c50uA: return "c50uA";
+        case c500uA: return "c500uA";
+        case c5mA: return "c5mA";
+        default: return "cDisabled";
+    }
+}
+
+static const char *type_name(enum variability_type t)
+{
+    switch (t)
+    {
+        case Sinusoidal: return "Sinusoidal";
+        case Gaussian: return "Gaussian";
+        case Ramp: return "Ramp";
+        case Table: return "Table";
+        case Eclipse: return "Eclipse";
+        default: return "Constant";
+    }
+}
+
+static void write_header(FILE *f, const char *manifest)
+{
+    fprintf(f, "//*****************************************************************************\n");
+    fprintf(f, "//  Generated by simc from %s - do not edit.\n", manifest);
+    fprintf(f, "//*****************************************************************************\n\n");
+}
+
+// 32-bit FNV-1a
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= ((const uint8_t *)data)[i];
+        hash *= 16777619UL;
+    }
+
+    return hash;
+}
+
+// Hash the catalog contents that the host caches: the order, exposure
+// times, names and descriptions of the simulations
+static uint32_t hash_catalog()
+{
+    uint32_t hash = 2166136261UL;
+    for (int i = 0; i < spec_count; i++)
+    {
+        struct spec *s = &specs[i];
+        uint8_t exptime[2] = { s->exptime & 0xFF, s->exptime >> 8 };
+        hash = fnv1a(hash, exptime, sizeof(exptime));
+        hash = fnv1a(hash, s->name, strlen(s->name) + 1);
+        hash = fnv1a(hash, s->desc, strlen(s->desc) + 1);
+    }
+
+    return hash;
+}
+
+static void write_catalog_c(FILE *f, const char *manifest)
+{
+    write_header(f, manifest);
+    fprintf(f, "#include <avr/pgmspace.h>\n");
+    fprintf(f, "#include \"main.h\"\n\n");
+
+    // Lookup tables used by the engine
+    fprintf(f, "// sin(x) for the first quadrant, scaled to 0xFFFF\n");
+    fprintf(f, "const uint16_t sine_table[SINE_TABLE_SIZE + 1] PROGMEM =\n{");
+    for (int i = 0; i <= SINE_TABLE_SIZE; i++)
+        fprintf(f, "%s%5ld,", i % 8 ? " " : "\n    ", lround(65535 * sin(M_PI / 2 * i / SINE_TABLE_SIZE)));
+    fprintf(f, "\n};\n\n");
+
+    fprintf(f, "// exp(-x^2) in steps of 1/GAUSSIAN_TABLE_SCALE, scaled to 0xFFFF\n");
+    fprintf(f, "const uint16_t gaussian_table[GAUSSIAN_TABLE_SIZE + 1] PROGMEM =\n{");
+    for (int i = 0; i <= GAUSSIAN_TABLE_SIZE; i++)
+    {
+        double x = (double)i / GAUSSIAN_TABLE_SCALE;
+        fprintf(f, "%s%5ld,", i % 8 ? " " : "\n    ", i == GAUSSIAN_TABLE_SIZE ? 0 : lround(65535 * exp(-x * x)));
+    }
+    fprintf(f, "\n};\n\n");
+
+    // Mode tables
+    for (int i = 0; i < table_count; i++)
+    {
+        struct table *t = &tables[i];
+        if (t->type == Table)
+            fprintf(f, "static const uint8_t modes_%d[%u] PROGMEM =\n{\n%s};\n\n", i, t->length, t->body);
+        else
+            fprintf(f, "static const struct %s modes_%d[%u] PROGMEM =\n{\n%s};\n\n",
+                    t->type == Sinusoidal ? "sinusoid" : t->type == Eclipse ? "eclipse_definition" : "gaussian",
+                    i, t->length, t->body);
+    }
+
+    for (int i = 0; i < spec_count; i++)
+    {
+        struct spec *s = &specs[i];
+        current_path = s->path;
+        current_line = 0;
+
+        fprintf(f, "// %s\n", s->path);
+        fprintf(f, "static const char %s_name[] PROGMEM = ", s->ident);
+        write_string(f, s->name);
+        fprintf(f, ";\nstatic const char %s_desc[] PROGMEM = ", s->ident);
+        write_string(f, s->desc);
+        fprintf(f, ";\n");
+
+        if (s->cloudy)
+        {
+            fprintf(f, "static const struct cloud_parameters %s_cloud PROGMEM =\n{\n", s->ident);
+            fprintf(f, "    .min_period = %uUL,\n", cloud_ticks(s->min_period));
+            fprintf(f, "    .max_period = %uUL,\n", cloud_ticks(s->max_period));
+            fprintf(f, "    .min_intensity = %u,\n", cloud_intensity(s->min_intensity));
+            fprintf(f, "    .max_intensity = %u,\n", cloud_intensity(s->max_intensity));
+            fprintf(f, "    .initial_intensity = %u\n", cloud_intensity(s->initial_intensity));
+            fprintf(f, "};\n");
+        }
+
+        fprintf(f, "static const struct simulation_definition %s_definition PROGMEM =\n{\n", s->ident);
+        if (s->cloudy)
+            fprintf(f, "    .cloud = &%s_cloud,\n", s->ident);
+        else
+            fprintf(f, "    .cloud = NULL,\n");
+
+        fprintf(f, "    .outputs =\n    {\n");
+        for (int j = 0; j < CHANNEL_COUNT; j++)
+        {
+            struct spec_output *o = &s->outputs[j];
+            uint32_t increment = 0;
+            if (o->type == Gaussian || o->type == Ramp || o->type == Table || o->type == Eclipse)
+                increment = phase_increment(1 / o->period);
+
+            fprintf(f, "        {\n");
+            fprintf(f, "            .current = %s,\n", current_name(o->current));
+            fprintf(f, "            .level = %ld,\n", lround(output_level(o)));
+            fprintf(f, "            .cloudy = %s,\n", o->cloudy ? "true" : "false");
+            fprintf(f, "            .type = %s,\n", type_name(o->type));
+            fprintf(f, "            .mode_count = %u,\n", o->type == Table ? o->table_bits : o->mode_count);
+            fprintf(f, "            .increment = %uUL,\n", increment);
+            if (o->table >= 0)
+                fprintf(f, "            .modes = modes_%d\n", o->table);
+            else
+                fprintf(f, "            .modes = NULL\n");
+            fprintf(f, "        },\n");
+        }
+        fprintf(f, "    }\n};\n\n");
+    }
+
+    fprintf(f, "const uint16_t simulation_count = %d;\n", spec_count);
+    fprintf(f, "const uint32_t catalog_hash = 0x%08XUL;\n", hash_catalog());
+    fprintf(f, "const struct simulation_parameters simulation[%d] PROGMEM =\n{\n", spec_count);
+    for (int i = 0; i < spec_count; i++)
+    {
+        struct spec *s = &specs[i];
+        fprintf(f, "    {\n");
+        fprintf(f, "        .name = %s_name,\n", s->ident);
+        fprintf(f, "        .desc = %s_desc,\n", s->ident);
+        fprintf(f, "        .exptime = %u,\n", s->exptime);
+        fprintf(f, "        .external = %s,\n", s->external ? "true" : "false");
+        fprintf(f, "        .definition = &%s_definition\n", s->ident);
+        fprintf(f, "    },\n");
+    }
+    fprintf(f, "};\n");
+}
+
+// Evaluate output i of the specialized update into level<i>.  An output that
+// shares an earlier waveform applies its own level to that evaluation
+static void write_output_update(FILE *f, struct spec *s, int i)
+{
+    struct spec_output *o = &s->outputs[i];
+    int shared = shared_output(s, i);
+    int w = shared >= 0 ? shared : i;
+
+    switch (o->type)
+    {
+        case Sinusoidal:
+            if (shared < 0)
+            {
+                fprintf(f, "    struct sinusoid *modes%d = outputs[%d].sinusoid.modes;\n", i, i);
+                fprintf(f, "    int32_t wave%d = (int32_t)0", i);
+                for (int j = 0; j < o->mode_count; j++)
+                    fprintf(f, "\n        + sinusoid_mode(&modes%d[%d], ticks)", i, j);
+                fprintf(f, ";\n");
+            }
+            fprintf(f, "    uint16_t level%d = clamp_output((int32_t)outputs[%d].level + wave%d);\n", i, i, w);
+            break;
+        case Gaussian:
+            // Pulses don't depend on the level
+            if (shared >= 0)
+            {
+                fprintf(f, "    uint16_t level%d = level%d;\n", i, shared);
+                break;
+            }
+
+            fprintf(f, "    struct gaussian_variability *g%d = &outputs[%d].gaussian;\n", i, i);
+            fprintf(f, "    uint32_t phase%d = advance_phase(&g%d->phase, g%d->increment, ticks);\n", i, i, i);
+            fprintf(f, "    uint16_t level%d = clamp_output((int32_t)0", i);
+            for (int j = 0; j < o->mode_count; j++)
+                fprintf(f, "\n        + gaussian_pulse(&g%d->modes[%d], phase%d)", i, j, i);
+            fprintf(f, ");\n");
+            break;
+        case Ramp:
+            if (shared < 0)
+                fprintf(f, "    uint32_t phase%d = advance_phase(&outputs[%d].ramp.phase, outputs[%d].ramp.increment, ticks);\n", i, i, i);
+            fprintf(f, "    uint16_t level%d = ramp_output(&outputs[%d], phase%d);\n", i, i, w);
+            break;
+        case Table:
+            fprintf(f, "    uint16_t level%d = table_level(&outputs[%d].table, ticks);\n", i, i);
+            break;
+        case Eclipse:
+            if (shared < 0)
+            {
+                fprintf(f, "    struct eclipse_variability *e%d = &outputs[%d].eclipse;\n", i, i);
+                fprintf(f, "    uint32_t phase%d = advance_phase(&e%d->phase, e%d->increment, ticks);\n", i, i, i);
+                fprintf(f, "    uint32_t blocked%d = (uint32_t)0", i);
+                for (int j = 0; j < o->mode_count; j++)
+                    fprintf(f, "\n        + eclipse(&e%d->eclipses[%d], phase%d)", i, j, i);
+                fprintf(f, ";\n");
+            }
+            fprintf(f, "    uint16_t level%d = eclipse_level(&outputs[%d], blocked%d);\n", i, i, w);
+            break;
+        default:
+            fprintf(f, "    uint16_t level%d = clamp_output(outputs[%d].level);\n", i, i);
+            break;
+    }
+}
+
+// Copy the phases of each shared waveform to the outputs that reuse it,
+// which the specialized update never advances
+static void write_copy_phases(FILE *f, struct spec *s)
+{
+    fprintf(f, "static void copy_phases_%s()\n{\n", s->ident);
+    for (int i = 0; i < CHANNEL_COUNT; i++)
+    {
+        struct spec_output *o = &s->outputs[i];
+        int shared = shared_output(s, i);
+        if (shared < 0)
+            continue;
+
+        if (o->type == Sinusoidal)
+            for (int j = 0; j < o->mode_count; j++)
+                fprintf(f, "    outputs[%d].sinusoid.modes[%d].phase = outputs[%d].sinusoid.modes[%d].phase;\n",
+                        i, j, shared, j);
+        else
+        {
+            const char *v = o->type == Gaussian ? "gaussian" : o->type == Ramp ? "ramp" : "eclipse";
+            fprintf(f, "    outputs[%d].%s.phase = outputs[%d].%s.phase;\n", i, v, shared, v);
+        }
+    }
+    fprintf(f, "}\n\n");
+}
+
+// Whether any output of the simulation shares an earlier waveform
+static bool has_shared_outputs(struct spec *s)
+{
+    for (int i = 0; i < CHANNEL_COUNT; i++)
+        if (shared_output(s, i) >= 0)
+            return true;
+
+    return false;
+}
+
+// Generate the specialized update functions that are included by main.c
+static void write_updates_h(FILE *f, const char *manifest)
+{
+    write_header(f, manifest);
+
+    for (int i = 0; i < spec_count; i++)
+    {
+        struct spec *s = &specs[i];
+        fprintf(f, "// %s\n", s->path);
+        fprintf(f, "static void update_%s(uint8_t ticks)\n{\n", s->ident);
+
+        bool used = s->cloudy;
+        if (s->cloudy)
+            fprintf(f, "    uint16_t attenuation = cloudgen_step(&cloud, ticks);\n");
+
+        for (int j = 0; j < CHANNEL_COUNT; j++)
+        {
+            struct spec_output *o = &s->outputs[j];
+            if (o->type == Constant && !attenuated(s, o))
+                continue;
+
+            write_output_update(f, s, j);
+            used = true;
+        }
+
+        for (int j = 0; j < CHANNEL_COUNT; j++)
+        {
+            struct spec_output *o = &s->outputs[j];
+            if (o->type == Constant && !attenuated(s, o))
+                continue;
+
+            if (attenuated(s, o))
+                fprintf(f, "    channel_set_duty(%d, attenuate(level%d, attenuation));\n", j, j);
+            else
+                fprintf(f, "    channel_set_duty(%d, level%d);\n", j, j);
+        }
+
+        if (!used)
+            fprintf(f, "    (void)ticks;\n");
+        fprintf(f, "}\n\n");
+
+        if (has_shared_outputs(s))
+            write_copy_phases(f, s);
+    }
+
+    fprintf(f, "static const struct simulation_update simulation_updates[%d] PROGMEM =\n{\n", spec_count);
+    for (int i = 0; i < spec_count; i++)
+    {
+        struct spec *s = &specs[i];
+        if (has_shared_outputs(s))
+            fprintf(f, "    { update_%s, copy_phases_%s },\n", s->ident, s->ident);
+        else
+            fprintf(f, "    { update_%s, NULL },\n", s->ident);
+    }
+    fprintf(f, "};\n");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-b cycle-budget] [-q] [-o <output.c>] [-u <updates.h>] <catalog>\n", name);
+    fprintf(stderr, "  -q  don't print the per-simulation cost report\n");
+    fprintf(stderr, "  -u  also generate the specialized update functions\n");
+    fprintf(stderr, "  Without -o the specs are checked and the report printed, but nothing is generated\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output = NULL;
+    const char *updates = NULL;
+    uint32_t budget = DEFAULT_BUDGET;
+    bool quiet = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:o:qu:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b': budget = strtoul(optarg, NULL, 0); break;
+            case 'o': output = optarg; break;
+            case 'q': quiet = true; break;
+            case 'u': updates = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *manifest = argv[optind];
+    FILE *f = fopen(manifest, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Unable to open catalog '%s'\n", manifest);
+        return 1;
+    }
+
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), f))
+    {
+        char *l = trim(line);
+        if (!*l)
+            continue;
+
+        if (spec_count == MAX_SIMULATIONS)
+        {
+            fprintf(stderr, "Too many simulations (maximum is %d)\n", MAX_SIMULATIONS);
+            return 1;
+        }
+
+        char path[MAX_LINE];
+        join_path(path, sizeof(path), manifest, l);
+        parse_spec(&specs[spec_count], path);
+        build_tables(spec_count++);
+    }
+    fclose(f);
+
+    // Report estimated costs and enforce the interrupt budget
+    bool over_budget = false;
+    uint32_t total_flash = 0;
+    if (!quiet)
+        printf("%4s  %-40s  %7s  %7s  %8s  %6s  %6s\n", "id", "simulation", "cycles", "generic", "catch-up",
+               "ram", "flash");
+
+    for (int i = 0; i < spec_count; i++)
+    {
+        struct spec *s = &specs[i];
+        uint32_t cycles = estimate_cycles(s);
+        uint32_t catchup = estimate_catchup_cycles(s);
+        uint16_t flash = estimate_flash(i);
+        total_flash += flash;
+        if (!quiet)
+            printf("%4d  %-40s  %7u  %7u  %8u  %6u  %6u\n", i + 1, s->name, estimate_specialized_cycles(s), cycles,
+                   catchup, estimate_ram(s), flash);
+
+        if (cycles > budget)
+        {
+            fprintf(stderr, "%s: estimated %u cycles per tick exceeds the budget of %u\n", s->path, cycles, budget);
+            over_budget = true;
+        }
+
+        if (catchup > CATCHUP_BUDGET)
+        {
+            fprintf(stderr, "%s: estimated %u cycles to catch up %u ticks exceeds the budget of %u\n",
+                    s->path, catchup, MAX_CATCHUP_TICKS, CATCHUP_BUDGET);
+            over_budget = true;
+        }
+    }
+
+    if (!quiet)
+    {
+        // The engine state is statically allocated for the worst case, so RAM use is independent of the catalog
+        printf("\nEngine state: %u bytes RAM for any simulation (cycle budget %u per tick, %u per catch-up)\n",
+               CHANNEL_COUNT * AVR_OUTPUT_SIZE + AVR_CLOUDGEN_SIZE, budget, CATCHUP_BUDGET);
+        printf("Catalog: %d simulations, %u bytes flash (excluding %u bytes of lookup tables)\n",
+               spec_count, total_flash, 2 * (SINE_TABLE_SIZE + GAUSSIAN_TABLE_SIZE + 2));
+    }
+
+    if (over_budget)
+        return 1;
+
+    if (!output)
+        return 0;
+
+    FILE *c = fopen(output, "w");
+    if (!c)
+    {
+        fprintf(stderr, "Unable to open '%s' for writing\n", output);
+        return 1;
+    }
+    write_catalog_c(c, manifest);
+    fclose(c);
+
+    if (updates)
+    {
+        FILE *u = fopen(updates, "w");
+        if (!u)
+        {
+            fprintf(stderr, "Unable to open '%s' for writing\n", updates);
+            return 1;
+        }
+        write_updates_h(u, manifest);
+        fclose(u);
+    }
+
+    return 0;
+}
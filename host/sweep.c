@@ -0,0 +1,503 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+//
+// Monte Carlo detectability sweep.
+//
+// Each run renders a night of a simulation with the batch renderer, applies
+// an independent cloud realization to the cloudy outputs, bins the output
+// into exposures with photometric noise, and measures the amplitude of each
+// known frequency against the mean of the surrounding amplitude spectrum.
+// Runs start at a random update in the 2^32 update phase cycle, so the
+// relative phases of the modes change between runs as well as the clouds.
+//
+// Runs are spread over a pool of worker threads.  Each worker takes runs from
+// the front of its own range, and steals the back half of the largest range
+// that remains when its own is empty.  Every run is seeded from its index and
+// the results are combined in index order, so the output depends only on the
+// seed and not on the number of threads or the order that runs complete.
+//
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "main.h"
+#include "render.h"
+
+#define MAX_CONFIGS 64
+#define MAX_FREQUENCIES MAX_MODES
+
+// Ticks rendered at a time
+#define BLOCK_TICKS 4096
+
+// The noise around each frequency is measured over +/- NOISE_BAND resolution
+// elements (1 / night length), at NOISE_SAMPLES frequencies that are at least
+// NOISE_EXCLUSION resolution elements from any known frequency
+#define NOISE_BAND 20.0
+#define NOISE_SAMPLES 80
+#define NOISE_EXCLUSION 1.5
+
+struct config
+{
+    uint16_t id;
+    const char *name;
+    const struct simulation_definition *definition;
+    struct render_plan *plan;
+    double exptime;
+
+    // Known frequencies of channel 0 (Hz), and their amplitudes as fractions of the mean level
+    uint8_t frequency_count;
+    double frequencies[MAX_FREQUENCIES];
+    double amplitudes[MAX_FREQUENCIES];
+};
+
+struct result
+{
+    double amplitude[MAX_FREQUENCIES];
+    double snr[MAX_FREQUENCIES];
+};
+
+struct worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+
+    // Runs remaining in this worker's range
+    uint32_t next;
+    uint32_t end;
+};
+
+static struct config configs[MAX_CONFIGS];
+static uint16_t config_count = 0;
+static struct result *results;
+
+static uint32_t runs = 100;
+static uint64_t seed = 0x20140420;
+static double hours = 2;
+static double noise = 0.01;
+static double threshold = 4;
+static bool differential = false;
+
+static struct worker *workers;
+static uint16_t worker_count;
+
+static double gaussian_random(uint64_t *state)
+{
+    // Box-Muller transform
+    double u = 1 - render_random(state);
+    double v = render_random(state);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// Amplitude of the signal y(t) at frequency f, for evenly spaced times t.
+// The phase is advanced by complex multiplication rather than calling
+// cos and sin for every sample, which dominates the run time otherwise
+static double amplitude(const double *t, const double *y, uint32_t count, double f)
+{
+    double c = cos(2 * M_PI * f * t[0]), s = -sin(2 * M_PI * f * t[0]);
+    double dc = cos(2 * M_PI * f * (t[1] - t[0])), ds = -sin(2 * M_PI * f * (t[1] - t[0]));
+    double re = 0, im = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        re += y[i] * c;
+        im += y[i] * s;
+
+        double next = c * dc - s * ds;
+        s = c * ds + s * dc;
+        c = next;
+    }
+
+    return 2 * sqrt(re * re + im * im) / count;
+}
+
+// Mean amplitude near frequency f, away from any known frequency
+static double local_noise(const struct config *c, const double *t, const double *y, uint32_t count,
+                          double f, double duration)
+{
+    double resolution = 1 / duration;
+    double nyquist = 0.5 / c->exptime;
+    double sum = 0;
+    uint16_t samples = 0;
+    for (uint16_t i = 0; i < NOISE_SAMPLES; i++)
+    {
+        double g = f + resolution * NOISE_BAND * (2.0 * i / (NOISE_SAMPLES - 1) - 1);
+        if (g <= 0 || g >= nyquist)
+            continue;
+
+        bool excluded = false;
+        for (uint8_t j = 0; j < c->frequency_count; j++)
+            excluded |= fabs(g - c->frequencies[j]) < NOISE_EXCLUSION * resolution;
+
+        if (!excluded)
+        {
+            sum += amplitude(t, y, count, g);
+            samples++;
+        }
+    }
+
+    return samples ? sum / samples : INFINITY;
+}
+
+static int simulate(uint32_t index, struct result *r)
+{
+    const struct config *c = &configs[index / runs];
+    const struct simulation_definition *d = c->definition;
+    uint64_t random = seed ^ ((index + 1) * 0xD1B54A32D192ED03ULL);
+
+    uint32_t ticks = hours * 3600 / TICK_INTERVAL;
+    uint32_t count = ticks * TICK_INTERVAL / c->exptime;
+    double *t = calloc(count, sizeof(double));
+    double *y = calloc(count, sizeof(double));
+    double *exposures[CHANNEL_COUNT];
+    uint32_t *samples = calloc(count, sizeof(uint32_t));
+    float *out[CHANNEL_COUNT], *transparency = calloc(BLOCK_TICKS, sizeof(float));
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+    {
+        exposures[j] = calloc(count, sizeof(double));
+        out[j] = calloc(BLOCK_TICKS, sizeof(float));
+    }
+
+    int ret = 1;
+    if (!t || !y || !samples || !transparency || !exposures[0] || !exposures[1] || !out[0] || !out[1])
+        goto error;
+
+    struct render_cloud cloud;
+    uint64_t first = (uint64_t)(render_random(&random) * 4294967296.0);
+    if (d->cloud)
+        render_cloud_init(&cloud, d->cloud, random * 0x9E3779B97F4A7C15ULL);
+
+    // Sum the output of each update into the exposure that contains it
+    for (uint32_t done = 0; done < ticks; done += BLOCK_TICKS)
+    {
+        uint32_t n = ticks - done < BLOCK_TICKS ? ticks - done : BLOCK_TICKS;
+        render_block(c->plan, first + done, n, out);
+        if (d->cloud)
+            render_cloud_block(&cloud, n, transparency);
+
+        for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+        {
+            bool cloudy = d->cloud && d->outputs[j].cloudy;
+            for (uint32_t i = 0; i < n; i++)
+            {
+                uint32_t e = (done + i) * TICK_INTERVAL / c->exptime;
+                if (e < count)
+                {
+                    exposures[j][e] += cloudy ? out[j][i] * transparency[i] : out[j][i];
+                    samples[e] += j == 0;
+                }
+            }
+        }
+    }
+
+    // Photometric noise falls as the square root of the exposure time
+    double sigma = noise / sqrt(c->exptime);
+    double mean = 0;
+    for (uint32_t e = 0; e < count; e++)
+    {
+        for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+            exposures[j][e] *= (1 + sigma * gaussian_random(&random)) / samples[e];
+
+        t[e] = (e + 0.5) * c->exptime;
+        y[e] = differential ? exposures[0][e] / exposures[1][e] : exposures[0][e];
+        mean += y[e] / count;
+    }
+
+    for (uint32_t e = 0; e < count; e++)
+        y[e] = y[e] / mean - 1;
+
+    double duration = count * c->exptime;
+    for (uint8_t k = 0; k < c->frequency_count; k++)
+    {
+        r->amplitude[k] = amplitude(t, y, count, c->frequencies[k]);
+        r->snr[k] = r->amplitude[k] / local_noise(c, t, y, count, c->frequencies[k], duration);
+    }
+
+    ret = 0;
+error:
+    free(t);
+    free(y);
+    free(samples);
+    free(transparency);
+    for (uint8_t j = 0; j < CHANNEL_COUNT; j++)
+    {
+        free(exposures[j]);
+        free(out[j]);
+    }
+
+    return ret;
+}
+
+// Take the next run from this worker's range
+static bool take(struct worker *w, uint32_t *index)
+{
+    pthread_mutex_lock(&w->lock);
+    bool found = w->next < w->end;
+    if (found)
+        *index = w->next++;
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+// Move the back half of the largest remaining range into this worker's range
+static bool steal(struct worker *w, uint32_t *index)
+{
+    for (;;)
+    {
+        struct worker *victim = NULL;
+        uint32_t largest = 0;
+        for (uint16_t i = 0; i < worker_count; i++)
+        {
+            pthread_mutex_lock(&workers[i].lock);
+            uint32_t remaining = workers[i].end - workers[i].next;
+            pthread_mutex_unlock(&workers[i].lock);
+            if (remaining > largest)
+            {
+                largest = remaining;
+                victim = &workers[i];
+            }
+        }
+
+        if (!victim)
+            return false;
+
+        // The victim may have finished its range since it was inspected
+        pthread_mutex_lock(&victim->lock);
+        uint32_t remaining = victim->end - victim->next;
+        uint32_t stolen = (remaining + 1) / 2;
+        victim->end -= stolen;
+        uint32_t start = victim->end;
+        pthread_mutex_unlock(&victim->lock);
+        if (stolen == 0)
+            continue;
+
+        pthread_mutex_lock(&w->lock);
+        w->next = start + 1;
+        w->end = start + stolen;
+        pthread_mutex_unlock(&w->lock);
+
+        *index = start;
+        return true;
+    }
+}
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    uint32_t index;
+    while (take(w, &index) || steal(w, &index))
+        if (simulate(index, &results[index]))
+            fprintf(stderr, "Run %u failed: allocation failure\n", index);
+
+    return NULL;
+}
+
+static int load_config(struct config *c, uint16_t id, double exptime)
+{
+    struct simulation_parameters params;
+    read_simulation(id, &params);
+
+    c->id = id;
+    c->name = params.name;
+    c->definition = params.definition;
+    c->exptime = exptime > 0 ? exptime : params.exptime / 1000.0;
+    c->plan = render_plan_new(c->definition);
+    if (!c->plan)
+        return 1;
+
+    // Sinusoidal outputs are described by their modes, and other variable outputs by their period
+    const struct output_definition *o = &c->definition->outputs[0];
+    c->frequency_count = 0;
+    if (o->type == Sinusoidal)
+    {
+        for (uint8_t j = 0; j < o->mode_count; j++)
+        {
+            const struct sinusoid *m = (const struct sinusoid *)o->modes + j;
+            c->frequencies[j] = m->increment / 4294967296.0 / TICK_INTERVAL;
+            c->amplitudes[j] = (double)m->amplitude / o->level;
+        }
+
+        c->frequency_count = o->mode_count;
+    }
+    else if (o->type != Constant)
+    {
+        c->frequencies[0] = o->increment / 4294967296.0 / TICK_INTERVAL;
+        c->amplitudes[0] = NAN;
+        c->frequency_count = 1;
+    }
+
+    return 0;
+}
+
+static void report(struct config *c, struct result *r)
+{
+    printf("Simulation %u: %s\n", c->id, c->name);
+    printf("%g h, %g s exposures, %u runs, %s photometry, S/N threshold %g\n",
+           hours, c->exptime, runs, differential ? "differential" : "absolute", threshold);
+    printf("%10s  %10s  %11s  %10s  %8s  %8s\n", "freq (uHz)", "period (s)", "input (mma)",
+           "mean (mma)", "mean S/N", "detected");
+
+    for (uint8_t k = 0; k < c->frequency_count; k++)
+    {
+        double amplitude = 0, snr = 0;
+        uint32_t detected = 0;
+        for (uint32_t i = 0; i < runs; i++)
+        {
+            amplitude += r[i].amplitude[k] / runs;
+            snr += r[i].snr[k] / runs;
+            detected += r[i].snr[k] >= threshold;
+        }
+
+        printf("%10.2f  %10.1f  ", c->frequencies[k] * 1e6, 1 / c->frequencies[k]);
+        if (isnan(c->amplitudes[k]))
+            printf("%11s  ", "-");
+        else
+            printf("%11.2f  ", c->amplitudes[k] * 1000);
+
+        printf("%10.2f  %8.2f  %7.1f%%\n", amplitude * 1000, snr, 100.0 * detected / runs);
+    }
+
+    printf("\n");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-r runs] [-t threads] [-s seed] [-l hours] [-e exptime[,exptime...]]\n"
+                    "       [-n noise] [-S threshold] [-d] id [id ...]\n", name);
+    fprintf(stderr, "  -r  runs for each simulation and exposure time (default 100)\n");
+    fprintf(stderr, "  -t  worker threads (default: one per processor)\n");
+    fprintf(stderr, "  -l  length of each run in hours (default 2)\n");
+    fprintf(stderr, "  -e  exposure times in seconds (default: the recommended exposure time)\n");
+    fprintf(stderr, "  -n  fractional noise in a one second exposure (default 0.01)\n");
+    fprintf(stderr, "  -S  signal to noise ratio required for a detection (default 4)\n");
+    fprintf(stderr, "  -d  divide channel 0 by channel 1 to remove the clouds\n");
+}
+
+int main(int argc, char *argv[])
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    double exptimes[MAX_CONFIGS] = { 0 };
+    uint16_t exptime_count = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:s:l:e:n:S:d")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': runs = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 0); break;
+            case 'l': hours = atof(optarg); break;
+            case 'e':
+            {
+                exptime_count = 0;
+                for (char *s = strtok(optarg, ","); s && exptime_count < MAX_CONFIGS; s = strtok(NULL, ","))
+                    exptimes[exptime_count++] = atof(s);
+                break;
+            }
+            case 'n': noise = atof(optarg); break;
+            case 'S': threshold = atof(optarg); break;
+            case 'd': differential = true; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind >= argc || runs == 0 || threads <= 0 || hours <= 0 || exptime_count == 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+        int id = atoi(argv[i]);
+        if (id <= 0 || id > simulation_count)
+        {
+            fprintf(stderr, "Invalid simulation id: %s\n", argv[i]);
+            return 2;
+        }
+
+        for (uint16_t j = 0; j < exptime_count; j++)
+        {
+            if (config_count == MAX_CONFIGS)
+            {
+                fprintf(stderr, "Too many configurations\n");
+                return 2;
+            }
+
+            struct config *c = &configs[config_count++];
+            if (load_config(c, id, exptimes[j]))
+            {
+                fprintf(stderr, "Allocation failure\n");
+                return 1;
+            }
+
+            // Each exposure must contain at least one update, and each run at least two exposures
+            if (c->exptime < TICK_INTERVAL || c->exptime > hours * 1800)
+            {
+                fprintf(stderr, "Invalid exposure time: %gs\n", c->exptime);
+                return 2;
+            }
+        }
+    }
+
+    uint32_t total = runs * config_count;
+    results = calloc(total, sizeof(struct result));
+    worker_count = threads < total ? threads : total;
+    workers = calloc(worker_count, sizeof(struct worker));
+    if (!results || !workers)
+    {
+        fprintf(stderr, "Allocation failure\n");
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Split the runs evenly, so that stealing is only needed to balance the tail
+    for (uint16_t i = 0; i < worker_count; i++)
+    {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].next = (uint64_t)total * i / worker_count;
+        workers[i].end = (uint64_t)total * (i + 1) / worker_count;
+    }
+
+    for (uint16_t i = 0; i < worker_count; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]))
+        {
+            fprintf(stderr, "Failed to start worker thread\n");
+            return 1;
+        }
+    }
+
+    for (uint16_t i = 0; i < worker_count; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (uint16_t i = 0; i < config_count; i++)
+    {
+        report(&configs[i], &results[i * runs]);
+        render_plan_free(configs[i].plan);
+    }
+
+    // Timing goes to stderr so that the results can be compared between thread counts
+    fprintf(stderr, "%u runs in %.2f s on %u threads (%.1f runs/s)\n", total, seconds,
+            worker_count, total / seconds);
+
+    free(results);
+    free(workers);
+    return 0;
+}
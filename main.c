@@ -8,11 +8,15 @@
 #include <avr/eeprom.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <math.h>
 #include <string.h>
 #include "main.h"
 #include "cloudgen.h"
-#include "simulation.h"
+#include "playlist.h"
+#include "scheduler.h"
+#include "sync.h"
 #include "usb.h"
 
 //
@@ -29,20 +33,43 @@ struct channel
 };
 
 // Hardware outputs
-struct channel channels[CHANNEL_COUNT];
+struct channel channels[CHANNEL_COUNT] =
+{
+    { .ocr = &OCR1B, .port = &PORTC, .mask = 0x0F },
+    { .ocr = &OCR1A, .port = &PORTD, .mask = 0xF0 },
+};
 
 // Simulation output
 static struct output outputs[CHANNEL_COUNT];
 static struct cloudgen cloud;
 
 // Simulation types
-const uint8_t simulation_count = 8;
-struct simulation_parameters simulation[8];
-uint8_t active_simulation = 0;
+uint16_t active_simulation = 0;
+
+// Performance counters
+struct performance_stats stats = { .tick_min = UINT16_MAX };
+
+// Ticks that elapsed while the previous update was running
+static uint8_t missed_ticks = 0;
+
+// Total number of elapsed ticks, for calibration against the host clock
+static uint32_t tick_count = 0;
+
+// Ticks since boot, which unlike tick_count is never stepped, for timing tasks
+static uint32_t uptime_ticks = 0;
+
+// Tick count that the simulation has been advanced to
+static uint32_t update_tick = 0;
+
+// The outputs are held while a simulation is being loaded
+static volatile bool loading = false;
 
-static void channel_set_duty(uint8_t i, double duty)
+// Measured crystal frequency error in ppm (positive if the crystal runs fast)
+int16_t crystal_trim = 0;
+
+static void channel_set_duty(uint8_t i, uint16_t level)
 {
-    *(channels[i].ocr) = (uint16_t)(0x03FF*duty);
+    *(channels[i].ocr) = level >> OUTPUT_SHIFT;
 }
 
 static void channel_set_current(uint8_t i, uint8_t state)
@@ -52,11 +79,20 @@ static void channel_set_current(uint8_t i, uint8_t state)
     *channels[i].port |= masked;
 }
 
+// Firmware before 16-bit simulation ids stored a byte, leaving the high byte
+// erased.  Ids of 0xFF00 and above are never used, so these are the old format
+static uint16_t read_stored_simulation()
+{
+    uint16_t id = eeprom_read_word(MODE_EEPROM_OFFSET);
+    if ((id >> 8) == 0xFF)
+        id &= 0xFF;
+
+    return id;
+}
+
 int main(void)
 {
     // Initialize output channels
-    channels[0] = (struct channel){ .ocr = &OCR1B, .port = &PORTC, .mask = 0x0F };
-    channels[1] = (struct channel){ .ocr = &OCR1A, .port = &PORTD, .mask = 0xF0 };
     DDRB = 0x01;
     DDRC = 0x0F;
     DDRD = 0xF0;
@@ -66,95 +102,422 @@ int main(void)
     TCCR1B |= _BV(WGM12) | _BV(CS11) | _BV(CS10);
     DDRB = 0x07;
 
-    // Configure timer0 with 64us ticks to update the output channels every 16ms
+    // Configure timer0 in CTC mode with 64us ticks to update the output channels every 16.32ms
+    TCCR0A = _BV(WGM01);
+    OCR0A = TICK_TIMER_COUNTS - 1;
     TCCR0B = _BV(CS02) | _BV(CS00);
-    TIMSK0 |= _BV(TOIE0);
+    TIMSK0 |= _BV(OCIE0A);
 
-    simulation[0] = simulation_constant();
-    simulation[1] = simulation_test_ramp();
-    simulation[2] = simulation_beating();
-    simulation[3] = simulation_ec20058_realtime();
-    simulation[4] = simulation_ec20058_realtime_cloud();
-    simulation[5] = simulation_ec20058_fast();
-    simulation[6] = simulation_ec20058_fast_cloud();
-    simulation[7] = simulation_crab_pulsar_slow();
+    // An erased EEPROM reads as -1ppm, which is treated as untrimmed
+    crystal_trim = eeprom_read_word(TRIM_EEPROM_OFFSET);
+    if (crystal_trim == -1)
+        crystal_trim = 0;
 
     // Initialize other components
     usb_initialize();
-    select_simulation(eeprom_read_byte(MODE_EEPROM_OFFSET));
+    if (!playlist_initialize())
+        select_simulation(read_stored_simulation());
+
+    // Tell the host that we have booted, so it doesn't need to guess
+    usb_send_ready();
 
-    // The output is updated via a timed interrupt configured in simulation_initialize,
-    // and so we only need to poll USB in the main loop
+    // The outputs are updated by the timer0 interrupt, and the scheduler runs the
+    // tasks it posts, starting with any input received before interrupts were enabled
+    scheduler_post(TASK_USB);
     sei();
-    for (;;)
-        usb_tick();
+    scheduler_run();
+}
+
+void stats_reset()
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.tick_min = UINT16_MAX;
+    scheduler_reset_stats();
+}
+
+// Number of timer1 counts since start.
+// Timer1 free-runs through the 10-bit PWM cycle, so intervals must be shorter than 4ms
+uint16_t stats_elapsed(uint16_t start)
+{
+    return (TCNT1 - start) & 0x03FF;
+}
+
+// Evaluate sin(2*pi*phase), scaled to +/- 0xFFFF
+static int32_t sine(uint32_t phase)
+{
+    // Position within the quadrant, in units of 1/256 of a table step
+    uint32_t x = (uint16_t)(phase >> (30 - SINE_TABLE_BITS - 8));
+
+    // Second and fourth quadrants mirror the table
+    if (phase & 0x40000000UL)
+        x = ((uint32_t)SINE_TABLE_SIZE << 8) - x;
+
+    uint16_t i = x >> 8;
+    uint8_t frac = x & 0xFF;
+    int32_t value = pgm_read_word(&sine_table[i]);
+    if (frac)
+        value += ((pgm_read_word(&sine_table[i + 1]) - value) * frac) >> 8;
+
+    return (phase & 0x80000000UL) ? -value : value;
+}
+
+// Evaluate exp(-x^2) for x = offset * inverse_width, scaled to 0xFFFF
+static uint16_t gaussian(int32_t offset, uint16_t inverse_width)
+{
+    // offset is a signed 0.31 fraction of a cycle; reduce to 0.16
+    uint16_t d = (offset < 0 ? -offset : offset) >> 15;
+
+    // x in units of 1/(256*GAUSSIAN_TABLE_SCALE)
+    uint32_t x = ((uint32_t)d * inverse_width) >> (24 - 8 - 6);
+    uint16_t i = x >> 8;
+    if (i >= GAUSSIAN_TABLE_SIZE)
+        return 0;
+
+    uint8_t frac = x & 0xFF;
+    int32_t value = pgm_read_word(&gaussian_table[i]);
+    if (frac)
+        value += ((int32_t)(pgm_read_word(&gaussian_table[i + 1]) - value) * frac) >> 8;
+
+    return value;
+}
+
+// Phase advance over the elapsed ticks.
+// Catch-up steps are rare, so avoid the 32-bit multiply in the common case
+static uint32_t advance(uint32_t increment, uint8_t ticks)
+{
+    return ticks == 1 ? increment : increment * ticks;
+}
+
+// Decode the next zigzag varint delta from the wavetable stream
+static int16_t table_delta(struct table_variability *t)
+{
+    uint16_t encoded = 0;
+    uint8_t shift = 0;
+    uint8_t b;
+    do
+    {
+        b = pgm_read_byte(t->next++);
+        encoded |= (uint16_t)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    return (encoded >> 1) ^ -(int16_t)(encoded & 1);
+}
+
+// Move to the next wavetable sample, restarting the stream to
+// find the sample that follows the end of the table
+static void table_step(struct table_variability *t)
+{
+    uint16_t mask = ((uint16_t)1 << t->bits) - 1;
+    t->index = (t->index + 1) & mask;
+    t->value = t->following;
+    if (t->index == mask)
+    {
+        t->next = t->data;
+        t->following = 0;
+    }
+
+    t->following += table_delta(t);
+}
+
+// Fraction of the blocked flux from an eclipse, scaled to 0xFFFF
+static uint16_t eclipse(struct eclipse *e, uint32_t phase)
+{
+    // Eclipses may straddle the start of the period
+    int32_t offset = phase - e->offset;
+    uint32_t distance = offset < 0 ? -(uint32_t)offset : (uint32_t)offset;
+    if (distance >= e->half_width)
+        return 0;
+
+    uint32_t x = ((distance >> e->shift) * e->scale) >> 16;
+    uint8_t i = x >> 8;
+    uint8_t frac = x & 0xFF;
+    int32_t value = e->profile[i];
+    if (frac)
+        value += ((int32_t)(e->profile[i + 1] - value) * frac) >> 8;
+
+    return value;
+}
+
+static uint16_t clamp_output(int32_t level)
+{
+    if (level < 0)
+        return 0;
+    if (level > OUTPUT_MAX)
+        return OUTPUT_MAX;
+    return level;
+}
+
+static uint16_t attenuate(uint16_t level, uint16_t attenuation)
+{
+    uint32_t attenuated = ((uint32_t)level * attenuation) >> CLOUD_SHIFT;
+    return attenuated > OUTPUT_MAX ? OUTPUT_MAX : attenuated;
+}
+
+static inline uint32_t advance_phase(uint32_t *phase, uint32_t increment, uint8_t ticks)
+{
+    return *phase += advance(increment, ticks);
+}
+
+// Increment a mode phase and return its contribution to the intensity
+static inline int32_t sinusoid_mode(struct sinusoid *m, uint8_t ticks)
+{
+    advance_phase(&m->phase, m->increment, ticks);
+    return (m->amplitude * sine(m->phase)) >> 16;
+}
+
+static inline uint32_t gaussian_pulse(const struct gaussian *p, uint32_t phase)
+{
+    // Pulses don't wrap around the end of the period
+    int32_t offset = (phase >> 1) - (p->offset >> 1);
+    return ((uint32_t)p->amplitude * gaussian(offset, p->inverse_width)) >> 16;
 }
 
-static double tick_output(struct output *o, double dt)
+static inline uint16_t ramp_output(struct output *o, uint32_t phase)
 {
-    // Tick the simulation of the specified channel and return the current intensity
+    return clamp_output(((uint32_t)o->level * (phase >> 16)) >> 16);
+}
+
+static inline uint16_t ramp_level(struct output *o, uint8_t ticks)
+{
+    struct ramp_variability *r = &o->ramp;
+    return ramp_output(o, advance_phase(&r->phase, r->increment, ticks));
+}
+
+static inline uint16_t table_level(struct table_variability *t, uint8_t ticks)
+{
+    advance_phase(&t->phase, t->increment, ticks);
+
+    // Decode forward to the sample preceding the new phase.
+    // This is a single step unless the table has more than one sample per tick
+    uint16_t index = t->phase >> (32 - t->bits);
+    while (t->index != index)
+        table_step(t);
+
+    // Linearly interpolate to the phase between samples
+    uint16_t frac = (t->phase << t->bits) >> 16;
+    int32_t delta = (int32_t)t->following - t->value;
+    return clamp_output(((int32_t)t->value << WAVETABLE_SHIFT) + ((delta * frac) >> (16 - WAVETABLE_SHIFT)));
+}
+
+static inline uint16_t eclipse_level(struct output *o, uint32_t blocked)
+{
+    if (blocked > 0xFFFF)
+        blocked = 0xFFFF;
+
+    return clamp_output((int32_t)o->level - (((uint32_t)o->level * blocked) >> 16));
+}
+
+static uint16_t tick_output(struct output *o, uint8_t ticks)
+{
+    // Advance the simulation of the specified channel by the elapsed
+    // number of ticks and return the current intensity
     switch (o->type)
     {
         case Sinusoidal:
         {
-            struct sinusoid_variability *s = &o->sinusoid;
-
             // Increment mode phases and calculate new brightness
-            double mma = 0;
-            for (uint8_t j = 0; j < s->mode_count; j++)
-            {
-                struct sinusoid *m = &s->modes[j];
-                m->phase += m->freq*dt;
-                while (m->phase > 1)
-                    m->phase -= 1;
-
-                mma += m->mma*sin(2*M_PI*m->phase);
-            }
-
-            return (1 + mma/1000);
+            int32_t level = o->level;
+            for (uint8_t j = 0; j < o->sinusoid.mode_count; j++)
+                level += sinusoid_mode(&o->sinusoid.modes[j], ticks);
+            return clamp_output(level);
         }
 
         case Ramp:
+            return ramp_level(o, ticks);
+
+        case Gaussian:
         {
-            struct ramp_variability *r = &o->ramp;
+            struct gaussian_variability *g = &o->gaussian;
+            uint32_t phase = advance_phase(&g->phase, g->increment, ticks);
+
+            int32_t level = 0;
+            for (uint8_t j = 0; j < g->mode_count; j++)
+                level += gaussian_pulse(&g->modes[j], phase);
+            return clamp_output(level);
+        }
 
-            r->accumulated += dt;
+        case Table:
+            return table_level(&o->table, ticks);
 
-            if (r->accumulated > r->period)
-                r->accumulated -= r->period;
+        case Eclipse:
+        {
+            struct eclipse_variability *v = &o->eclipse;
+            uint32_t phase = advance_phase(&v->phase, v->increment, ticks);
 
-            return r->accumulated / r->period;
+            uint32_t blocked = 0;
+            for (uint8_t j = 0; j < v->eclipse_count; j++)
+                blocked += eclipse(&v->eclipses[j], phase);
+            return eclipse_level(o, blocked);
         }
 
-        case Gaussian:
+        default:
+            return clamp_output(o->level);
+    }
+}
+
+// Advance every channel through the generic engine
+static void update_generic(uint8_t ticks)
+{
+    // Calculate cloud attenuation
+    uint16_t attenuation = cloudgen_step(&cloud, ticks);
+
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    {
+        uint16_t level = tick_output(&outputs[i], ticks);
+        if (outputs[i].cloudy)
+            level = attenuate(level, attenuation);
+
+        channel_set_duty(i, level);
+    }
+}
+
+// Specialized update generated by simc for each simulation
+struct simulation_update
+{
+    void (*update)(uint8_t ticks);
+
+    // Channels with the same waveform share its evaluation, and only the first
+    // advances its phases.  Copies them to the others before the generic
+    // engine takes over, or NULL if no channels are shared
+    void (*copy_phases)();
+};
+
+// Defines the update functions and simulation_updates, indexed by id - 1
+#include "updates.h"
+
+// The update used for the running simulation
+static void (*active_update)(uint8_t ticks) = update_generic;
+static void (*active_copy_phases)() = NULL;
+
+// Correct a per-tick phase increment for the measured crystal error.
+// A fast crystal shortens the tick, so the phase must advance less per tick
+static uint32_t trim_increment(uint32_t increment)
+{
+    // The tick length is disciplined directly while synchronized
+    if (sync_active())
+        return increment;
+
+    return increment - (int64_t)increment * crystal_trim / 1000000;
+}
+
+// Number of annuli used to integrate the eclipsed flux
+#define ECLIPSE_ANNULI 16
+
+// Fraction of the light from a limb-darkened star that is blocked by a disk
+// of radius k at a separation z (both in units of the stellar radius)
+static float eclipse_blocked(float k, float z, float u1, float u2)
+{
+    float inner = z > k ? z - k : 0;
+    float outer = z + k < 1 ? z + k : 1;
+    if (outer <= inner)
+        return 0;
+
+    // Sum the covered arc of each annulus, weighted by its brightness
+    float dr = (outer - inner) / ECLIPSE_ANNULI;
+    float blocked = 0;
+    for (uint8_t i = 0; i < ECLIPSE_ANNULI; i++)
+    {
+        float r = inner + (i + 0.5f) * dr;
+        float angle = (float)M_PI;
+        if (r > k - z)
         {
-            struct gaussian_variability *g = &o->gaussian;
+            float c = (r * r + z * z - k * k) / (2 * r * z);
+            angle = c >= 1 ? 0 : c <= -1 ? (float)M_PI : acosf(c);
+        }
+
+        float w = 1 - sqrtf(1 - r * r);
+        blocked += (1 - u1 * w - u2 * w * w) * angle * r;
+    }
 
-            g->accumulated += dt;
+    return 2 * blocked * dr / ((float)M_PI * (1 - u1 / 3 - u2 / 6));
+}
+
+// Tabulate the eclipse profile.  This uses floating point, and so is
+// much too slow for the timer interrupt, but is only done once per load
+static void load_eclipse(struct eclipse *e, const struct eclipse_definition *d)
+{
+    e->offset = d->offset;
+    e->half_width = d->half_width;
+
+    e->shift = 0;
+    while ((e->half_width >> e->shift) > 0xFFFF)
+        e->shift++;
+    e->scale = ((uint32_t)ECLIPSE_TABLE_SIZE << 24) / (e->half_width >> e->shift);
+
+    float k = d->radius / 32768.0f;
+    float b = d->impact / 32768.0f;
+    float u1 = d->u1 / 16384.0f;
+    float u2 = d->u2 / 16384.0f;
+
+    // Separation runs along the chord from mid-eclipse to last contact
+    float chord = (1 + k) * (1 + k) - b * b;
+    for (uint8_t i = 0; i <= ECLIPSE_TABLE_SIZE; i++)
+    {
+        float x = (float)i / ECLIPSE_TABLE_SIZE;
+        float blocked = eclipse_blocked(k, sqrtf(b * b + x * x * chord), u1, u2);
+        e->profile[i] = blocked >= 1 ? 0xFFFF : blocked <= 0 ? 0 : (uint16_t)(blocked * 0xFFFF + 0.5f);
+    }
+}
 
-            if (g->accumulated > g->period)
-                g->accumulated -= g->period;
+static void load_output(struct output *o, const struct output_definition *d)
+{
+    o->current = d->current;
+    o->level = d->level;
+    o->cloudy = d->cloudy;
+    o->type = d->type;
 
-            double phase = g->accumulated / g->period;
-            double intensity = 0;
-            for (uint8_t j = 0; j < g->mode_count; j++)
+    switch (d->type)
+    {
+        case Sinusoidal:
+            o->sinusoid.mode_count = d->mode_count;
+            memcpy_P(o->sinusoid.modes, d->modes, d->mode_count*sizeof(struct sinusoid));
+            for (uint8_t j = 0; j < d->mode_count; j++)
+                o->sinusoid.modes[j].increment = trim_increment(o->sinusoid.modes[j].increment);
+            break;
+        case Gaussian:
+            o->gaussian.mode_count = d->mode_count;
+            o->gaussian.increment = trim_increment(d->increment);
+            memcpy_P(o->gaussian.modes, d->modes, d->mode_count*sizeof(struct gaussian));
+            break;
+        case Ramp:
+            o->ramp.increment = trim_increment(d->increment);
+            break;
+        case Eclipse:
+        {
+            o->eclipse.eclipse_count = d->mode_count;
+            o->eclipse.increment = trim_increment(d->increment);
+            for (uint8_t j = 0; j < d->mode_count; j++)
             {
-                struct gaussian *p = &g->modes[j];
-                double x = (phase - p->offset)/p->width;
-                intensity += p->amplitude * exp(-x*x);
+                struct eclipse_definition e;
+                memcpy_P(&e, (const struct eclipse_definition *)d->modes + j, sizeof(struct eclipse_definition));
+                load_eclipse(&o->eclipse.eclipses[j], &e);
             }
-
-            return intensity;
+            break;
+        }
+        case Table:
+        {
+            // Start at the last sample, so that the first update steps to the beginning
+            struct table_variability *t = &o->table;
+            t->increment = trim_increment(d->increment);
+            t->data = t->next = d->modes;
+            t->bits = d->mode_count;
+            t->index = ((uint16_t)1 << t->bits) - 1;
+            t->following = table_delta(t);
+            break;
         }
-        
         case Constant:
-            return 1;
+            break;
     }
+}
 
-    return 0;
+void read_simulation(uint16_t simulation_type, struct simulation_parameters *params)
+{
+    // Simulation IDs are 1-indexed to make user-friendlier ids.
+    memcpy_P(params, &simulation[simulation_type-1], sizeof(struct simulation_parameters));
 }
 
-void select_simulation(uint8_t simulation_type)
+void select_simulation(uint16_t simulation_type)
 {
     // Sanity check input - reset to the first definition on error
     // Simulation IDs are 1-indexed to make user-friendlier ids.
@@ -165,18 +528,47 @@ void select_simulation(uint8_t simulation_type)
     }
 
     // Save choice
+    eeprom_update_word(MODE_EEPROM_OFFSET, simulation_type);
+
+    uint32_t start;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        start = tick_count;
+
+    start_simulation(simulation_type, start);
+}
+
+// Load a simulation without saving it as the power-on default.
+// The first update advances the phases by the ticks elapsed since start
+void start_simulation(uint16_t simulation_type, uint32_t start)
+{
+    if (simulation_type == 0 || simulation_type > simulation_count)
+        simulation_type = 1;
+
     active_simulation = simulation_type;
-    eeprom_update_byte(MODE_EEPROM_OFFSET, simulation_type);
+    loading = true;
 
     // Clear existing parameters
     memset(&cloud, 0, sizeof(cloud));
     memset(outputs, 0, sizeof(outputs));
 
-    // Load new parameters
-    (simulation[simulation_type-1].initialize)(&cloud, outputs);
+    // Load new parameters from flash
+    struct simulation_parameters params;
+    read_simulation(simulation_type, &params);
+
+    struct simulation_definition definition;
+    memcpy_P(&definition, params.definition, sizeof(definition));
+
+    if (definition.cloud)
+    {
+        cloud.enabled = true;
+        memcpy_P(&cloud.parameters, definition.cloud, sizeof(struct cloud_parameters));
+    }
+
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+        load_output(&outputs[i], &definition.outputs[i]);
 
     // Set internal/external LED
-    if (!simulation[simulation_type-1].external)
+    if (!params.external)
         PORTB |= 0x01;
 
     // Initialize simulation
@@ -184,30 +576,352 @@ void select_simulation(uint8_t simulation_type)
     for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
     {
         channel_set_current(i, outputs[i].current);
-        channel_set_duty(i, outputs[i].pwm_duty);
+        channel_set_duty(i, outputs[i].level);
+    }
+
+    struct simulation_update update;
+    memcpy_P(&update, &simulation_updates[simulation_type - 1], sizeof(update));
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        active_update = update.update;
+        active_copy_phases = update.copy_phases;
+        update_tick = start;
+        loading = false;
     }
 
     // Notify the user of the change
-    usb_send_simulation_changed(simulation_type);
+    usb_send_simulation_changed();
 }
 
-// Intensity update interrupt.
-// Called every 16.32 ms +/- clock tolerance when timer0 overflows
-ISR(TIMER0_OVF_vect)
+// Phase and increment of a sinusoidal mode, or of a channel with another
+// variability type.  Returns NULL if the channel has no such phase
+static uint32_t *output_phase(struct output *o, uint8_t index, uint32_t **increment)
+{
+    switch (o->type)
+    {
+        case Sinusoidal:
+            if (index >= o->sinusoid.mode_count)
+                return NULL;
+            *increment = &o->sinusoid.modes[index].increment;
+            return &o->sinusoid.modes[index].phase;
+        case Gaussian:
+            *increment = &o->gaussian.increment;
+            return &o->gaussian.phase;
+        case Ramp:
+            *increment = &o->ramp.increment;
+            return &o->ramp.phase;
+        case Table:
+            *increment = &o->table.increment;
+            return &o->table.phase;
+        case Eclipse:
+            *increment = &o->eclipse.increment;
+            return &o->eclipse.phase;
+        default:
+            return NULL;
+    }
+}
+
+// Channels that share a waveform in the specialized update may be about to
+// differ.  Called once a change has been validated, before it is applied,
+// so that the update never mixes the old and new values
+static void unshare_outputs()
 {
-    const double dt = 0.01632;
+    if (active_copy_phases)
+        use_generic_update();
+}
 
-    // Calculate cloud attenuation
-    double attenuation = cloudgen_step(&cloud, dt);
+// Mode amplitudes are stored in output units, so are rescaled with the level
+static bool set_level(struct output *o, int32_t value)
+{
+    if (value < 0 || value > OUTPUT_MAX || o->type == Table)
+        return false;
 
-    // Update the four output channels
-    for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+    // Amplitudes can't be recovered from a zero level, and stay at zero
+    int32_t amplitudes[MAX_MODES];
+    uint8_t count = o->type == Sinusoidal ? o->sinusoid.mode_count : o->type == Gaussian ? o->gaussian.mode_count : 0;
+    for (uint8_t j = 0; j < count; j++)
     {
-        double intensity = tick_output(&outputs[i], dt);
+        int32_t a = o->type == Sinusoidal ? o->sinusoid.modes[j].amplitude : o->gaussian.modes[j].amplitude;
+        amplitudes[j] = o->level ? (int64_t)a * value / o->level : 0;
+        if (o->type == Sinusoidal ? amplitudes[j] < INT16_MIN || amplitudes[j] > INT16_MAX : amplitudes[j] > UINT16_MAX)
+            return false;
+    }
 
-        if (outputs[i].cloudy)
-            intensity *= attenuation;
+    unshare_outputs();
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        o->level = value;
+        for (uint8_t j = 0; j < count; j++)
+        {
+            if (o->type == Sinusoidal)
+                o->sinusoid.modes[j].amplitude = amplitudes[j];
+            else
+                o->gaussian.modes[j].amplitude = amplitudes[j];
+        }
+    }
+
+    return true;
+}
+
+static bool set_amplitude(struct output *o, uint8_t index, int32_t value)
+{
+    int32_t amplitude = (int64_t)o->level * value / 1000000;
+    if (o->type == Sinusoidal && index < o->sinusoid.mode_count &&
+        amplitude >= INT16_MIN && amplitude <= INT16_MAX)
+    {
+        unshare_outputs();
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+            o->sinusoid.modes[index].amplitude = amplitude;
+        return true;
+    }
+
+    if (o->type == Gaussian && index < o->gaussian.mode_count &&
+        amplitude >= 0 && amplitude <= UINT16_MAX)
+    {
+        unshare_outputs();
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+            o->gaussian.modes[index].amplitude = amplitude;
+        return true;
+    }
+
+    return false;
+}
+
+static bool set_phase(struct output *o, uint8_t index, uint32_t value)
+{
+    uint32_t *increment;
+    uint32_t *phase = output_phase(o, index, &increment);
+    if (!phase)
+        return false;
+
+    unshare_outputs();
+    if (o->type != Table)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+            *phase = value;
+        return true;
+    }
+
+    // The table decoder only steps forwards, so restart a copy from the
+    // beginning and decode up to the new phase outside the interrupt
+    struct table_variability t;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        t = o->table;
 
-        channel_set_duty(i, intensity*outputs[i].pwm_duty);
+    t.next = t.data;
+    t.index = ((uint16_t)1 << t.bits) - 1;
+    t.following = table_delta(&t);
+    t.phase = value;
+
+    uint16_t sample = value >> (32 - t.bits);
+    while (t.index != sample)
+        table_step(&t);
+
+    // The increment may have changed while decoding
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        t.increment = o->table.increment;
+        o->table = t;
+    }
+
+    return true;
+}
+
+static bool set_cloud_parameter(uint8_t parameter, int32_t value)
+{
+    struct cloud_parameters p = cloud.parameters;
+    switch (parameter)
+    {
+        case ParamCloudMinPeriod: p.min_period = value; break;
+        case ParamCloudMaxPeriod: p.max_period = value; break;
+        case ParamCloudMinIntensity: p.min_intensity = value; break;
+        case ParamCloudMaxIntensity: p.max_intensity = value; break;
+        default: return false;
+    }
+
+    // New bounds apply from the next control point
+    bool intensity = parameter == ParamCloudMinIntensity || parameter == ParamCloudMaxIntensity;
+    if (!cloud.enabled || value <= 0 || (intensity && value > CLOUD_UNITY) ||
+        p.min_period > p.max_period || p.min_intensity > p.max_intensity)
+        return false;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        cloud.parameters = p;
+
+    return true;
+}
+
+// Update a single parameter of the running simulation without resetting any
+// phases or the cloud state.  Returns false (and changes nothing) if the
+// parameter doesn't apply to the channel or mode, or the value is out of range
+bool set_parameter(uint8_t channel, uint8_t parameter, uint8_t index, int32_t value)
+{
+    if (parameter >= ParamCloudMinPeriod)
+        return set_cloud_parameter(parameter, value);
+
+    if (channel >= CHANNEL_COUNT)
+        return false;
+
+    struct output *o = &outputs[channel];
+    switch (parameter)
+    {
+        case ParamLevel:
+            if (!set_level(o, value))
+                return false;
+
+            // The specialized updates never write constant clear-sky channels
+            if (o->type == Constant && !(o->cloudy && cloud.enabled))
+                channel_set_duty(channel, o->level);
+            return true;
+        case ParamCurrent:
+            if (value != cDisabled && value != c5uA && value != c50uA && value != c500uA && value != c5mA)
+                return false;
+            o->current = value;
+            channel_set_current(channel, value);
+            return true;
+        case ParamFrequency:
+        {
+            // Changing only the increment keeps the phase continuous
+            uint32_t *increment;
+            if (!output_phase(o, index, &increment))
+                return false;
+
+            uint32_t trimmed = trim_increment((uint32_t)value);
+            unshare_outputs();
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                *increment = trimmed;
+            return true;
+        }
+        case ParamAmplitude:
+            return set_amplitude(o, index, value);
+        case ParamPhase:
+            return set_phase(o, index, (uint32_t)value);
+        default:
+            return false;
+    }
+}
+
+// Run the active simulation through the generic engine until the next one is loaded
+void use_generic_update()
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (active_copy_phases)
+            active_copy_phases();
+        active_copy_phases = NULL;
+        active_update = update_generic;
+    }
+}
+
+bool using_generic_update()
+{
+    return active_update == update_generic;
+}
+
+// Store a new crystal trim and restart the active simulation to apply it
+void set_crystal_trim(int16_t ppm)
+{
+    // -1 is reserved for the erased state
+    if (ppm == -1)
+        ppm = 0;
+
+    crystal_trim = ppm;
+    eeprom_update_word(TRIM_EEPROM_OFFSET, ppm);
+
+    uint32_t start;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        start = tick_count;
+
+    start_simulation(active_simulation, start);
+}
+
+// Read a count that advances every tick, with the timer0 counts into the current tick
+static uint32_t read_ticks(const uint32_t *count, uint8_t *counts)
+{
+    uint32_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        ticks = *count + missed_ticks;
+        *counts = TCNT0;
+
+        // Account for a compare match that hasn't been serviced yet
+        if ((TIFR0 & _BV(OCF0A)) && *counts < OCR0A)
+            ticks++;
+    }
+
+    return ticks;
+}
+
+// Returns the number of elapsed ticks, and the timer0 counts into the current tick
+uint32_t read_tick_count(uint8_t *counts)
+{
+    return read_ticks(&tick_count, counts);
+}
+
+// As read_tick_count, but ignoring any steps made by step_tick_count
+uint32_t read_uptime(uint8_t *counts)
+{
+    return read_ticks(&uptime_ticks, counts);
+}
+
+// Move the tick count by a whole number of ticks, e.g. onto a shared timeline.
+// The simulation catches up (or holds) until it reaches the new count
+void step_tick_count(int32_t ticks)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        tick_count += ticks;
+}
+
+// Advance the simulation to the current tick count and update the output channels
+static void update_outputs()
+{
+    // Advance by the true elapsed time, collapsing any missed ticks (or
+    // those since a playlist entry started) into a single catch-up step.
+    // Longer gaps are spread over several updates, and the outputs are
+    // held while the tick count is behind the simulation
+    int32_t elapsed = tick_count - update_tick;
+    if (elapsed <= 0)
+        return;
+
+    uint8_t ticks = elapsed > UINT8_MAX ? UINT8_MAX : elapsed;
+    update_tick += ticks;
+
+    active_update(ticks);
+}
+
+// Intensity update interrupt.
+// Called every 16.32 ms +/- clock tolerance when timer0 reaches OCR0A
+ISR(TIMER0_COMPA_vect)
+{
+    uint16_t start = TCNT1;
+
+    // Set the length of the next tick
+    OCR0A = TICK_TIMER_COUNTS - 1 - sync_update();
+
+    tick_count += 1 + missed_ticks;
+    uptime_ticks += 1 + missed_ticks;
+    missed_ticks = 0;
+    playlist_update(tick_count);
+
+    if (!loading)
+        update_outputs();
+
+    uint16_t elapsed = stats_elapsed(start);
+    if (elapsed < stats.tick_min)
+        stats.tick_min = elapsed;
+    if (elapsed > stats.tick_max)
+        stats.tick_max = elapsed;
+
+    // The compare flag is cleared on entry, so if it is set again then
+    // timer0 has reached OCR0A while the update was running (or while the
+    // interrupt was blocked).  Clear the pending interrupt and account for
+    // the tick in the next update instead of running a second update now.
+    // The flag can only record one missed tick, so simc checks that the
+    // longest catch-up update fits within the shortest tick
+    if (TIFR0 & _BV(OCF0A))
+    {
+        TIFR0 = _BV(OCF0A);
+        missed_ticks++;
+        stats.tick_overruns++;
     }
-}
\ No newline at end of file
+}
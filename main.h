@@ -10,13 +10,56 @@
 
 #include <stdbool.h>
 #include <stdint.h>
-#include "simulation.h"
+#include <avr/pgmspace.h>
 
 // Number of output channels
 #define CHANNEL_COUNT 2
 
 // Where the active configuration mode is stored
-#define MODE_EEPROM_OFFSET (uint8_t *)(0x00)
+#define MODE_EEPROM_OFFSET (uint16_t *)(0x00)
+
+// Where the crystal trim (in ppm) is stored
+#define TRIM_EEPROM_OFFSET (uint16_t *)(0x02)
+
+// Where the playlist is stored
+#define PLAYLIST_EEPROM_OFFSET (uint8_t *)(0x10)
+
+// Outputs are updated each time timer0 counts TICK_TIMER_COUNTS
+// periods of the prescaled clock, giving exactly 16.32ms at 16MHz
+#define TICK_PRESCALER 1024
+#define TICK_TIMER_COUNTS 255
+
+// Interval between output updates, in seconds
+#define TICK_INTERVAL ((double)TICK_TIMER_COUNTS * TICK_PRESCALER / F_CPU)
+
+// Output intensities are expressed in 1/64ths of a 10-bit PWM count
+#define OUTPUT_SHIFT 6
+#define OUTPUT_MAX ((uint16_t)0x03FF << OUTPUT_SHIFT)
+
+// Cloud attenuation is expressed as a Q15 fraction
+#define CLOUD_SHIFT 15
+#define CLOUD_UNITY ((uint16_t)1 << CLOUD_SHIFT)
+
+// Cloud periods are expressed in 1/65536ths of a tick
+#define CLOUD_TICK ((uint32_t)1 << 16)
+
+// The sine lookup table covers a quarter wave
+#define SINE_TABLE_BITS 8
+#define SINE_TABLE_SIZE (1 << SINE_TABLE_BITS)
+
+// The gaussian lookup table covers exp(-x^2) for 0 <= x < 4
+#define GAUSSIAN_TABLE_BITS 8
+#define GAUSSIAN_TABLE_SIZE (1 << GAUSSIAN_TABLE_BITS)
+#define GAUSSIAN_TABLE_SCALE 64
+
+// Eclipse profiles are tabulated from mid-eclipse to last contact
+#define ECLIPSE_TABLE_BITS 5
+#define ECLIPSE_TABLE_SIZE (1 << ECLIPSE_TABLE_BITS)
+#define MAX_ECLIPSES 2
+
+// Wavetable samples are stored in units of 1/4 PWM count
+#define WAVETABLE_SHIFT 4
+#define WAVETABLE_MAX (OUTPUT_MAX >> WAVETABLE_SHIFT)
 
 enum current_value
 {
@@ -32,14 +75,20 @@ enum variability_type
     Constant = 0,
     Sinusoidal = 1,
     Gaussian = 2,
-    Ramp = 3
+    Ramp = 3,
+    Table = 4,
+    Eclipse = 5
 };
 
+// Phases are unsigned 32-bit fractions of a cycle, which advance by a
+// precomputed increment each tick and wrap naturally on overflow.
 struct sinusoid
 {
-    double freq;
-    double mma;
-    double phase;
+    uint32_t increment;
+    uint32_t phase;
+
+    // Semi-amplitude in output units
+    int16_t amplitude;
 };
 
 // Maximum number of pulsation modes per output
@@ -53,29 +102,95 @@ struct sinusoid_variability
 
 struct gaussian
 {
-    double amplitude;
-    double offset;
-    double width;
+    // Pulse center as a fraction of the period
+    uint32_t offset;
+
+    // Reciprocal of the pulse width as an 8.8 fixed-point value
+    uint16_t inverse_width;
+
+    // Peak intensity in output units
+    uint16_t amplitude;
 };
 
 struct gaussian_variability
 {
     uint8_t mode_count;
     struct gaussian modes[MAX_MODES];
-    double period;
-    double accumulated;
+    uint32_t increment;
+    uint32_t phase;
 };
 
 struct ramp_variability
 {
-    double period;
-    double accumulated;
+    uint32_t increment;
+    uint32_t phase;
+};
+
+// A periodic waveform sampled at 2^bits evenly spaced phases.
+// The samples are stored in flash as a stream of zigzag-encoded varint
+// deltas (the first relative to zero), which is decoded one sample at a
+// time as the phase advances.
+struct table_variability
+{
+    const uint8_t *data;
+    const uint8_t *next;
+    uint8_t bits;
+
+    // Samples either side of the current phase, in wavetable units
+    uint16_t index;
+    uint16_t value;
+    uint16_t following;
+
+    uint32_t increment;
+    uint32_t phase;
+};
+
+// Flash-resident description of an eclipse or transit, generated by simc
+struct eclipse_definition
+{
+    // Mid-eclipse and half of the total (first to last contact)
+    // duration, as fractions of the period
+    uint32_t offset;
+    uint32_t half_width;
+
+    // Radius ratio and impact parameter as Q15 fractions of the stellar radius
+    uint16_t radius;
+    uint16_t impact;
+
+    // Quadratic limb darkening coefficients as Q14 values
+    int16_t u1;
+    int16_t u2;
+};
+
+struct eclipse
+{
+    uint32_t offset;
+    uint32_t half_width;
+
+    // Converts the distance from mid-eclipse into table units:
+    // ((distance >> shift) * scale) >> 16 is 256 times the table index
+    uint8_t shift;
+    uint32_t scale;
+
+    // Fraction of the flux blocked at evenly spaced times from
+    // mid-eclipse to last contact, scaled to 0xFFFF
+    uint16_t profile[ECLIPSE_TABLE_SIZE + 1];
+};
+
+struct eclipse_variability
+{
+    uint8_t eclipse_count;
+    struct eclipse eclipses[MAX_ECLIPSES];
+    uint32_t increment;
+    uint32_t phase;
 };
 
 struct output
 {
     enum current_value current;
-    double pwm_duty;
+
+    // Mean intensity in output units
+    uint16_t level;
     bool cloudy;
 
     enum variability_type type;
@@ -84,24 +199,58 @@ struct output
         struct sinusoid_variability sinusoid;
         struct gaussian_variability gaussian;
         struct ramp_variability ramp;
+        struct table_variability table;
+        struct eclipse_variability eclipse;
     };
 };
 
+struct cloud_parameters
+{
+    // Control point spacing, in units of CLOUD_TICK
+    uint32_t min_period;
+    uint32_t max_period;
+
+    // Transparency as a fraction of CLOUD_UNITY
+    uint16_t min_intensity;
+    uint16_t max_intensity;
+    uint16_t initial_intensity;
+};
+
 struct cloudgen
 {
     bool enabled;
-    double min_period;
-    double max_period;
-    double min_intensity;
-    double max_intensity;
-    double initial_intensity;
-
-    double next_period;
-    double accumulated_time;
+    struct cloud_parameters parameters;
+
+    uint32_t next_period;
+    uint32_t accumulated_time;
+    uint32_t period_scale;
     uint8_t start;
 
     // A circular buffer of the 4 control points for weighted-linear interpolation
-    double points[4];
+    uint16_t points[4];
+};
+
+// Flash-resident description of an output, generated by simc.
+// The modes pointer refers to an array of struct sinusoid, struct gaussian
+// or struct eclipse_definition in program memory, depending on the variability type.  Table outputs
+// point to the encoded sample stream, and store the table size (in bits)
+// in mode_count.
+struct output_definition
+{
+    enum current_value current;
+    uint16_t level;
+    bool cloudy;
+    enum variability_type type;
+    uint8_t mode_count;
+    uint32_t increment;
+    const void *modes;
+};
+
+struct simulation_definition
+{
+    // NULL when the simulation has clear skies
+    const struct cloud_parameters *cloud;
+    struct output_definition outputs[CHANNEL_COUNT];
 };
 
 struct simulation_parameters
@@ -110,12 +259,82 @@ struct simulation_parameters
     const char *desc;
     uint16_t exptime;
     bool external;
-    void (*initialize)(struct cloudgen *, struct output *);
+    const struct simulation_definition *definition;
 };
 
-extern const uint8_t simulation_count;
-extern struct simulation_parameters simulation[];
-extern uint8_t active_simulation;
-void select_simulation(uint8_t simulation_type);
+// Parameters of the running simulation that can be changed by set_parameter
+enum simulation_parameter
+{
+    // Mean intensity of a channel in output units.  Mode amplitudes are
+    // rescaled to keep their size relative to the mean
+    ParamLevel = 0,
+
+    // A channel's current_value
+    ParamCurrent = 1,
+
+    // Untrimmed phase increment per tick of a sinusoidal mode, or of a
+    // channel with another variability type.  The phase is unchanged
+    ParamFrequency = 2,
+
+    // Amplitude of a sinusoidal mode or gaussian pulse, in millionths of the channel level
+    ParamAmplitude = 3,
+
+    // Phase of a sinusoidal mode, or of a channel with another variability type
+    ParamPhase = 4,
+
+    // Cloud control point spacing (CLOUD_TICK units) and transparency (CLOUD_UNITY units)
+    ParamCloudMinPeriod = 5,
+    ParamCloudMaxPeriod = 6,
+    ParamCloudMinIntensity = 7,
+    ParamCloudMaxIntensity = 8
+};
+
+// Runtime performance counters, reported by the STATS packet.
+// Durations are measured in timer1 counts (4us, or 64 cpu cycles)
+#define STATS_COUNT_CYCLES 64
+struct performance_stats
+{
+    uint16_t tick_min;
+    uint16_t tick_max;
+    uint16_t tick_overruns;
+    uint16_t rx_overflows;
+
+    // Packets that found the output buffer full, and log messages dropped as a result
+    uint16_t tx_full;
+    uint16_t tx_dropped;
+    uint8_t output_high_water;
+    uint8_t input_high_water;
+    uint16_t checksum_errors;
+    uint16_t footer_errors;
+    uint16_t long_packets;
+    uint16_t unknown_packets;
+};
+
+extern const uint16_t sine_table[SINE_TABLE_SIZE + 1];
+extern const uint16_t gaussian_table[GAUSSIAN_TABLE_SIZE + 1];
+
+// The simulation catalog is generated by simc and lives in flash.
+// Entries must be copied into RAM with read_simulation before use.
+extern const uint16_t simulation_count;
+extern const uint32_t catalog_hash;
+extern const struct simulation_parameters simulation[] PROGMEM;
+extern uint16_t active_simulation;
+void read_simulation(uint16_t simulation_type, struct simulation_parameters *params);
+void select_simulation(uint16_t simulation_type);
+void start_simulation(uint16_t simulation_type, uint32_t start);
+
+bool set_parameter(uint8_t channel, uint8_t parameter, uint8_t index, int32_t value);
+void use_generic_update();
+bool using_generic_update();
+
+extern int16_t crystal_trim;
+void set_crystal_trim(int16_t ppm);
+uint32_t read_tick_count(uint8_t *counts);
+uint32_t read_uptime(uint8_t *counts);
+void step_tick_count(int32_t ticks);
+
+extern struct performance_stats stats;
+void stats_reset();
+uint16_t stats_elapsed(uint16_t start);
 
 #endif
@@ -0,0 +1,192 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+#include "main.h"
+#include "playlist.h"
+#include "scheduler.h"
+
+//
+// A sequence of simulations that are stepped through on exact tick count
+// boundaries.  The timer interrupt posts the playlist task when an entry
+// ends, and the task loads the next simulation with its phases starting
+// from the boundary, so the sequence doesn't drift however long the task
+// waits to run.  The entries live in EEPROM, and are read when needed.
+//
+
+// EEPROM layout: running flag, playlist flags, entry count, entries
+#define PLAYLIST_RUNNING (PLAYLIST_EEPROM_OFFSET + 0)
+#define PLAYLIST_FLAGS   (PLAYLIST_EEPROM_OFFSET + 1)
+#define PLAYLIST_COUNT   (PLAYLIST_EEPROM_OFFSET + 2)
+#define PLAYLIST_ENTRIES (PLAYLIST_EEPROM_OFFSET + 3)
+#define PLAYLIST_ENTRY_SIZE 6
+
+static volatile bool running = false;
+static uint8_t entry;
+
+// Tick count at which the current entry ends, and at the most recent update
+static volatile uint32_t entry_end;
+static volatile uint32_t last_tick;
+
+static void read_entry(uint8_t i, struct playlist_entry *e)
+{
+    uint8_t *addr = PLAYLIST_ENTRIES + i * PLAYLIST_ENTRY_SIZE;
+    e->simulation = eeprom_read_word((uint16_t *)addr);
+    eeprom_read_block(&e->duration, addr + 2, sizeof(uint32_t));
+}
+
+static void write_entry(uint8_t i, const struct playlist_entry *e)
+{
+    uint8_t *addr = PLAYLIST_ENTRIES + i * PLAYLIST_ENTRY_SIZE;
+    eeprom_update_word((uint16_t *)addr, e->simulation);
+    eeprom_update_block(&e->duration, addr + 2, sizeof(uint32_t));
+}
+
+// An erased EEPROM holds an empty playlist
+static uint8_t read_count()
+{
+    uint8_t count = eeprom_read_byte(PLAYLIST_COUNT);
+    return count > PLAYLIST_MAX_ENTRIES ? 0 : count;
+}
+
+// Stop stepping through the playlist, and keep the
+// simulation that is left running after a power loss
+static void finish()
+{
+    playlist_stop();
+    eeprom_update_word(MODE_EEPROM_OFFSET, active_simulation);
+}
+
+// Load entry i, with its phases starting from the given tick count
+static void load_entry(uint8_t i, uint32_t start)
+{
+    struct playlist_entry e;
+    read_entry(i, &e);
+
+    entry = i;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        entry_end = start + e.duration;
+
+    start_simulation(e.simulation, start);
+    if (e.duration == 0)
+        finish();
+}
+
+bool playlist_initialize()
+{
+    if (eeprom_read_byte(PLAYLIST_RUNNING) != 1)
+        return false;
+
+    return playlist_start(0);
+}
+
+bool playlist_store(uint8_t flags, uint8_t count, const struct playlist_entry *entries)
+{
+    if (count > PLAYLIST_MAX_ENTRIES)
+        return false;
+
+    for (uint8_t i = 0; i < count; i++)
+        if (entries[i].simulation == 0 || entries[i].simulation > simulation_count)
+            return false;
+
+    // A power loss part way through leaves an empty or a stopped playlist,
+    // never one that mixes old and new entries
+    playlist_stop();
+    eeprom_update_byte(PLAYLIST_COUNT, 0);
+    for (uint8_t i = 0; i < count; i++)
+        write_entry(i, &entries[i]);
+    eeprom_update_byte(PLAYLIST_FLAGS, flags);
+    eeprom_update_byte(PLAYLIST_COUNT, count);
+    return true;
+}
+
+uint8_t playlist_read(uint8_t *flags, struct playlist_entry *entries)
+{
+    uint8_t count = read_count();
+    *flags = count ? eeprom_read_byte(PLAYLIST_FLAGS) : 0;
+    for (uint8_t i = 0; i < count; i++)
+        read_entry(i, &entries[i]);
+
+    return count;
+}
+
+bool playlist_start(uint8_t i)
+{
+    if (i >= read_count())
+        return false;
+
+    uint32_t now;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        now = last_tick;
+
+    // Restart from the beginning after a power loss
+    running = true;
+    eeprom_update_byte(PLAYLIST_RUNNING, 1);
+    load_entry(i, now);
+    return true;
+}
+
+void playlist_stop()
+{
+    running = false;
+    eeprom_update_byte(PLAYLIST_RUNNING, 0);
+}
+
+bool playlist_status(uint8_t *i, uint32_t *remaining)
+{
+    *i = entry;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        *remaining = running ? entry_end - last_tick : 0;
+
+    return running;
+}
+
+void playlist_update(uint32_t ticks)
+{
+    last_tick = ticks;
+    if (running && (int32_t)(ticks - entry_end) >= 0)
+        scheduler_post(TASK_PLAYLIST);
+}
+
+void playlist_tick()
+{
+    uint32_t now, end;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        now = last_tick;
+        end = entry_end;
+    }
+
+    if (!running || (int32_t)(now - end) < 0)
+        return;
+
+    // Skip any entries that ended while the task was waiting to run
+    uint8_t count = read_count();
+    bool loop = eeprom_read_byte(PLAYLIST_FLAGS) & PLAYLIST_LOOP;
+    uint8_t next = entry;
+    uint32_t start;
+    struct playlist_entry e;
+    do
+    {
+        start = end;
+        if (++next >= count)
+        {
+            if (!loop || count == 0)
+            {
+                finish();
+                return;
+            }
+            next = 0;
+        }
+
+        read_entry(next, &e);
+        end = start + e.duration;
+    } while (e.duration != 0 && (int32_t)(now - end) >= 0);
+
+    load_entry(next, start);
+}
@@ -0,0 +1,54 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef LIGHTBOX_PLAYLIST_H
+#define LIGHTBOX_PLAYLIST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PLAYLIST_MAX_ENTRIES 16
+
+// Return to the first entry after the last one ends
+#define PLAYLIST_LOOP 0x01
+
+struct playlist_entry
+{
+    uint16_t simulation;
+
+    // Ticks before the next entry starts, or 0 to remain on this
+    // simulation and stop the playlist
+    uint32_t duration;
+};
+
+// Restart a playlist that was running when the power was lost.
+// Returns false if no playlist was started
+bool playlist_initialize();
+
+// Replace the stored playlist, stopping it if it is running.
+// Returns false, leaving the playlist unchanged, if an entry is invalid
+bool playlist_store(uint8_t flags, uint8_t count, const struct playlist_entry *entries);
+
+// Read the stored playlist, returning the number of entries
+uint8_t playlist_read(uint8_t *flags, struct playlist_entry *entries);
+
+// Load the given entry and step through the rest of the playlist.
+// Returns false if there is no such entry
+bool playlist_start(uint8_t entry);
+void playlist_stop();
+
+// Returns true if the playlist is running, with the current entry
+// and the number of ticks until the next one starts
+bool playlist_status(uint8_t *entry, uint32_t *remaining);
+
+// Called by the timer interrupt with the updated tick count
+void playlist_update(uint32_t ticks);
+
+// Load the next entry once the current one has ended
+void playlist_tick();
+
+#endif
@@ -0,0 +1,110 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <string.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include "main.h"
+#include "playlist.h"
+#include "scheduler.h"
+#include "usb.h"
+
+//
+// A minimal cooperative scheduler for work that doesn't need to run inside
+// an interrupt.  Interrupt routines (or other tasks) post a task to mark it
+// as ready, and the main loop runs the ready tasks to completion in priority
+// order.  When nothing is ready the CPU idles until the next interrupt.
+//
+
+static void (*const tasks[TASK_COUNT])() =
+{
+    [TASK_PLAYLIST] = playlist_tick,
+    [TASK_USB] = usb_tick,
+};
+
+const char task_names[TASK_COUNT][TASK_NAME_LENGTH] PROGMEM =
+{
+    [TASK_PLAYLIST] = "playlist",
+    [TASK_USB] = "usb",
+};
+
+struct task_stats task_stats[TASK_COUNT];
+uint32_t idle_time = 0;
+
+// Bitmask of tasks that are waiting to run
+static volatile uint8_t ready = 0;
+
+// Elapsed time in timer0 counts.  The tick count may be stepped
+// while synchronized, so intervals are measured from the uptime
+static uint32_t timestamp()
+{
+    uint8_t counts;
+    uint32_t ticks = read_uptime(&counts);
+    return ticks * TICK_TIMER_COUNTS + counts;
+}
+
+// Mark a task as ready to run.  May be called from interrupts
+void scheduler_post(enum task task)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        ready |= _BV(task);
+}
+
+// Sleep until an interrupt has been serviced.
+// Must be called with interrupts disabled, and returns with them enabled.
+// The instruction following sei() is always executed before any pending
+// interrupt, so an interrupt can't be missed between checking the caller's
+// wake condition and sleeping.
+void scheduler_sleep()
+{
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+}
+
+void scheduler_reset_stats()
+{
+    memset(task_stats, 0, sizeof(task_stats));
+    idle_time = 0;
+}
+
+// Run tasks as they become ready.  Never returns
+void scheduler_run()
+{
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    for (;;)
+    {
+        uint32_t start = timestamp();
+
+        cli();
+        uint8_t run = ready;
+        ready = 0;
+        if (!run)
+        {
+            scheduler_sleep();
+            idle_time += timestamp() - start;
+            continue;
+        }
+        sei();
+
+        for (uint8_t i = 0; i < TASK_COUNT; i++)
+        {
+            if (!(run & _BV(i)))
+                continue;
+
+            tasks[i]();
+
+            uint32_t end = timestamp();
+            task_stats[i].runs++;
+            task_stats[i].time += end - start;
+            start = end;
+        }
+    }
+}
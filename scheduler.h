@@ -0,0 +1,42 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef LIGHTBOX_SCHEDULER_H
+#define LIGHTBOX_SCHEDULER_H
+
+#include <stdint.h>
+
+// Background tasks, in priority order
+enum task
+{
+    TASK_PLAYLIST = 0,
+    TASK_USB = 1,
+    TASK_COUNT
+};
+
+#define TASK_NAME_LENGTH 8
+
+// Runtime accounting, measured in 64us timer0 counts.
+// Individual runs are usually shorter than a count, but the
+// measurement is unbiased when averaged over many runs.
+struct task_stats
+{
+    uint32_t runs;
+    uint32_t time;
+};
+
+extern struct task_stats task_stats[TASK_COUNT];
+extern uint32_t idle_time;
+extern const char task_names[TASK_COUNT][TASK_NAME_LENGTH];
+
+void scheduler_post(enum task task);
+// Runs posted tasks, sleeping while there are none.  Never returns
+void scheduler_run() __attribute__((noreturn));
+void scheduler_sleep();
+void scheduler_reset_stats();
+
+#endif
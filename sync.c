@@ -0,0 +1,171 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#include <util/atomic.h>
+#include "main.h"
+#include "sync.h"
+
+//
+// Disciplines the tick count to a timeline shared by several devices.
+// The host sends the shared time in periodic beacons, which is compared with
+// the local time that each beacon arrived.  Large errors step the tick count
+// by whole ticks, and the remainder is slewed out by shortening (or
+// lengthening) the following ticks.  The drift between beacons also trims a
+// frequency correction that is spread across every tick, so that the device
+// stays locked between beacons.  The simulation phases are advanced by the
+// tick count, so they follow the shared timeline with no further work.
+//
+
+// Errors larger than this (in timer0 counts) are stepped rather than slewed
+#define SYNC_SLEW_LIMIT TICK_TIMER_COUNTS
+
+// A single beacon with a larger error than this (in timer0 counts) while
+// locked is assumed to have been delayed on the way, and is ignored
+#define SYNC_SPIKE_LIMIT 16
+
+// The frequency correction is trimmed by 1/2^SYNC_RATE_GAIN of the drift measured between beacons
+#define SYNC_RATE_GAIN 2
+
+// Largest frequency correction, in 1/65536 counts per tick (about 2000ppm)
+#define SYNC_MAX_RATE 32768L
+
+static volatile uint8_t state = SYNC_OFF;
+
+// Counts still to be removed from (or added to, if negative) the following ticks
+static volatile int16_t pending = 0;
+
+// Frequency correction and its fractional remainder, in 1/65536 counts per tick
+static volatile int32_t rate = 0;
+static int32_t accumulator = 0;
+
+// Local tick count when the previous beacon arrived
+static uint32_t last_ticks;
+
+// The previous beacon was ignored as a spike
+static bool spiked = false;
+
+// Move onto the shared timeline by whole ticks, and slew out the remaining counts
+static void step(int32_t ticks, int16_t counts, uint32_t rx_ticks)
+{
+    step_tick_count(ticks);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        pending = counts;
+
+    last_ticks = rx_ticks + ticks;
+    spiked = false;
+    state = SYNC_STEPPED;
+}
+
+uint8_t sync_beacon(uint8_t flags, uint16_t simulation, uint32_t ticks, uint8_t counts,
+                    uint32_t rx_ticks, uint8_t rx_counts, int32_t *error, int32_t *correction)
+{
+    // Split the error into whole ticks and 0 <= remainder < TICK_TIMER_COUNTS
+    int32_t whole = ticks - rx_ticks;
+    int16_t remainder = (int16_t)counts - rx_counts;
+    if (remainder < 0)
+    {
+        remainder += TICK_TIMER_COUNTS;
+        whole--;
+    }
+
+    const int32_t limit = INT32_MAX / TICK_TIMER_COUNTS - 1;
+    *error = whole > limit ? INT32_MAX : whole < -limit ? INT32_MIN : whole * TICK_TIMER_COUNTS + remainder;
+
+    if (flags & SYNC_START)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            rate = 0;
+            accumulator = 0;
+        }
+
+        // The phases start from shared tick 0, which may not have been reached yet
+        step(whole, remainder, rx_ticks);
+        start_simulation(simulation, 0);
+    }
+    else if (state == SYNC_OFF)
+    {
+        // Beacons are ignored until a simulation has been started
+    }
+    else if (state == SYNC_LOCKED && !spiked && (*error > SYNC_SPIKE_LIMIT || *error < -SYNC_SPIKE_LIMIT))
+    {
+        // A single large error is assumed to be a delayed beacon, but a second in a row is real
+        spiked = true;
+    }
+    else if (*error > SYNC_SLEW_LIMIT || *error < -SYNC_SLEW_LIMIT)
+        step(whole, remainder, rx_ticks);
+    else
+    {
+        // Drift since the previous beacon, excluding any of the
+        // previous correction that hasn't been applied yet
+        int16_t outstanding;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            outstanding = pending;
+            pending = *error;
+        }
+
+        int32_t interval = rx_ticks - last_ticks;
+        if (interval > 0)
+        {
+            int32_t drift = *error - outstanding;
+            int32_t r = rate + ((drift * 65536L / interval) >> SYNC_RATE_GAIN);
+            if (r > SYNC_MAX_RATE)
+                r = SYNC_MAX_RATE;
+            if (r < -SYNC_MAX_RATE)
+                r = -SYNC_MAX_RATE;
+
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                rate = r;
+        }
+
+        last_ticks = rx_ticks;
+        spiked = false;
+        state = SYNC_LOCKED;
+    }
+
+    // The rate is only changed by this task
+    *correction = rate;
+    return spiked && state == SYNC_LOCKED ? SYNC_IGNORED : state;
+}
+
+void sync_stop()
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        state = SYNC_OFF;
+        pending = 0;
+        rate = 0;
+    }
+}
+
+bool sync_active()
+{
+    return state != SYNC_OFF;
+}
+
+int8_t sync_update()
+{
+    if (state == SYNC_OFF)
+        return 0;
+
+    // Whole counts of the frequency correction that are due
+    accumulator += rate;
+    int16_t adjust = accumulator >> 16;
+    accumulator -= adjust * 65536L;
+
+    // Spread the phase correction over the following ticks
+    int16_t slew = pending > SYNC_MAX_SHORTEN ? SYNC_MAX_SHORTEN : pending;
+    int16_t total = adjust + slew;
+    if (total < -1)
+        total = -1;
+    if (total > SYNC_MAX_SHORTEN)
+        total = SYNC_MAX_SHORTEN;
+
+    pending -= total - adjust;
+    return total;
+}
@@ -0,0 +1,47 @@
+//*****************************************************************************
+//  Copyright 2014 Paul Chote
+//  This file is part of lightbox, which is free software. It is made available
+//  to you under version 3 (or later) of the GNU General Public License, as
+//  published by the Free Software Foundation and included in the LICENSE file.
+//*****************************************************************************
+
+#ifndef LIGHTBOX_SYNC_H
+#define LIGHTBOX_SYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Most counts removed from a single tick while slewing.  Ticks can only be
+// lengthened by one count, because OCR0A is already at its maximum
+#define SYNC_MAX_SHORTEN 64
+
+// Beacon flag: load the given simulation with its phases starting at shared tick 0
+#define SYNC_START 0x01
+
+// Synchronization states reported to the host
+#define SYNC_OFF     0
+#define SYNC_STEPPED 1
+#define SYNC_LOCKED  2
+
+// Reported for a beacon that was ignored as delayed, or whose arrival time was
+// lost because further input arrived before it was parsed
+#define SYNC_IGNORED 3
+
+// Apply a time beacon.  ticks and counts are the shared time when the beacon
+// was received, and rx_ticks and rx_counts the local time it was received.
+// Returns the state, with the error (in timer0 counts, positive if the local
+// clock was behind) and the frequency correction (in 1/65536 counts per tick)
+uint8_t sync_beacon(uint8_t flags, uint16_t simulation, uint32_t ticks, uint8_t counts,
+                    uint32_t rx_ticks, uint8_t rx_counts, int32_t *error, int32_t *correction);
+
+// Stop disciplining the clock, leaving the tick count on the shared timeline
+void sync_stop();
+
+// Whether the tick rate is locked to the host
+bool sync_active();
+
+// Called by the timer interrupt at the start of each tick.
+// Returns the number of timer0 counts to remove from the tick (or add, if negative)
+int8_t sync_update();
+
+#endif
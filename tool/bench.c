@@ -0,0 +1,482 @@
+/*
+ * Copyright 2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+//
+// Protocol round-trip benchmark.
+//
+// Each packet type is sent the requested number of times, one request at a
+// time, and the time from writing the request to parsing its response is
+// recorded.  The latency percentiles, a histogram with power of two bins and
+// the bytes moved per second are reported for each packet type at each baud
+// rate, and can be written as CSV and JSON so that protocol and firmware
+// changes can be compared.  Requests that would change the device state are
+// chosen to leave it as it was: SET_MODE reselects the active simulation, and
+// SET_PARAM names a channel that doesn't exist.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "protocol.h"
+#include "serial.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <time.h>
+
+// Opening the port resets the board.  Older firmware doesn't send READY,
+// but has booted by the time this expires
+#define READY_TIMEOUT_MS 3000
+
+// Requests without a response after this long are counted as timeouts
+#define RESPONSE_TIMEOUT_MS 2000
+
+#define DEFAULT_REQUESTS 200
+#define MAX_BAUDS 8
+
+// Upper edges of the histogram bins, in ms, with a final bin for anything slower
+#define HISTOGRAM_EDGES 12
+#define HISTOGRAM_BINS (HISTOGRAM_EDGES + 1)
+
+struct bench_type
+{
+    const char *name;
+    uint8_t request;
+    uint8_t response;
+
+    // HELLO feature that the device must report, if any
+    uint16_t feature;
+};
+
+static const struct bench_type types[] =
+{
+    { "tick_count", TICK_COUNT, TICK_COUNT, 0 },
+    { "hello", HELLO, HELLO, 0 },
+    { "stats", STATS, STATS, FEATURE_STATS },
+    { "details", REQUEST_DETAILS, SIMULATION_TYPE, 0 },
+    { "set_mode", SET_MODE, SET_MODE, 0 },
+    { "set_param", SET_PARAM, SET_PARAM, FEATURE_PARAMS },
+    { "playlist", PLAYLIST, PLAYLIST, FEATURE_PLAYLIST },
+};
+
+#define TYPE_COUNT (sizeof(types) / sizeof(types[0]))
+
+struct result
+{
+    uint32_t baud;
+    const struct bench_type *type;
+    uint32_t requests;
+    uint32_t timeouts;
+    double p50, p90, p99, max, mean;
+    uint64_t sent;
+    uint64_t received;
+    double bytes_per_second;
+    uint32_t histogram[HISTOGRAM_BINS];
+};
+
+struct connection
+{
+    struct serial_port *port;
+    struct timer_packet packet;
+    uint64_t received;
+};
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Read until a packet of the given type (or READY, if type is zero) is parsed
+// or the deadline passes.  Returns true if the packet arrived
+static bool wait_packet(struct connection *c, uint8_t type, double deadline)
+{
+    for (;;)
+    {
+        uint8_t b;
+        ssize_t length = serial_read(c->port, &b, 1);
+        if (length < 0)
+            return false;
+
+        if (length == 0)
+        {
+            double remaining = deadline - now_ms();
+            if (remaining <= 0)
+                return false;
+
+            // Sleeps for the full timeout when replaying, as there is no descriptor
+            int fd = serial_fd(c->port);
+            poll(&(struct pollfd){ .fd = fd, .events = POLLIN }, 1, remaining < 1 ? 1 : (int)remaining);
+            continue;
+        }
+
+        c->received++;
+        if (packet_parse_byte(&c->packet, b) && c->packet.type == (type ? type : READY))
+            return true;
+    }
+}
+
+// Discard anything left over from a previous request
+static void drain(struct connection *c)
+{
+    uint8_t buf[256];
+    ssize_t length;
+    while ((length = serial_read(c->port, buf, sizeof(buf))) > 0)
+        c->received += length;
+    c->packet.state = HEADERA;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile(const double *sorted, uint32_t count, double p)
+{
+    uint32_t rank = (uint32_t)(p * count + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static double histogram_edge(uint8_t i)
+{
+    return (double)(1 << i);
+}
+
+static void measure(struct connection *c, const struct bench_type *type, const struct packet_hello *hello,
+                    uint32_t requests, struct result *r)
+{
+    union
+    {
+        struct packet_set_mode mode;
+        struct packet_stats_request stats;
+        struct packet_set_param param;
+    } data;
+    uint8_t length = 0;
+
+    memset(&data, 0, sizeof(data));
+    switch (type->request)
+    {
+        case REQUEST_DETAILS:
+        case SET_MODE:
+            data.mode.id = hello->active ? hello->active : 1;
+            length = sizeof(struct packet_set_mode);
+            break;
+        case STATS:
+            length = sizeof(struct packet_stats_request);
+            break;
+        case SET_PARAM:
+            data.param.channel = 0xFF;
+            length = sizeof(struct packet_set_param);
+            break;
+    }
+
+    uint8_t request[PACKET_OVERHEAD + sizeof(data)];
+    size_t request_length = packet_encode(request, type->request, &data, length);
+
+    double *latencies = calloc(requests, sizeof(double));
+    if (!latencies)
+        return;
+
+    memset(r, 0, sizeof(struct result));
+    r->type = type;
+    r->requests = requests;
+
+    uint32_t count = 0;
+    double total = 0;
+    drain(c);
+    uint64_t received = c->received;
+    double start = now_ms();
+    for (uint32_t i = 0; i < requests; i++)
+    {
+        double sent = now_ms();
+        if (serial_write(c->port, request, request_length) < 0)
+        {
+            r->timeouts += requests - i;
+            break;
+        }
+        r->sent += request_length;
+
+        if (!wait_packet(c, type->response, sent + RESPONSE_TIMEOUT_MS))
+        {
+            r->timeouts++;
+            drain(c);
+            continue;
+        }
+
+        double latency = now_ms() - sent;
+        latencies[count++] = latency;
+        total += latency;
+
+        uint8_t bin = 0;
+        while (bin < HISTOGRAM_EDGES && latency >= histogram_edge(bin))
+            bin++;
+        r->histogram[bin]++;
+    }
+
+    double elapsed = (now_ms() - start) / 1000;
+    r->received = c->received - received;
+    r->bytes_per_second = elapsed > 0 ? (r->sent + r->received) / elapsed : 0;
+
+    if (count > 0)
+    {
+        qsort(latencies, count, sizeof(double), compare_double);
+        r->p50 = percentile(latencies, count, 0.5);
+        r->p90 = percentile(latencies, count, 0.9);
+        r->p99 = percentile(latencies, count, 0.99);
+        r->max = latencies[count - 1];
+        r->mean = total / count;
+    }
+
+    free(latencies);
+}
+
+// Open the device at the given baud rate and benchmark each selected type.
+// Returns the number of results, or -1 if the device couldn't be opened
+static int run_baud(const char *device, uint32_t baud, const bool *selected, uint32_t requests, struct result *results)
+{
+    ssize_t error;
+    struct connection c = { .packet.state = HEADERA };
+    c.port = serial_new(device, baud, &error);
+    if (!c.port)
+    {
+        printf("Connection error %zd: %s\n", error, serial_error_string(error));
+        return -1;
+    }
+
+    serial_set_hangup(c.port, true);
+    if (!serial_is_socket(c.port) && !wait_packet(&c, 0, now_ms() + READY_TIMEOUT_MS))
+        printf("Device didn't report READY; assuming it has booted\n");
+    drain(&c);
+
+    // The features decide which packet types can be measured
+    struct packet_hello hello;
+    memset(&hello, 0, sizeof(hello));
+    uint8_t request[PACKET_OVERHEAD];
+    bool have_hello = serial_write(c.port, request, packet_encode(request, HELLO, NULL, 0)) >= 0 &&
+        wait_packet(&c, HELLO, now_ms() + RESPONSE_TIMEOUT_MS);
+    if (have_hello)
+        hello = c.packet.data.hello;
+
+    int count = 0;
+    for (size_t i = 0; i < TYPE_COUNT; i++)
+    {
+        const struct bench_type *type = &types[i];
+        if (!selected[i])
+            continue;
+
+        if ((type->request == HELLO && !have_hello) || (type->feature & ~hello.features))
+        {
+            printf("%7u  %-10s  not supported by the device firmware\n", baud, type->name);
+            continue;
+        }
+
+        struct result *r = &results[count];
+        measure(&c, type, &hello, requests, r);
+        r->baud = baud;
+        count++;
+
+        if (r->timeouts == r->requests)
+            printf("%7u  %-10s  %8u  %8u  %8s  %8s  %8s  %8s  %8s\n", baud, type->name, r->requests,
+                   r->timeouts, "-", "-", "-", "-", "-");
+        else
+            printf("%7u  %-10s  %8u  %8u  %8.2f  %8.2f  %8.2f  %8.2f  %8.0f\n", baud, type->name, r->requests,
+                   r->timeouts, r->p50, r->p90, r->p99, r->max, r->bytes_per_second);
+        fflush(stdout);
+    }
+
+    serial_free(c.port);
+    return count;
+}
+
+static int write_csv(const char *path, const struct result *results, int count)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return 1;
+
+    fprintf(f, "baud,type,requests,timeouts,p50_ms,p90_ms,p99_ms,max_ms,mean_ms,bytes_sent,bytes_received,bytes_per_s\n");
+    for (int i = 0; i < count; i++)
+    {
+        const struct result *r = &results[i];
+        fprintf(f, "%u,%s,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%llu,%llu,%.1f\n", r->baud, r->type->name,
+                r->requests, r->timeouts, r->p50, r->p90, r->p99, r->max, r->mean,
+                (unsigned long long)r->sent, (unsigned long long)r->received, r->bytes_per_second);
+    }
+
+    return fclose(f) ? 1 : 0;
+}
+
+static int write_json(const char *path, const char *device, uint32_t requests, const struct result *results, int count)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return 1;
+
+    fprintf(f, "{\n  \"device\": \"");
+    for (const char *s = device; *s; s++)
+        fprintf(f, *s == '"' || *s == '\\' ? "\\%c" : "%c", *s);
+    fprintf(f, "\",\n  \"requests\": %u,\n  \"histogram_edges_ms\": [", requests);
+    for (uint8_t i = 0; i < HISTOGRAM_EDGES; i++)
+        fprintf(f, "%s%g", i ? ", " : "", histogram_edge(i));
+    fprintf(f, "],\n  \"results\": [\n");
+
+    for (int i = 0; i < count; i++)
+    {
+        const struct result *r = &results[i];
+        fprintf(f, "    {\"baud\": %u, \"type\": \"%s\", \"requests\": %u, \"timeouts\": %u, "
+                "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, \"mean_ms\": %.3f, "
+                "\"bytes_sent\": %llu, \"bytes_received\": %llu, \"bytes_per_s\": %.1f, \"histogram\": [",
+                r->baud, r->type->name, r->requests, r->timeouts, r->p50, r->p90, r->p99, r->max, r->mean,
+                (unsigned long long)r->sent, (unsigned long long)r->received, r->bytes_per_second);
+        for (uint8_t j = 0; j < HISTOGRAM_BINS; j++)
+            fprintf(f, "%s%u", j ? ", " : "", r->histogram[j]);
+        fprintf(f, "]}%s\n", i + 1 < count ? "," : "");
+    }
+
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) ? 1 : 0;
+}
+
+// Parse a comma separated list of packet type names into selected
+static int parse_types(char *list, bool *selected)
+{
+    memset(selected, 0, TYPE_COUNT * sizeof(bool));
+    for (char *name = strtok(list, ","); name; name = strtok(NULL, ","))
+    {
+        size_t i = 0;
+        while (i < TYPE_COUNT && strcmp(name, types[i].name) != 0)
+            i++;
+
+        if (i == TYPE_COUNT)
+        {
+            printf("Unknown packet type: %s\n", name);
+            return 1;
+        }
+        selected[i] = true;
+    }
+
+    return 0;
+}
+
+int bench_main(int argc, char *argv[])
+{
+    uint32_t requests = DEFAULT_REQUESTS;
+    uint32_t bauds[MAX_BAUDS] = { 9600 };
+    int baud_count = 1;
+    const char *prefix = NULL;
+    bool selected[TYPE_COUNT];
+    for (size_t i = 0; i < TYPE_COUNT; i++)
+        selected[i] = true;
+
+    int i = 0;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        char *value = argv[i + 1];
+        if (strcmp(argv[i], "-n") == 0 && atoi(value) > 0)
+            requests = atoi(value);
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            baud_count = 0;
+            for (char *b = strtok(value, ","); b && baud_count < MAX_BAUDS; b = strtok(NULL, ","))
+                if (atoi(b) > 0)
+                    bauds[baud_count++] = atoi(b);
+            if (baud_count == 0)
+                goto usage;
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            if (parse_types(value, selected))
+                goto usage;
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+            prefix = value;
+        else
+            goto usage;
+    }
+
+    if (i + 1 != argc)
+        goto usage;
+
+    const char *device = argv[i];
+    struct result *results = calloc(MAX_BAUDS * TYPE_COUNT, sizeof(struct result));
+    if (!results)
+    {
+        printf("Allocation failure\n");
+        return 1;
+    }
+
+    printf("%u requests of each type, latencies in ms\n", requests);
+    printf("%7s  %-10s  %8s  %8s  %8s  %8s  %8s  %8s  %8s\n", "baud", "type", "requests", "timeouts",
+           "p50", "p90", "p99", "max", "bytes/s");
+
+    int count = 0;
+    int ret = 0;
+    for (int b = 0; b < baud_count; b++)
+    {
+        int added = run_baud(device, bauds[b], selected, requests, results + count);
+        if (added < 0)
+        {
+            ret = 1;
+            break;
+        }
+        count += added;
+    }
+
+    if (prefix && count > 0)
+    {
+        size_t length = strlen(prefix) + 6;
+        char *path = malloc(length);
+        if (!path)
+            ret = 1;
+        else
+        {
+            snprintf(path, length, "%s.csv", prefix);
+            if (write_csv(path, results, count))
+            {
+                printf("Failed to write %s\n", path);
+                ret = 1;
+            }
+
+            snprintf(path, length, "%s.json", prefix);
+            if (write_json(path, device, requests, results, count))
+            {
+                printf("Failed to write %s\n", path);
+                ret = 1;
+            }
+            free(path);
+        }
+    }
+
+    for (int j = 0; j < count; j++)
+        if (results[j].timeouts)
+            ret = 1;
+
+    free(results);
+    return ret;
+
+usage:
+    printf("Usage: starsimulator -b [-n requests] [-r baud[,baud...]] [-t type[,type...]] [-o prefix] <device>\n");
+    printf("Types: ");
+    for (size_t j = 0; j < TYPE_COUNT; j++)
+        printf("%s%s", j ? ", " : "", types[j].name);
+    printf("\n");
+    return 2;
+}
+
+#else
+
+int bench_main(int argc, char *argv[])
+{
+    printf("Benchmark mode is not supported on Windows\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,15 @@
+/*
+ * Copyright 2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+// Measure request/response latencies against a device.
+// argv holds the options, then the device path
+int bench_main(int argc, char *argv[]);
+
+#endif
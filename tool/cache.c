@@ -0,0 +1,156 @@
+/*
+ * Copyright 2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+//
+// The simulation catalog only changes when the firmware is rebuilt, so it is
+// cached on disk keyed by the catalog hash that the device reports in HELLO.
+// Each catalog is stored in its own file as a small header followed by the
+// raw packet_simulation structs.
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+#ifdef _WIN32
+#   include <direct.h>
+#   define make_directory(path) _mkdir(path)
+#   define PATH_SEPARATOR "\\"
+#else
+#   define make_directory(path) mkdir(path, 0755)
+#   define PATH_SEPARATOR "/"
+#endif
+
+#define CACHE_MAGIC 0x4C425843UL
+#define CACHE_VERSION 1
+
+struct PACKED_STRUCT cache_header
+{
+    uint32_t magic;
+    uint8_t version;
+    uint32_t hash;
+    uint16_t count;
+    uint16_t record_size;
+};
+
+static bool ensure_directory(const char *path)
+{
+    return make_directory(path) == 0 || errno == EEXIST;
+}
+
+// Find (and optionally create) the cache directory, writing the path of the
+// catalog file into path.  Returns false if no cache location is available
+static bool cache_path(char *path, size_t length, uint32_t hash, bool create)
+{
+    char dir[1024];
+#ifdef _WIN32
+    const char *base = getenv("LOCALAPPDATA");
+    if (!base)
+        return false;
+    snprintf(dir, sizeof(dir), "%s", base);
+#else
+    const char *base = getenv("XDG_CACHE_HOME");
+    if (base && base[0])
+        snprintf(dir, sizeof(dir), "%s", base);
+    else
+    {
+        const char *home = getenv("HOME");
+        if (!home)
+            return false;
+
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    }
+#endif
+
+    if (create && !ensure_directory(dir))
+        return false;
+
+    size_t used = strlen(dir);
+    snprintf(dir + used, sizeof(dir) - used, PATH_SEPARATOR "starsimulator");
+    if (create && !ensure_directory(dir))
+        return false;
+
+    snprintf(path, length, "%s" PATH_SEPARATOR "catalog-%08lx.bin", dir, (unsigned long)hash);
+    return true;
+}
+
+struct packet_simulation *catalog_cache_load(uint32_t hash, uint16_t count)
+{
+    char path[1100];
+    if (!cache_path(path, sizeof(path), hash, false))
+        return NULL;
+
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    struct packet_simulation *catalog = NULL;
+    struct cache_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != CACHE_MAGIC ||
+        header.version != CACHE_VERSION || header.hash != hash || header.count != count ||
+        header.record_size != sizeof(struct packet_simulation))
+        goto error;
+
+    catalog = calloc(count ? count : 1, sizeof(struct packet_simulation));
+    if (!catalog || fread(catalog, sizeof(struct packet_simulation), count, f) != count)
+        goto error;
+
+    // Reject partially written or otherwise corrupted entries
+    for (uint16_t i = 0; i < count; i++)
+        if (catalog[i].id != i + 1)
+            goto error;
+
+    fclose(f);
+    return catalog;
+
+error:
+    free(catalog);
+    fclose(f);
+    return NULL;
+}
+
+int catalog_cache_store(uint32_t hash, const struct packet_simulation *catalog, uint16_t count)
+{
+    char path[1100];
+    if (!cache_path(path, sizeof(path), hash, true))
+        return 1;
+
+    // Write to a temporary file first so that a concurrent reader
+    // never sees a partial catalog
+    char temp[1110];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *f = fopen(temp, "wb");
+    if (!f)
+        return 1;
+
+    struct cache_header header = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .hash = hash,
+        .count = count,
+        .record_size = sizeof(struct packet_simulation)
+    };
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(catalog, sizeof(struct packet_simulation), count, f) == count;
+    ok &= fclose(f) == 0;
+
+#ifdef _WIN32
+    // rename doesn't replace an existing file under windows
+    remove(path);
+#endif
+    if (!ok || rename(temp, path) != 0)
+    {
+        remove(temp);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright 2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+// Load the catalog with the given hash from the on-disk cache.
+// Returns a malloc'd array of count simulations indexed by id - 1,
+// or NULL if the catalog hasn't been cached
+struct packet_simulation *catalog_cache_load(uint32_t hash, uint16_t count);
+
+// Save a complete catalog to the cache. Returns 1 on error
+int catalog_cache_store(uint32_t hash, const struct packet_simulation *catalog, uint16_t count);
+
+#endif
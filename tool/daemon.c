@@ -0,0 +1,537 @@
+/*
+ * Copyright 2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+//
+// lightboxd: keep a lightbox open and share it between local clients.
+//
+// Clients connect to a unix domain socket and speak the normal lightbox
+// protocol, so starsimulator can be pointed at the socket path instead of
+// the serial port.  Catalog and HELLO queries are answered from a cache that
+// is filled once at startup.  Other requests are forwarded to the device one at a time,
+// and the device's replies are routed back to the client that asked.
+// Clients that send SUBSCRIBE also receive every SET_MODE notification.
+//
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "protocol.h"
+#include "serial.h"
+
+#define MAX_CLIENTS 32
+#define MAX_QUEUED 64
+
+// Opening the port resets the board.  Older firmware doesn't send READY,
+// but has booted by the time this expires
+#define READY_TIMEOUT_MS 3000
+
+// Time allowed for the device to send the catalog at startup
+#define CATALOG_TIMEOUT_MS 10000
+
+// Time allowed for the device to answer a forwarded request
+#define REQUEST_TIMEOUT_MS 1000
+
+struct client
+{
+    int fd;
+    struct timer_packet packet;
+    bool subscribed;
+};
+
+// A request waiting to be forwarded to the device
+struct request
+{
+    struct client *client;
+    uint8_t type;
+    uint8_t length;
+    uint8_t data[MAX_DATA_LENGTH];
+};
+
+static struct serial_port *port;
+static struct timer_packet device_packet;
+
+static struct client clients[MAX_CLIENTS];
+
+static struct request queue[MAX_QUEUED];
+static uint8_t queue_read = 0;
+static uint8_t queue_length = 0;
+
+// The request currently being handled by the device, or NULL
+static struct request current;
+static struct request *active = NULL;
+static uint8_t active_response;
+static double active_deadline;
+
+// Cached device state
+static struct packet_simulation_count count;
+static struct packet_simulation *catalog;
+static uint16_t catalog_received = 0;
+
+// Device identity, if the firmware supports HELLO
+static struct packet_hello hello;
+static bool have_hello = false;
+
+static volatile sig_atomic_t stopping = 0;
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void drop_client(struct client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+
+    // Any reply to an outstanding request is discarded
+    if (active && active->client == c)
+        active->client = NULL;
+
+    for (uint8_t i = 0; i < queue_length; i++)
+        if (queue[(queue_read + i) % MAX_QUEUED].client == c)
+            queue[(queue_read + i) % MAX_QUEUED].client = NULL;
+}
+
+static void send_client(struct client *c, uint8_t type, const void *data, uint8_t length)
+{
+    if (!c || c->fd == -1)
+        return;
+
+    // Slow clients are disconnected rather than allowed to stall the daemon
+    uint8_t buf[MAX_DATA_LENGTH + PACKET_OVERHEAD];
+    size_t total = packet_encode(buf, type, data, length);
+    if (send(c->fd, buf, total, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)total)
+        drop_client(c);
+}
+
+static void send_count(struct client *c)
+{
+    send_client(c, SIMULATION_COUNT, &count, sizeof(count));
+}
+
+// Parse an optional simulation range, defaulting to the whole catalog
+static void read_range(struct timer_packet *p, uint16_t *first, uint16_t *last)
+{
+    *first = 1;
+    *last = count.total + 1;
+    if (p->length < sizeof(struct packet_simulation_range))
+        return;
+
+    if (p->data.range.first > *first)
+        *first = p->data.range.first;
+    if (p->data.range.last < *last)
+        *last = p->data.range.last;
+}
+
+static void send_simulation_type(struct client *c, uint16_t id)
+{
+    send_client(c, SIMULATION_TYPE, &catalog[id - 1], sizeof(struct packet_simulation));
+}
+
+static void send_simulation_name(struct client *c, uint16_t id)
+{
+    struct packet_simulation *sim = &catalog[id - 1];
+    struct packet_simulation_name name;
+    name.id = id;
+    name.name_length = sim->name_length < MAX_SIMULATION_NAME_LENGTH ? sim->name_length : MAX_SIMULATION_NAME_LENGTH;
+    memcpy(name.name, sim->name, name.name_length);
+    send_client(c, SIMULATION_NAME, &name, offsetof(struct packet_simulation_name, name) + name.name_length);
+}
+
+static void start_next_request()
+{
+    while (!active && queue_length > 0)
+    {
+        current = queue[queue_read];
+        active = &current;
+        queue_read = (queue_read + 1) % MAX_QUEUED;
+        queue_length--;
+
+        // The client may have disconnected while the request was queued
+        if (!active->client)
+        {
+            active = NULL;
+            continue;
+        }
+
+        // Requests without a known reply are completed by the timeout
+        switch (active->type)
+        {
+            case SET_MODE: active_response = SET_MODE; break;
+            case STATS: active_response = STATS; break;
+            case TICK_COUNT: active_response = TICK_COUNT; break;
+            case SET_TRIM: active_response = TICK_COUNT; break;
+            case HELLO: active_response = HELLO; break;
+            case TASKS: active_response = TASKS; break;
+            case SET_PARAM: active_response = SET_PARAM; break;
+            case SET_PLAYLIST:
+            case START_PLAYLIST:
+            case STOP_PLAYLIST:
+            case PLAYLIST: active_response = PLAYLIST; break;
+            case SYNC: active_response = SYNC_STATUS; break;
+            default: active_response = 0; break;
+        }
+
+        uint8_t buf[MAX_DATA_LENGTH + PACKET_OVERHEAD];
+        size_t length = packet_encode(buf, active->type, active->data, active->length);
+        if (serial_write(port, buf, length) < 0)
+        {
+            fprintf(stderr, "Failed to write to device\n");
+            stopping = 1;
+        }
+
+        active_deadline = now_ms() + REQUEST_TIMEOUT_MS;
+    }
+}
+
+static void handle_client_packet(struct client *c, struct timer_packet *p)
+{
+    switch (p->type)
+    {
+        case REQUEST_MODES:
+            send_count(c);
+            for (uint16_t i = 1; i <= count.total; i++)
+                send_simulation_type(c, i);
+            return;
+        case REQUEST_NAMES:
+        case REQUEST_PAGE:
+        {
+            uint16_t first, last;
+            read_range(p, &first, &last);
+            send_count(c);
+            for (uint16_t i = first; i < last; i++)
+            {
+                if (p->type == REQUEST_NAMES)
+                    send_simulation_name(c, i);
+                else
+                    send_simulation_type(c, i);
+            }
+            return;
+        }
+        case REQUEST_DETAILS:
+        {
+            uint16_t id = p->data.set_simulation.id;
+            if (p->length >= sizeof(struct packet_set_mode) && id > 0 && id <= count.total)
+                send_simulation_type(c, id);
+            return;
+        }
+        case HELLO:
+            if (!have_hello)
+                break;
+
+            hello.active = count.active;
+            send_client(c, HELLO, &hello, sizeof(hello));
+            return;
+        case SUBSCRIBE:
+            c->subscribed = true;
+            send_count(c);
+            return;
+        default:
+            break;
+    }
+
+    if (queue_length == MAX_QUEUED)
+    {
+        fprintf(stderr, "Request queue full - dropping '%c' request\n", p->type);
+        return;
+    }
+
+    struct request *r = &queue[(queue_read + queue_length++) % MAX_QUEUED];
+    r->client = c;
+    r->type = p->type;
+    r->length = p->length;
+    memcpy(r->data, p->data.bytes, p->length);
+    start_next_request();
+}
+
+static void handle_device_packet(struct timer_packet *p)
+{
+    // The board has been reset by something else, and reloaded the stored simulation
+    if (p->type == READY)
+    {
+        hello = p->data.hello;
+        count.active = hello.active;
+        return;
+    }
+
+    // Keep the cached state in sync with the device
+    if (p->type == SET_MODE)
+    {
+        count.active = p->data.set_simulation.id;
+        for (uint8_t i = 0; i < MAX_CLIENTS; i++)
+            if (clients[i].fd != -1 && clients[i].subscribed && (!active || active->client != &clients[i]))
+                send_client(&clients[i], p->type, p->data.bytes, p->length);
+    }
+
+    if (!active)
+        return;
+
+    send_client(active->client, p->type, p->data.bytes, p->length);
+    if (p->type == active_response)
+    {
+        active = NULL;
+        start_next_request();
+    }
+}
+
+// Wait for the board to boot, discarding anything sent before READY
+static void wait_ready()
+{
+    double deadline = now_ms() + READY_TIMEOUT_MS;
+    while (now_ms() < deadline)
+    {
+        uint8_t b;
+        ssize_t ret = serial_read(port, &b, 1);
+        if (ret < 0)
+            return;
+
+        if (ret == 0)
+            poll(NULL, 0, 1);
+        else if (packet_parse_byte(&device_packet, b) && device_packet.type == READY)
+            return;
+    }
+}
+
+// Fill the catalog cache.  Returns 0 on success
+static int load_catalog()
+{
+    // Older firmware ignores HELLO, in which case it is forwarded to the device
+    uint8_t buf[2 * PACKET_OVERHEAD];
+    size_t length = packet_encode(buf, HELLO, NULL, 0);
+    length += packet_encode(buf + length, REQUEST_MODES, NULL, 0);
+    if (serial_write(port, buf, length) < 0)
+        return 1;
+
+    double deadline = now_ms() + CATALOG_TIMEOUT_MS;
+    while (now_ms() < deadline && (!catalog || catalog_received < count.total))
+    {
+        uint8_t b;
+        ssize_t ret = serial_read(port, &b, 1);
+        if (ret < 0)
+            return 1;
+
+        if (ret == 0)
+        {
+            poll(NULL, 0, 10);
+            continue;
+        }
+
+        if (!packet_parse_byte(&device_packet, b))
+            continue;
+
+        struct timer_packet *p = &device_packet;
+        if (p->type == HELLO)
+        {
+            hello = p->data.hello;
+            have_hello = true;
+        }
+        else if (p->type == SIMULATION_COUNT && !catalog)
+        {
+            count = p->data.count;
+            catalog = calloc(count.total ? count.total : 1, sizeof(struct packet_simulation));
+            if (!catalog)
+                return 1;
+        }
+        else if (p->type == SIMULATION_TYPE && catalog)
+        {
+            uint16_t id = p->data.simulation.id;
+            if (id > 0 && id <= count.total)
+            {
+                catalog[id - 1] = p->data.simulation;
+                catalog_received++;
+            }
+        }
+    }
+
+    return catalog && catalog_received == count.total ? 0 : 1;
+}
+
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long\n");
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 8) == -1)
+    {
+        perror("Failed to create socket");
+        return -1;
+    }
+
+    return fd;
+}
+
+static void stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <device> <socket>\n", argv[0]);
+        return 2;
+    }
+
+    for (uint8_t i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+
+    ssize_t error;
+    port = serial_new(argv[1], 9600, &error);
+    if (!port)
+    {
+        fprintf(stderr, "Connection error %zd: %s\n", error, serial_error_string(error));
+        return 1;
+    }
+
+    serial_set_hangup(port, true);
+    wait_ready();
+
+    if (load_catalog())
+    {
+        fprintf(stderr, "Failed to read the simulation catalog from %s\n", argv[1]);
+        serial_free(port);
+        return 1;
+    }
+
+    int listener = listen_socket(argv[2]);
+    if (listener == -1)
+    {
+        serial_free(port);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Serving %s (%u simulations, active %u) on %s\n", argv[1], count.total, count.active, argv[2]);
+    fflush(stdout);
+
+    while (!stopping)
+    {
+        // Device, listener, then clients
+        struct pollfd fds[MAX_CLIENTS + 2];
+        struct client *polled[MAX_CLIENTS];
+        nfds_t nfds = 0;
+        fds[nfds++] = (struct pollfd){ .fd = serial_fd(port), .events = POLLIN };
+        fds[nfds++] = (struct pollfd){ .fd = listener, .events = POLLIN };
+        for (uint8_t i = 0; i < MAX_CLIENTS; i++)
+        {
+            if (clients[i].fd == -1)
+                continue;
+
+            polled[nfds - 2] = &clients[i];
+            fds[nfds++] = (struct pollfd){ .fd = clients[i].fd, .events = POLLIN };
+        }
+
+        int timeout = -1;
+        if (active)
+        {
+            timeout = (int)(active_deadline - now_ms());
+            if (timeout < 0)
+                timeout = 0;
+        }
+
+        if (poll(fds, nfds, timeout) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents)
+        {
+            uint8_t buf[256];
+            ssize_t length = serial_read(port, buf, sizeof(buf));
+            if (length < 0)
+            {
+                fprintf(stderr, "Device error: %s\n", serial_error_string(length));
+                break;
+            }
+
+            for (ssize_t i = 0; i < length; i++)
+                if (packet_parse_byte(&device_packet, buf[i]))
+                    handle_device_packet(&device_packet);
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            int fd = accept(listener, NULL, NULL);
+            uint8_t i = 0;
+            while (i < MAX_CLIENTS && clients[i].fd != -1)
+                i++;
+
+            if (fd != -1 && i < MAX_CLIENTS)
+            {
+                clients[i].fd = fd;
+                clients[i].subscribed = false;
+                clients[i].packet.state = HEADERA;
+            }
+            else if (fd != -1)
+                close(fd);
+        }
+
+        for (nfds_t j = 2; j < nfds; j++)
+        {
+            if (!fds[j].revents)
+                continue;
+
+            struct client *c = polled[j - 2];
+            uint8_t buf[256];
+            ssize_t length = recv(c->fd, buf, sizeof(buf), 0);
+            if (length <= 0)
+            {
+                drop_client(c);
+                continue;
+            }
+
+            for (ssize_t i = 0; i < length && c->fd != -1; i++)
+                if (packet_parse_byte(&c->packet, buf[i]))
+                    handle_client_packet(c, &c->packet);
+        }
+
+        if (active && now_ms() >= active_deadline)
+        {
+            active = NULL;
+            start_next_request();
+        }
+    }
+
+    for (uint8_t i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].fd != -1)
+            close(clients[i].fd);
+
+    close(listener);
+    unlink(argv[2]);
+    serial_free(port);
+    free(catalog);
+    return 0;
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright 2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+//
+// Run a simulation on several lightboxes with phase-coherent outputs.
+//
+// The host picks an epoch shortly in the future, and sends each device a SYNC
+// beacon holding the shared time (in ticks and timer counts since the epoch)
+// at which the beacon's final byte is expected to arrive.  The first beacon
+// loads the simulation with its phases starting at the epoch, and later
+// beacons are sent every interval so that the firmware can correct its tick
+// count and trim its tick rate to follow the host clock.
+//
+// The arrival time is predicted from the serial transmission time plus a
+// per-device latency, estimated as half of the smallest round trip after
+// subtracting the bytes moved in each direction.  Each device replies with the
+// error it measured, which is the phase error accumulated since the previous
+// beacon.  These are printed for every round, along with the spread between
+// devices, and summarized once the devices have locked.  The devices keep
+// their frequency correction after the tool exits.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lockstep.h"
+#include "protocol.h"
+#include "serial.h"
+
+#ifdef __linux__
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+// Opening the port resets the board
+#define READY_TIMEOUT_MS 3000
+
+// Rounds without a response after this long are skipped for that device
+#define RESPONSE_TIMEOUT_MS 1000
+
+// The first beacon is sent this long before the epoch
+#define EPOCH_DELAY_MS 1000
+
+// Locked rounds ignored by the summary while the frequency correction converges
+#define SETTLE_ROUNDS 5
+
+#define DEFAULT_INTERVAL_S 2
+#define DEFAULT_DURATION_S 60
+
+// 8N1 framing at 9600 baud
+#define BYTE_MS (10 * 1e3 / 9600)
+
+struct device
+{
+    const char *path;
+    struct serial_port *port;
+    struct timer_packet packet;
+
+    bool booting;
+    bool waiting;
+    const char *error;
+    double deadline;
+
+    // Time and bytes received since the current beacon was sent
+    double sent_ms;
+    uint32_t received;
+
+    // Smallest one-way latency seen, or negative if unknown
+    double latency_ms;
+
+    // The simulation has been started by a beacon that the device applied
+    bool started;
+
+    // Results of the current round
+    bool replied;
+    struct packet_sync_status status;
+
+    // Statistics for rounds after the device has locked
+    uint32_t locked;
+    uint32_t counted;
+    uint32_t ignored;
+    double sum_squares;
+    double max_us;
+};
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void fail(struct device *d, int epoll, const char *error)
+{
+    d->error = error;
+    d->waiting = false;
+    epoll_ctl(epoll, EPOLL_CTL_DEL, serial_fd(d->port), NULL);
+}
+
+// Send a beacon holding the shared time that its final byte is expected to arrive
+static void send_beacon(struct device *d, int epoll, double epoch, uint8_t flags, uint16_t simulation)
+{
+    uint8_t request[PACKET_OVERHEAD + sizeof(struct packet_sync)];
+    size_t length = sizeof(request);
+
+    d->sent_ms = now_ms();
+    double arrival = d->sent_ms + length * BYTE_MS + (d->latency_ms > 0 ? d->latency_ms : 0);
+    double counts = (arrival - epoch) / (TICK_COUNT_SECONDS * 1e3);
+    double ticks = floor(counts / TICK_TIMER_COUNTS);
+
+    struct packet_sync sync =
+    {
+        .flags = flags,
+        .simulation = simulation,
+        .ticks = (uint32_t)(int32_t)ticks,
+        .counts = (uint8_t)(counts - ticks * TICK_TIMER_COUNTS),
+    };
+
+    packet_encode(request, SYNC, &sync, sizeof(sync));
+    d->received = 0;
+    d->replied = false;
+    d->waiting = true;
+    d->deadline = d->sent_ms + RESPONSE_TIMEOUT_MS;
+    if (serial_write(d->port, request, length) < 0)
+        fail(d, epoll, "failed to send beacon");
+}
+
+static void handle_reply(struct device *d, struct timer_packet *p)
+{
+    double rtt = now_ms() - d->sent_ms;
+    double latency = (rtt - (PACKET_OVERHEAD + sizeof(struct packet_sync) + d->received) * BYTE_MS) / 2;
+    if (latency < 0)
+        latency = 0;
+    if (d->latency_ms < 0 || latency < d->latency_ms)
+        d->latency_ms = latency;
+
+    d->status = p->data.sync;
+    d->replied = true;
+    d->waiting = false;
+
+    if (d->status.state == SYNC_STEPPED || d->status.state == SYNC_LOCKED)
+        d->started = true;
+
+    if (d->status.state == SYNC_IGNORED)
+        d->ignored++;
+    else if (d->status.state == SYNC_LOCKED && ++d->locked > SETTLE_ROUNDS)
+    {
+        double us = d->status.error * TICK_COUNT_SECONDS * 1e6;
+        d->counted++;
+        d->sum_squares += us * us;
+        if (fabs(us) > d->max_us)
+            d->max_us = fabs(us);
+    }
+}
+
+// Read and parse whatever a device has sent
+static void read_device(struct device *d, int epoll)
+{
+    uint8_t buf[256];
+    ssize_t length = serial_read(d->port, buf, sizeof(buf));
+    if (length < 0)
+    {
+        fail(d, epoll, serial_error_string(length));
+        return;
+    }
+
+    for (ssize_t i = 0; i < length; i++)
+    {
+        d->received++;
+        if (!packet_parse_byte(&d->packet, buf[i]))
+            continue;
+
+        // Anything sent before READY is from the bootloader or a previous session
+        if (d->booting && (d->packet.type == READY || d->packet.type == HELLO))
+        {
+            d->booting = false;
+            d->waiting = false;
+            if (!(d->packet.data.hello.features & FEATURE_SYNC))
+            {
+                fail(d, epoll, "firmware doesn't support SYNC");
+                return;
+            }
+        }
+        else if (!d->booting && d->waiting && d->packet.type == SYNC_STATUS)
+            handle_reply(d, &d->packet);
+    }
+}
+
+// Wait until no device is waiting for a reply, and until the given time
+static void wait_devices(struct device *devices, int count, int epoll, double until)
+{
+    for (;;)
+    {
+        double now = now_ms();
+        double next = until > now ? until : INFINITY;
+        bool waiting = false;
+        for (int i = 0; i < count; i++)
+        {
+            struct device *d = &devices[i];
+            if (!d->waiting)
+                continue;
+
+            if (now >= d->deadline)
+            {
+                if (d->booting)
+                    fail(d, epoll, "device didn't report READY");
+                d->waiting = false;
+                continue;
+            }
+
+            waiting = true;
+            if (d->deadline < next)
+                next = d->deadline;
+        }
+
+        if (!waiting && now >= until)
+            return;
+
+        struct epoll_event events[16];
+        int ready = epoll_wait(epoll, events, 16, (int)(next - now) + 1);
+        for (int i = 0; i < ready; i++)
+            read_device(events[i].data.ptr, epoll);
+    }
+}
+
+static void summarize(struct device *devices, int count)
+{
+    printf("\n* beacon ignored by the device as delayed or untimed\n");
+    printf("%-24s %10s %10s %8s %12s %12s\n", "device", "rms (us)", "max (us)", "ignored", "crystal ppm", "latency ms");
+    for (int i = 0; i < count; i++)
+    {
+        struct device *d = &devices[i];
+        printf("%-24s ", d->path);
+        if (d->error)
+            printf("ERROR: %s\n", d->error);
+        else if (d->counted == 0)
+            printf("never locked\n");
+        else
+        {
+            // A positive correction shortens the ticks of a slow crystal
+            double ppm = -(double)d->status.rate / 65536 / TICK_TIMER_COUNTS * 1e6;
+            printf("%10.0f %10.0f %8u %12.1f %12.2f\n", sqrt(d->sum_squares / d->counted), d->max_us, d->ignored, ppm, d->latency_ms);
+        }
+    }
+}
+
+static int run(struct device *devices, int count, uint16_t simulation, double interval_ms, double duration_ms)
+{
+    int epoll = epoll_create1(0);
+    if (epoll == -1)
+    {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    // Open every port first so that the boards reset in parallel
+    double start = now_ms();
+    uint8_t hello[PACKET_OVERHEAD];
+    size_t hello_length = packet_encode(hello, HELLO, NULL, 0);
+    for (int i = 0; i < count; i++)
+    {
+        ssize_t error;
+        struct device *d = &devices[i];
+        d->packet.state = HEADERA;
+        d->latency_ms = -1;
+        d->port = serial_new(d->path, 9600, &error);
+        if (!d->port)
+        {
+            d->error = serial_error_string(error);
+            continue;
+        }
+
+        serial_set_hangup(d->port, true);
+        d->booting = true;
+        d->waiting = true;
+        d->deadline = start + READY_TIMEOUT_MS;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = d };
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, serial_fd(d->port), &ev) == -1)
+        {
+            d->error = "failed to watch port";
+            d->waiting = false;
+        }
+
+        // Devices behind lightboxd are already running
+        else if (serial_is_socket(d->port) && serial_write(d->port, hello, hello_length) < 0)
+            fail(d, epoll, "failed to send request");
+    }
+
+    wait_devices(devices, count, epoll, 0);
+
+    printf("Round  Time (s)");
+    for (int i = 0; i < count; i++)
+        printf("  %6s %-2d", "Device", i);
+    printf("  Spread (us)\n");
+
+    // The first beacon that a device applies starts the simulation at the epoch
+    double epoch = now_ms() + EPOCH_DELAY_MS;
+    for (uint32_t round = 0; ; round++)
+    {
+        double target = round == 0 ? 0 : epoch + (round - 1) * interval_ms;
+        wait_devices(devices, count, epoll, target);
+        if (round > 0 && target - epoch > duration_ms)
+            break;
+
+        int active = 0;
+        for (int i = 0; i < count; i++)
+        {
+            struct device *d = &devices[i];
+            if (!d->error)
+            {
+                send_beacon(d, epoll, epoch, d->started ? 0 : SYNC_START, simulation);
+                active++;
+            }
+        }
+
+        if (active == 0)
+            break;
+
+        wait_devices(devices, count, epoll, 0);
+
+        // Errors are reported in microseconds against the host clock
+        double min = INFINITY, max = -INFINITY;
+        printf("%5u  %8.1f", round, (now_ms() - epoch) / 1e3);
+        for (int i = 0; i < count; i++)
+        {
+            struct device *d = &devices[i];
+            if (d->error || !d->replied)
+            {
+                printf("  %9s", "-");
+                continue;
+            }
+
+            // The first error includes the time since the device booted
+            double us = d->status.error * TICK_COUNT_SECONDS * 1e6;
+            if (round == 0)
+            {
+                printf("  %9s", d->status.state == SYNC_OFF ? "off" : "start");
+                continue;
+            }
+
+            // Delayed beacons are reported but not applied
+            if (d->status.state == SYNC_IGNORED)
+            {
+                printf("  %+8.0f*", us);
+                continue;
+            }
+
+            printf("  %+9.0f", us);
+            if (us < min)
+                min = us;
+            if (us > max)
+                max = us;
+        }
+
+        if (max >= min)
+            printf("  %11.0f", max - min);
+        printf("\n");
+        fflush(stdout);
+    }
+
+    summarize(devices, count);
+
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        struct device *d = &devices[i];
+        if (d->error || d->counted == 0)
+            failed++;
+        if (d->port)
+            serial_free(d->port);
+    }
+
+    close(epoll);
+    return failed ? 1 : 0;
+}
+
+int lockstep_main(int argc, char *argv[])
+{
+    double interval = DEFAULT_INTERVAL_S;
+    double duration = DEFAULT_DURATION_S;
+    while (argc >= 2 && argv[0][0] == '-')
+    {
+        if (strcmp(argv[0], "-i") == 0)
+            interval = atof(argv[1]);
+        else if (strcmp(argv[0], "-d") == 0)
+            duration = atof(argv[1]);
+        else
+            goto usage;
+
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc < 2 || atoi(argv[0]) <= 0 || interval <= 0 || duration <= 0)
+        goto usage;
+
+    uint16_t simulation = atoi(argv[0]);
+    int count = argc - 1;
+    struct device *devices = calloc(count, sizeof(struct device));
+    if (!devices)
+    {
+        printf("Allocation failure\n");
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        devices[i].path = argv[1 + i];
+        printf("Device %d: %s\n", i, devices[i].path);
+    }
+
+    int ret = run(devices, count, simulation, interval * 1e3, duration * 1e3);
+    free(devices);
+    return ret;
+
+usage:
+    printf("Usage: starsimulator -s [-i <interval>] [-d <duration>] <id> <device> [<device> ...]\n");
+    printf("  -i  seconds between beacons (default %d)\n", DEFAULT_INTERVAL_S);
+    printf("  -d  seconds to run before reporting (default %d)\n", DEFAULT_DURATION_S);
+    return 2;
+}
+
+#else
+
+int lockstep_main(int argc, char *argv[])
+{
+    printf("Synchronized mode is only supported on Linux\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,15 @@
+/*
+ * Copyright 2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+// Run a simulation on several devices with their phases locked together.
+// argv holds the options, the simulation id, then the device paths
+int lockstep_main(int argc, char *argv[]);
+
+#endif
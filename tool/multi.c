@@ -0,0 +1,350 @@
+/*
+ * Copyright 2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+//
+// Apply a single command to many lightboxes at once.
+//
+// All ports are opened together so that the boards reset and boot in
+// parallel, and a single epoll loop sends the request to each device as soon
+// as it reports READY and then collects the responses.  The total time is
+// therefore roughly that of configuring a single device.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "multi.h"
+#include "protocol.h"
+#include "serial.h"
+
+#ifdef __linux__
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+// Opening the port resets the board.  Older firmware doesn't send READY,
+// but has booted by the time this expires
+#define READY_TIMEOUT_MS 3000
+
+// Give up on devices that haven't responded after this long
+#define RESPONSE_TIMEOUT_MS 3000
+
+enum multi_action { ACTION_LIST, ACTION_STATS, ACTION_SELECT };
+
+struct device
+{
+    const char *path;
+    struct serial_port *port;
+    struct timer_packet packet;
+
+    bool booting;
+    bool done;
+    const char *error;
+    double deadline;
+    double latency_ms;
+
+    // Results
+    struct packet_simulation_count count;
+    uint16_t names;
+    char active_name[MAX_SIMULATION_NAME_LENGTH + 1];
+    struct packet_stats stats;
+    uint16_t selected;
+};
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Returns true when the device has sent everything needed for the action
+static bool handle_packet(struct device *d, enum multi_action action, struct timer_packet *p)
+{
+    switch (p->type)
+    {
+        case SIMULATION_COUNT:
+            d->count = p->data.count;
+            return action == ACTION_LIST && d->count.total == 0;
+        case SIMULATION_NAME:
+        {
+            struct packet_simulation_name *sim = &p->data.name;
+            uint8_t length = sim->name_length < MAX_SIMULATION_NAME_LENGTH ? sim->name_length : MAX_SIMULATION_NAME_LENGTH;
+            if (sim->id == d->count.active)
+            {
+                memcpy(d->active_name, sim->name, length);
+                d->active_name[length] = '\0';
+            }
+
+            return action == ACTION_LIST && ++d->names == d->count.total;
+        }
+        case STATS:
+            d->stats = p->data.stats;
+            return action == ACTION_STATS;
+        case SET_MODE:
+            d->selected = p->data.set_simulation.id;
+            return action == ACTION_SELECT;
+        default:
+            return false;
+    }
+}
+
+static void send_request(struct device *d, const uint8_t *request, size_t length)
+{
+    d->booting = false;
+    d->deadline = now_ms() + RESPONSE_TIMEOUT_MS;
+    if (serial_write(d->port, request, length) < 0)
+    {
+        d->error = "failed to send request";
+        d->done = true;
+    }
+}
+
+static void report(struct device *d, enum multi_action action)
+{
+    printf("%-24s ", d->path);
+    if (d->error)
+    {
+        printf("ERROR: %s\n", d->error);
+        return;
+    }
+
+    switch (action)
+    {
+        case ACTION_LIST:
+            printf("%3hu of %3hu  %-40s", d->count.active, d->count.total, d->active_name);
+            break;
+        case ACTION_STATS:
+        {
+            struct packet_stats *s = &d->stats;
+            printf("tick max %5u us  overruns %5hu  rx overflows %5hu  parse errors %5u",
+                   s->tick_max * STATS_COUNT_US, s->tick_overruns, s->rx_overflows,
+                   s->checksum_errors + s->footer_errors + s->long_packets + s->unknown_packets);
+            break;
+        }
+        case ACTION_SELECT:
+            printf("selected %3hu", d->selected);
+            break;
+    }
+
+    printf("  (%.0f ms)\n", d->latency_ms);
+}
+
+static int run(struct device *devices, int count, enum multi_action action, uint16_t id)
+{
+    int epoll = epoll_create1(0);
+    if (epoll == -1)
+    {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    // Open every port first so that the boards reset in parallel
+    double start = now_ms();
+    for (int i = 0; i < count; i++)
+    {
+        ssize_t error;
+        struct device *d = &devices[i];
+        d->packet.state = HEADERA;
+        d->port = serial_new(d->path, 9600, &error);
+        if (!d->port)
+        {
+            d->error = serial_error_string(error);
+            d->done = true;
+        }
+        else
+        {
+            serial_set_hangup(d->port, true);
+            d->booting = !serial_is_socket(d->port);
+            d->deadline = start + READY_TIMEOUT_MS;
+        }
+    }
+
+    uint8_t request[PACKET_OVERHEAD + sizeof(struct packet_set_mode)];
+    size_t request_length = 0;
+    switch (action)
+    {
+        case ACTION_LIST: request_length = packet_encode(request, REQUEST_NAMES, NULL, 0); break;
+        case ACTION_STATS: request_length = packet_encode(request, STATS, NULL, 0); break;
+        case ACTION_SELECT:
+        {
+            struct packet_set_mode mode = { .id = id };
+            request_length = packet_encode(request, SET_MODE, &mode, sizeof(mode));
+            break;
+        }
+    }
+
+    int pending = 0;
+    for (int i = 0; i < count; i++)
+    {
+        struct device *d = &devices[i];
+        if (d->done)
+            continue;
+
+        // Booting devices are sent the request once they report READY
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = d };
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, serial_fd(d->port), &ev) == -1)
+        {
+            d->error = "failed to send request";
+            d->done = true;
+            continue;
+        }
+
+        if (!d->booting)
+            send_request(d, request, request_length);
+
+        if (!d->done)
+            pending++;
+    }
+
+    while (pending > 0)
+    {
+        // Send the request to devices that haven't reported READY in time,
+        // and give up on devices that haven't responded
+        double now = now_ms();
+        double next = now + RESPONSE_TIMEOUT_MS;
+        for (int i = 0; i < count; i++)
+        {
+            struct device *d = &devices[i];
+            if (d->done)
+                continue;
+
+            if (now >= d->deadline && d->booting)
+                send_request(d, request, request_length);
+            else if (now >= d->deadline)
+            {
+                d->error = "no response";
+                d->done = true;
+            }
+
+            if (d->done)
+            {
+                epoll_ctl(epoll, EPOLL_CTL_DEL, serial_fd(d->port), NULL);
+                pending--;
+                continue;
+            }
+
+            if (d->deadline < next)
+                next = d->deadline;
+        }
+
+        if (pending == 0)
+            break;
+
+        struct epoll_event events[16];
+        int ready = epoll_wait(epoll, events, 16, (int)(next - now) + 1);
+        for (int i = 0; i < ready; i++)
+        {
+            struct device *d = events[i].data.ptr;
+            uint8_t buf[256];
+            ssize_t length = serial_read(d->port, buf, sizeof(buf));
+            if (length < 0)
+            {
+                d->error = serial_error_string(length);
+                d->done = true;
+                epoll_ctl(epoll, EPOLL_CTL_DEL, serial_fd(d->port), NULL);
+                pending--;
+                continue;
+            }
+
+            for (ssize_t j = 0; j < length && !d->done; j++)
+            {
+                if (!packet_parse_byte(&d->packet, buf[j]))
+                    continue;
+
+                // Anything sent before READY is from the bootloader or a previous session
+                if (d->booting)
+                {
+                    if (d->packet.type == READY)
+                        send_request(d, request, request_length);
+
+                    if (d->done)
+                    {
+                        epoll_ctl(epoll, EPOLL_CTL_DEL, serial_fd(d->port), NULL);
+                        pending--;
+                    }
+                }
+                else if (handle_packet(d, action, &d->packet))
+                {
+                    d->done = true;
+                    d->latency_ms = now_ms() - start;
+                    epoll_ctl(epoll, EPOLL_CTL_DEL, serial_fd(d->port), NULL);
+                    pending--;
+                }
+            }
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        struct device *d = &devices[i];
+        if (d->error)
+            failed++;
+
+        report(d, action);
+        if (d->port)
+            serial_free(d->port);
+    }
+
+    printf("%d of %d devices succeeded in %.0f ms\n", count - failed, count, now_ms() - start);
+    close(epoll);
+    return failed ? 1 : 0;
+}
+
+int multi_main(int argc, char *argv[])
+{
+    if (argc < 2)
+        goto usage;
+
+    enum multi_action action;
+    uint16_t id = 0;
+    int first = 1;
+    if (strcmp(argv[0], "list") == 0)
+        action = ACTION_LIST;
+    else if (strcmp(argv[0], "stats") == 0)
+        action = ACTION_STATS;
+    else if (strcmp(argv[0], "select") == 0 && argc >= 3 && atoi(argv[1]) > 0)
+    {
+        action = ACTION_SELECT;
+        id = atoi(argv[1]);
+        first = 2;
+    }
+    else
+        goto usage;
+
+    int count = argc - first;
+    struct device *devices = calloc(count, sizeof(struct device));
+    if (!devices)
+    {
+        printf("Allocation failure\n");
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++)
+        devices[i].path = argv[first + i];
+
+    int ret = run(devices, count, action, id);
+    free(devices);
+    return ret;
+
+usage:
+    printf("Usage: starsimulator -m list <device> [<device> ...]\n");
+    printf("       starsimulator -m stats <device> [<device> ...]\n");
+    printf("       starsimulator -m select <id> <device> [<device> ...]\n");
+    return 2;
+}
+
+#else
+
+int multi_main(int argc, char *argv[])
+{
+    printf("Multi-device mode is only supported on Linux\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,15 @@
+/*
+ * Copyright 2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+#ifndef MULTI_H
+#define MULTI_H
+
+// Run a command against several devices in parallel.
+// argv holds the command, its arguments, then the device paths
+int multi_main(int argc, char *argv[]);
+
+#endif
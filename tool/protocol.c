@@ -0,0 +1,141 @@
+/*
+ * Copyright 2010-2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "protocol.h"
+
+// Firmware before 16-bit simulation ids sent an 8-bit id (and total) in these
+// packets.  Widen them in place so that callers only see the current layout
+static void upgrade_legacy(struct timer_packet *p)
+{
+    uint8_t *bytes = p->data.bytes;
+    switch (p->type)
+    {
+        case SIMULATION_COUNT:
+            if (p->length == 2)
+            {
+                uint8_t total = bytes[0], active = bytes[1];
+                p->data.count.total = total;
+                p->data.count.active = active;
+                p->length = sizeof(struct packet_simulation_count);
+            }
+            break;
+        case SET_MODE:
+            if (p->length == 1)
+            {
+                p->data.set_simulation.id = bytes[0];
+                p->length = sizeof(struct packet_set_mode);
+            }
+            break;
+        case SIMULATION_TYPE:
+            if (p->length == sizeof(struct packet_simulation) - 1)
+            {
+                uint8_t id = bytes[0];
+                memmove(bytes + 2, bytes + 1, p->length - 1);
+                p->data.simulation.id = id;
+                p->length = sizeof(struct packet_simulation);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+bool packet_parse_byte(struct timer_packet *p, uint8_t b)
+{
+    switch (p->state)
+    {
+        case HEADERA:
+        case HEADERB:
+            if (b == '$')
+                p->state++;
+            else
+                p->state = HEADERA;
+            break;
+        case TYPE:
+            p->type = b;
+            p->state++;
+            break;
+        case LENGTH:
+            p->length = b;
+            p->progress = 0;
+            p->checksum = 0;
+            if (p->length == 0)
+                p->state = CHECKSUM;
+            else if (p->length <= sizeof(p->data))
+                p->state++;
+            else
+            {
+                printf("Warning: ignoring long packet: %c (length %u)\n", p->type, p->length);
+                p->state = HEADERA;
+            }
+            break;
+        case DATA:
+            p->checksum ^= b;
+            p->data.bytes[p->progress++] = b;
+            if (p->progress == p->length)
+                p->state++;
+            break;
+        case CHECKSUM:
+            if (p->checksum == b)
+                p->state++;
+            else
+            {
+                printf("Warning: Packet checksum failed. Got 0x%02x, expected 0x%02x.\n", b, p->checksum);
+                p->state = HEADERA;
+            }
+            break;
+        case FOOTERA:
+            if (b == '\r')
+                p->state++;
+            else
+            {
+                printf("Warning: Invalid packet end byte. Got 0x%02x, expected 0x%02x.\n", b, '\r');
+                p->state = HEADERA;
+            }
+            break;
+        case FOOTERB:
+            p->state = HEADERA;
+            if (b == '\n')
+            {
+                upgrade_legacy(p);
+                return true;
+            }
+
+            printf("Warning: Invalid packet end byte. Got 0x%02x, expected 0x%02x.\n", b, '\n');
+            break;
+    }
+
+    return false;
+}
+
+size_t packet_encode(uint8_t *buf, uint8_t type, const void *data, uint8_t length)
+{
+    // Header
+    size_t i = 0;
+    buf[i++] = '$';
+    buf[i++] = '$';
+    buf[i++] = type;
+    buf[i++] = length;
+
+    // Data
+    uint8_t checksum = 0;
+    for (uint8_t j = 0; j < length; j++)
+    {
+        uint8_t b = ((const uint8_t *)data)[j];
+        buf[i++] = b;
+        checksum ^= b;
+    }
+
+    // Footer
+    buf[i++] = checksum;
+    buf[i++] = '\r';
+    buf[i++] = '\n';
+
+    return i;
+}
@@ -0,0 +1,331 @@
+/*
+ * Copyright 2010-2014 Paul Chote
+ * This file is part of Puoko-nui, which is free software. It is made available
+ * to you under the terms of version 3 of the GNU General Public License, as
+ * published by the Free Software Foundation. For more information, see LICENSE.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Force gcc ABI for packed structs under windows
+#ifdef _WIN32
+#   define PACKED_STRUCT __attribute__((gcc_struct, __packed__))
+#else
+#   define PACKED_STRUCT __attribute__((__packed__))
+#endif
+
+// Message protocol definitions
+#define MAX_DATA_LENGTH 200
+
+// Must be less than MAX_DATA_LENGTH - 5
+#define MAX_SIMULATION_NAME_LENGTH 40
+#define MAX_SIMULATION_DESC_LENGTH 150
+
+enum packet_state {HEADERA = 0, HEADERB, TYPE, LENGTH, DATA, CHECKSUM, FOOTERA, FOOTERB};
+enum packet_type
+{
+    REQUEST_MODES = 'A',
+    SET_MODE = 'B',
+    MESSAGE = 'C',
+    SIMULATION_TYPE = 'D',
+    SIMULATION_COUNT = 'E',
+    REQUEST_NAMES = 'F',
+    REQUEST_DETAILS = 'G',
+    REQUEST_PAGE = 'H',
+    SIMULATION_NAME = 'I',
+    STATS = 'J',
+    TICK_COUNT = 'K',
+    SET_TRIM = 'L',
+    HELLO = 'N',
+    TASKS = 'O',
+
+    // Sent unprompted once the firmware has booted, with a HELLO payload
+    READY = 'P',
+
+    // Changes one parameter of the running simulation, and is echoed back with the result
+    SET_PARAM = 'Q',
+
+    // Store, start, stop or query the playlist, each answered with a PLAYLIST packet
+    SET_PLAYLIST = 'R',
+    START_PLAYLIST = 'S',
+    STOP_PLAYLIST = 'T',
+    PLAYLIST = 'U',
+
+    // Time beacon for synchronizing several devices, answered with SYNC_STATUS
+    SYNC = 'V',
+    SYNC_STATUS = 'W',
+
+    // Handled by lightboxd and never sent to the device
+    SUBSCRIBE = 'M',
+};
+
+// The firmware updates every 255 timer counts of 64us
+#define TICK_TIMER_COUNTS 255
+#define TICK_COUNT_SECONDS 64e-6
+
+// Firmware durations are measured in 4us timer counts
+#define STATS_COUNT_US 4
+#define STATS_COUNT_CYCLES 64
+
+struct PACKED_STRUCT packet_message
+{
+    uint8_t length;
+    char str[MAX_DATA_LENGTH-1];
+};
+
+struct PACKED_STRUCT packet_simulation
+{
+    uint16_t id;
+    uint16_t exptime;
+
+    char name[MAX_SIMULATION_NAME_LENGTH + 1];
+    uint8_t name_length;
+
+    char desc[MAX_SIMULATION_DESC_LENGTH + 1];
+    uint8_t desc_length;
+};
+
+struct PACKED_STRUCT packet_simulation_name
+{
+    uint16_t id;
+    uint8_t name_length;
+    char name[MAX_SIMULATION_NAME_LENGTH + 1];
+};
+
+struct PACKED_STRUCT packet_simulation_count
+{
+    uint16_t total;
+    uint16_t active;
+};
+
+struct PACKED_STRUCT packet_set_mode
+{
+    uint16_t id;
+};
+
+struct PACKED_STRUCT packet_tick_count
+{
+    uint32_t ticks;
+    uint8_t counts;
+    int16_t trim;
+};
+
+struct PACKED_STRUCT packet_set_trim
+{
+    int16_t ppm;
+};
+
+// Optional packet groups reported by HELLO
+#define FEATURE_PAGED_CATALOG 0x0001
+#define FEATURE_STATS         0x0002
+#define FEATURE_TRIM          0x0004
+#define FEATURE_TASKS         0x0008
+#define FEATURE_PARAMS        0x0010
+#define FEATURE_PLAYLIST      0x0020
+#define FEATURE_SYNC          0x0040
+
+struct PACKED_STRUCT packet_hello
+{
+    uint32_t build_hash;
+    uint32_t catalog_hash;
+    uint8_t protocol_version;
+    uint16_t features;
+    uint16_t total;
+    uint16_t active;
+};
+
+#define MAX_TASKS 8
+#define TASK_NAME_LENGTH 8
+
+struct PACKED_STRUCT packet_task
+{
+    char name[TASK_NAME_LENGTH];
+    uint32_t runs;
+    uint32_t time;
+};
+
+// Task runtimes are measured in timer0 counts (TICK_COUNT_SECONDS)
+struct PACKED_STRUCT packet_tasks
+{
+    uint32_t idle;
+    uint8_t count;
+    struct packet_task tasks[MAX_TASKS];
+};
+
+// Firmware fixed-point units: output intensity, cloud transparency, and
+// cloud control point spacing per tick
+#define OUTPUT_MAX (0x03FF << 6)
+#define CLOUD_UNITY 32768
+#define CLOUD_TICK 65536
+
+enum simulation_parameter
+{
+    // Channel intensity in output units (0 - OUTPUT_MAX), mode amplitudes are rescaled
+    PARAM_LEVEL = 0,
+
+    // Channel current source (0, 1, 2, 4 or 8 for disabled, 5uA, 50uA, 500uA and 5mA)
+    PARAM_CURRENT = 1,
+
+    // Phase increment per tick of a sinusoidal mode or a periodic channel
+    PARAM_FREQUENCY = 2,
+
+    // Sinusoid or pulse amplitude in millionths of the channel level
+    PARAM_AMPLITUDE = 3,
+
+    // Phase of a sinusoidal mode or a periodic channel, as a 32-bit fraction of a cycle
+    PARAM_PHASE = 4,
+
+    // Cloud control point spacing (CLOUD_TICK units) and transparency (CLOUD_UNITY units)
+    PARAM_CLOUD_MIN_PERIOD = 5,
+    PARAM_CLOUD_MAX_PERIOD = 6,
+    PARAM_CLOUD_MIN_INTENSITY = 7,
+    PARAM_CLOUD_MAX_INTENSITY = 8,
+};
+
+// index selects the mode for sinusoid and pulse parameters.
+// status is 1 in the reply if the change was applied
+struct PACKED_STRUCT packet_set_param
+{
+    uint8_t channel;
+    uint8_t parameter;
+    uint8_t index;
+    int32_t value;
+    uint8_t status;
+};
+
+#define MAX_PLAYLIST_ENTRIES 16
+#define PLAYLIST_LOOP 0x01
+
+// Durations are measured in ticks, and 0 remains on the simulation and stops the playlist
+struct PACKED_STRUCT packet_playlist_entry
+{
+    uint16_t simulation;
+    uint32_t duration;
+};
+
+// Only the first count entries are sent
+struct PACKED_STRUCT packet_playlist
+{
+    uint8_t flags;
+    uint8_t count;
+    struct packet_playlist_entry entries[MAX_PLAYLIST_ENTRIES];
+};
+
+// Entries are numbered from 0
+struct PACKED_STRUCT packet_start_playlist
+{
+    uint8_t entry;
+};
+
+// status is 1 if the request was applied, and remaining
+// counts the ticks until the next entry starts
+struct PACKED_STRUCT packet_playlist_status
+{
+    uint8_t status;
+    uint8_t running;
+    uint8_t entry;
+    uint32_t remaining;
+    struct packet_playlist playlist;
+};
+
+#define SYNC_START 0x01
+
+// Shared time in ticks and timer counts since the host's epoch when the
+// final byte arrives.  SYNC_START loads the simulation with its phases
+// starting at tick 0
+struct PACKED_STRUCT packet_sync
+{
+    uint8_t flags;
+    uint16_t simulation;
+    uint32_t ticks;
+    uint8_t counts;
+};
+
+// SYNC_IGNORED is reported when the beacon was rejected as delayed, or arrived
+// too close to other input for the device to timestamp it
+enum sync_state { SYNC_OFF = 0, SYNC_STEPPED = 1, SYNC_LOCKED = 2, SYNC_IGNORED = 3 };
+
+// The measured error is in timer counts (positive if the device was behind)
+// and the frequency correction in 1/65536 counts per tick
+struct PACKED_STRUCT packet_sync_status
+{
+    int32_t error;
+    int32_t rate;
+    uint8_t state;
+};
+
+struct PACKED_STRUCT packet_simulation_range
+{
+    uint16_t first;
+    uint16_t last;
+};
+
+struct PACKED_STRUCT packet_stats_request
+{
+    uint8_t reset;
+};
+
+struct PACKED_STRUCT packet_stats
+{
+    uint16_t tick_min;
+    uint16_t tick_max;
+    uint16_t tick_overruns;
+    uint16_t rx_overflows;
+
+    // Packets that found the output buffer full, and log messages dropped as a result
+    uint16_t tx_full;
+    uint16_t tx_dropped;
+    uint8_t output_high_water;
+    uint8_t input_high_water;
+    uint16_t checksum_errors;
+    uint16_t footer_errors;
+    uint16_t long_packets;
+    uint16_t unknown_packets;
+};
+
+struct timer_packet
+{
+    enum packet_state state;
+    enum packet_type type;
+    uint8_t length;
+    uint8_t progress;
+    uint8_t checksum;
+
+    union
+    {
+        // Extra byte allows us to always null-terminate strings for display
+        uint8_t bytes[MAX_DATA_LENGTH+1];
+        struct packet_message message;
+        struct packet_simulation simulation;
+        struct packet_simulation_name name;
+        struct packet_simulation_count count;
+        struct packet_set_mode set_simulation;
+        struct packet_stats stats;
+        struct packet_tick_count tick_count;
+        struct packet_simulation_range range;
+        struct packet_hello hello;
+        struct packet_tasks tasks;
+        struct packet_set_param param;
+        struct packet_playlist_status playlist;
+        struct packet_sync_status sync;
+    } data;
+};
+
+// Header, type, length, checksum and footer bytes
+#define PACKET_OVERHEAD 7
+
+// Feed a received byte to the packet state machine.
+// Returns true when p holds a complete, valid packet.  Packets from firmware
+// with 8-bit simulation ids are widened to the current layout.
+bool packet_parse_byte(struct timer_packet *p, uint8_t b);
+
+// Frame length bytes of data into buf, which must hold length + PACKET_OVERHEAD bytes.
+// Returns the number of bytes written.
+size_t packet_encode(uint8_t *buf, uint8_t type, const void *data, uint8_t length);
+
+#endif
@@ -6,31 +6,309 @@
  */
 
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "serial.h"
 
 #ifdef _WIN32
 #   include <windows.h>
 #else
-#   include <errno.h>
 #   include <fcntl.h>
 #   include <poll.h>
 #   include <sys/ioctl.h>
+#   include <sys/socket.h>
+#   include <sys/stat.h>
+#   include <sys/un.h>
 #   include <termios.h>
 #endif
+
+// Captured sessions start with CAPTURE_MAGIC, followed by a record for each
+// buffer: the record type, the microseconds since the previous record and the
+// buffer length (both as LEB128 varints), then the data.  The tool reads a byte
+// at a time, so most records take four bytes
+#define CAPTURE_MAGIC "LBSESS01"
+#define CAPTURE_MAGIC_LENGTH 8
+#define CAPTURE_MIN_RECORD 3
+#define CAPTURE_MAX_HEADER 11
+#define CAPTURE_READ 'R'
+#define CAPTURE_WRITE 'W'
+
+#define REPLAY_PREFIX "replay:"
+#define REPLAY_FAST_PREFIX "replay-fast:"
+
+struct replay_record
+{
+    uint8_t type;
+    uint16_t length;
+    const uint8_t *data;
+
+    // Seconds since the start of the capture, and the bytes written before the record
+    double time;
+    uint64_t written;
+};
+
+struct replay
+{
+    uint8_t *file;
+    struct replay_record *records;
+    size_t count;
+    bool fast;
+
+    // Host time when the replay started, and how far the replayed
+    // writes have fallen behind their recorded times, in seconds
+    double start;
+    double lag;
+
+    // Next read and write records, and the bytes of each that have been used
+    size_t read;
+    size_t read_offset;
+    size_t write;
+    size_t write_offset;
+
+    uint64_t written;
+    size_t mismatches;
+};
+
 struct serial_port
 {
 #ifdef _WIN32
     HANDLE handle;
 #else
     int fd;
+
+    // Connected to a lightboxd socket rather than the device itself
+    bool socket;
 #endif
+
+    // Buffers are recorded here while capturing
+    FILE *capture;
+    double capture_time;
+
+    // Recorded session that stands in for the device, if replaying
+    struct replay *replay;
 };
 
+// Monotonic host clock, in seconds
+static double monotonic_time()
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+// Decode a varint from buf[*i], stopping at end.  Returns false if it is truncated
+static bool read_varint(const uint8_t *buf, long *i, long end, uint32_t *value)
+{
+    *value = 0;
+    for (uint8_t shift = 0; *i < end && shift < 32; shift += 7)
+    {
+        uint8_t b = buf[(*i)++];
+        *value |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+// Returns the number of bytes written to buf
+static uint8_t write_varint(uint8_t *buf, uint32_t value)
+{
+    uint8_t length = 0;
+    do
+    {
+        buf[length] = value & 0x7F;
+        value >>= 7;
+        if (value)
+            buf[length] |= 0x80;
+        length++;
+    } while (value);
+
+    return length;
+}
+
+// Load a captured session, returning NULL and setting error on failure
+static struct replay *replay_load(const char *path, bool fast, ssize_t *error)
+{
+    struct replay *r = calloc(1, sizeof(struct replay));
+    FILE *f = fopen(path, "rb");
+    if (!r || !f)
+    {
+        *error = r ? -errno : -ENOMEM;
+        goto error;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    r->file = malloc(length > 0 ? length : 1);
+    if (!r->file || length < CAPTURE_MAGIC_LENGTH || fread(r->file, 1, length, f) != (size_t)length ||
+        memcmp(r->file, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0)
+    {
+        *error = r->file ? -EINVAL : -ENOMEM;
+        goto error;
+    }
+
+    r->records = calloc((length - CAPTURE_MAGIC_LENGTH) / CAPTURE_MIN_RECORD + 1, sizeof(struct replay_record));
+    if (!r->records)
+    {
+        *error = -ENOMEM;
+        goto error;
+    }
+
+    double time = 0;
+    uint64_t written = 0;
+    for (long i = CAPTURE_MAGIC_LENGTH; i < length;)
+    {
+        struct replay_record *rec = &r->records[r->count];
+        uint32_t delta, size;
+        rec->type = r->file[i++];
+
+        // Ignore a record truncated by an interrupted capture
+        if (!read_varint(r->file, &i, length, &delta) || !read_varint(r->file, &i, length, &size) ||
+            size > UINT16_MAX || i + size > length)
+            break;
+
+        time += delta / 1e6;
+        rec->time = time;
+        rec->length = size;
+        rec->data = r->file + i;
+        rec->written = written;
+        i += size;
+
+        if (rec->type == CAPTURE_WRITE)
+            written += rec->length;
+        r->count++;
+    }
+
+    fclose(f);
+    r->fast = fast;
+    r->start = monotonic_time();
+    return r;
+
+error:
+    if (f)
+        fclose(f);
+    if (r)
+    {
+        free(r->records);
+        free(r->file);
+    }
+    free(r);
+    return NULL;
+}
+
+static void replay_free(struct replay *r)
+{
+    free(r->records);
+    free(r->file);
+    free(r);
+}
+
+static ssize_t replay_read(struct replay *r, uint8_t *buf, size_t length)
+{
+    while (r->read < r->count && r->records[r->read].type != CAPTURE_READ)
+        r->read++;
+
+    // The device stays silent once the recording ends
+    if (r->read == r->count)
+        return 0;
+
+    // Responses aren't returned before the requests that preceded them
+    struct replay_record *rec = &r->records[r->read];
+    if (r->written < rec->written)
+        return 0;
+
+    if (!r->fast && monotonic_time() - r->start < rec->time + r->lag)
+        return 0;
+
+    size_t count = rec->length - r->read_offset;
+    if (count > length)
+        count = length;
+
+    memcpy(buf, rec->data + r->read_offset, count);
+    r->read_offset += count;
+    if (r->read_offset == rec->length)
+    {
+        r->read++;
+        r->read_offset = 0;
+    }
+
+    return count;
+}
+
+static ssize_t replay_write(struct replay *r, const uint8_t *buf, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        while (r->write < r->count && r->records[r->write].type != CAPTURE_WRITE)
+            r->write++;
+
+        // Anything written after the end of the recording is unexpected
+        if (r->write == r->count)
+        {
+            r->mismatches += length - i;
+            break;
+        }
+
+        // Later responses are delayed by as much as the host is behind the recording
+        struct replay_record *rec = &r->records[r->write];
+        if (r->write_offset == 0)
+        {
+            double lag = monotonic_time() - r->start - rec->time;
+            if (lag > r->lag)
+                r->lag = lag;
+        }
+
+        if (rec->data[r->write_offset] != buf[i])
+            r->mismatches++;
+
+        if (++r->write_offset == rec->length)
+        {
+            r->write++;
+            r->write_offset = 0;
+        }
+    }
+
+    r->written += length;
+    return length;
+}
+
+static void capture_record(struct serial_port *port, uint8_t type, const uint8_t *buf, size_t length)
+{
+    // Split buffers that don't fit in a record
+    while (length > 0)
+    {
+        double now = monotonic_time();
+        double delta = (now - port->capture_time) * 1e6;
+        uint16_t chunk = length > UINT16_MAX ? UINT16_MAX : length;
+        port->capture_time = now;
+
+        uint8_t header[CAPTURE_MAX_HEADER];
+        uint8_t header_length = 1;
+        header[0] = type;
+        header_length += write_varint(header + header_length, delta > UINT32_MAX ? UINT32_MAX : (uint32_t)(delta + 0.5));
+        header_length += write_varint(header + header_length, chunk);
+        fwrite(header, 1, header_length, port->capture);
+        fwrite(buf, 1, chunk, port->capture);
+
+        buf += chunk;
+        length -= chunk;
+    }
+}
+
 
 #ifdef _WIN32
 // Static buffer for error messages
@@ -41,6 +319,24 @@ struct serial_port *serial_new(const char *path, uint32_t baud, ssize_t *error)
 {
     struct serial_port *port = calloc(1, sizeof(struct serial_port));
 
+    bool fast = strncmp(path, REPLAY_FAST_PREFIX, strlen(REPLAY_FAST_PREFIX)) == 0;
+    if (port && (fast || strncmp(path, REPLAY_PREFIX, strlen(REPLAY_PREFIX)) == 0))
+    {
+        port->replay = replay_load(strchr(path, ':') + 1, fast, error);
+        if (!port->replay)
+        {
+            free(port);
+            return NULL;
+        }
+
+#ifdef _WIN32
+        port->handle = 0;
+#else
+        port->fd = -1;
+#endif
+        return port;
+    }
+
 #ifdef _WIN32
     if (!port)
     {
@@ -118,6 +414,30 @@ open_error:
         return NULL;
     }
 
+    // Connect to the daemon if it owns the port
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+        port->socket = true;
+        port->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (port->fd == -1)
+        {
+            *error = -errno;
+            goto open_error;
+        }
+
+        if (connect(port->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            *error = -errno;
+            goto configuration_error;
+        }
+
+        return port;
+    }
+
     // Open port read/write; don't wait for hardware CARRIER line
     port->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (port->fd == -1)
@@ -178,6 +498,9 @@ open_error:
         goto configuration_error;
     }
 
+    // Discard anything received before the port was opened
+    tcflush(port->fd, TCIFLUSH);
+
     return port;
 configuration_error:
     close(port->fd);
@@ -189,6 +512,11 @@ open_error:
 
 void serial_free(struct serial_port *port)
 {
+    if (port->capture)
+        fclose(port->capture);
+    if (port->replay)
+        replay_free(port->replay);
+
 #ifdef _WIN32
     if (port->handle != 0)
         CloseHandle(port->handle);
@@ -199,18 +527,61 @@ void serial_free(struct serial_port *port)
     free(port);
 }
 
+#ifndef _WIN32
+int serial_fd(struct serial_port *port)
+{
+    return port->fd;
+}
+#endif
+
+bool serial_is_socket(struct serial_port *port)
+{
+#ifdef _WIN32
+    return false;
+#else
+    return port->socket;
+#endif
+}
+
 void serial_set_dtr(struct serial_port *port, bool enabled)
 {
+    if (port->replay)
+        return;
+
 #ifdef _WIN32
     EscapeCommFunction(port->handle, enabled ? SETDTR : CLRDTR);
 #else
+    // The daemon owns the control lines
+    if (port->socket)
+        return;
+
     int val = enabled ? TIOCM_DTR : 0;
     ioctl(port->fd, TIOCMSET, &val);
 #endif
 }
 
-ssize_t serial_read(struct serial_port *port, uint8_t *buf, size_t length)
+void serial_set_hangup(struct serial_port *port, bool enabled)
+{
+#ifndef _WIN32
+    // Windows doesn't change DTR when the port is closed
+    struct termios tio;
+    if (port->replay || port->socket || tcgetattr(port->fd, &tio) == -1)
+        return;
+
+    if (enabled)
+        tio.c_cflag |= HUPCL;
+    else
+        tio.c_cflag &= ~HUPCL;
+    tcsetattr(port->fd, TCSANOW, &tio);
+#endif
+}
+
+// Read from the device or recording, without capturing
+static ssize_t port_read(struct serial_port *port, uint8_t *buf, size_t length)
 {
+    if (port->replay)
+        return replay_read(port->replay, buf, length);
+
 #ifdef _WIN32
     DWORD read;
     if (!ReadFile(port->handle, buf, length, &read, NULL))
@@ -235,8 +606,11 @@ ssize_t serial_read(struct serial_port *port, uint8_t *buf, size_t length)
 #endif
 }
 
-ssize_t serial_write(struct serial_port *port, const uint8_t *buf, size_t length)
+static ssize_t port_write(struct serial_port *port, const uint8_t *buf, size_t length)
 {
+    if (port->replay)
+        return replay_write(port->replay, buf, length);
+
 #ifdef _WIN32
     DWORD written;
     if (!WriteFile(port->handle, buf, length, &written, NULL))
@@ -248,6 +622,47 @@ ssize_t serial_write(struct serial_port *port, const uint8_t *buf, size_t length
 #endif
 }
 
+ssize_t serial_read(struct serial_port *port, uint8_t *buf, size_t length)
+{
+    ssize_t ret = port_read(port, buf, length);
+    if (port->capture && ret > 0)
+        capture_record(port, CAPTURE_READ, buf, ret);
+    return ret;
+}
+
+ssize_t serial_write(struct serial_port *port, const uint8_t *buf, size_t length)
+{
+    ssize_t ret = port_write(port, buf, length);
+    if (port->capture && ret > 0)
+        capture_record(port, CAPTURE_WRITE, buf, ret);
+    return ret;
+}
+
+ssize_t serial_capture(struct serial_port *port, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -errno;
+
+    if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LENGTH, f) != CAPTURE_MAGIC_LENGTH)
+    {
+        fclose(f);
+        return -EIO;
+    }
+
+    if (port->capture)
+        fclose(port->capture);
+
+    port->capture = f;
+    port->capture_time = monotonic_time();
+    return 0;
+}
+
+ssize_t serial_replay_mismatches(struct serial_port *port)
+{
+    return port->replay ? (ssize_t)port->replay->mismatches : -1;
+}
+
 const char *serial_error_string(ssize_t code)
 {
 #ifdef _WIN32
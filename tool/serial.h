@@ -13,15 +13,41 @@
 
 #if (defined _WIN32 && !defined _WIN64)
 typedef int ssize_t;
+#elif !defined _WIN32
+#   include <sys/types.h>
 #endif
 
 struct serial_port;
 
+// Paths of the form replay:<file> or replay-fast:<file> open a session recorded
+// by serial_capture instead of a device.  Recorded reads are returned once the
+// writes that preceded them have been replayed, and (unless fast) no earlier
+// than their recorded time.  Replayed writes are compared against the recording
 struct serial_port *serial_new(const char *path, uint32_t baud, ssize_t *error);
 void serial_free(struct serial_port *port);
 void serial_set_dtr(struct serial_port *port, bool enabled);
+
+// Choose whether closing the port drops DTR.  Asserting DTR resets the board,
+// so if it is left asserted then later connections won't reset it
+void serial_set_hangup(struct serial_port *port, bool enabled);
+
+// True if connected to lightboxd instead of the device.
+// The device is already running, so there is no need to wait for it to boot
+bool serial_is_socket(struct serial_port *port);
 ssize_t serial_read(struct serial_port *port, uint8_t *buf, size_t length);
 ssize_t serial_write(struct serial_port *port, const uint8_t *buf, size_t length);
 const char *serial_error_string(ssize_t code);
 
+// Record every buffer that is read or written, with a microsecond timestamp, to path.
+// Returns 0 on success or a negative error code
+ssize_t serial_capture(struct serial_port *port, const char *path);
+
+// Number of replayed bytes that differed from the recording, or -1 if not replaying
+ssize_t serial_replay_mismatches(struct serial_port *port);
+
+#ifndef _WIN32
+// Underlying file descriptor, for use with poll/epoll
+int serial_fd(struct serial_port *port);
+#endif
+
 #endif
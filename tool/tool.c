@@ -5,11 +5,18 @@
  * published by the Free Software Foundation. For more information, see LICENSE.
  */
 
+#include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include "bench.h"
+#include "cache.h"
+#include "lockstep.h"
+#include "multi.h"
+#include "protocol.h"
 #include "serial.h"
 
 #ifdef _WIN32
@@ -18,78 +25,27 @@
 #   include <sys/time.h>
 #endif
 
+// Interval between calibration samples, in ms
+#define CALIBRATION_INTERVAL 1000
 
-// Force gcc ABI for packed structs under windows
+// Time allowed for the board to boot after a reset, in ms.
+// Older firmware doesn't send READY, but has booted by then
+#define READY_TIMEOUT 3000
+
+// Monotonic host clock, in seconds
+static double host_time()
+{
 #ifdef _WIN32
-#   define PACKED_STRUCT __attribute__((gcc_struct, __packed__))
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / frequency.QuadPart;
 #else
-#   define PACKED_STRUCT __attribute__((__packed__))
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 #endif
-
-// Message protocol definitions
-#define MAX_DATA_LENGTH 200
-
-// Must be less than MAX_DATA_LENGTH - 5
-#define MAX_SIMULATION_NAME_LENGTH 40
-#define MAX_SIMULATION_DESC_LENGTH 150
-
-enum packet_state {HEADERA = 0, HEADERB, TYPE, LENGTH, DATA, CHECKSUM, FOOTERA, FOOTERB};
-enum packet_type
-{
-    REQUEST_MODES = 'A',
-    SET_MODE = 'B',
-    MESSAGE = 'C',
-    SIMULATION_TYPE = 'D',
-    SIMULATION_COUNT = 'E',
-};
-
-struct PACKED_STRUCT packet_message
-{
-    uint8_t length;
-    char str[MAX_DATA_LENGTH-1];
-};
-
-struct PACKED_STRUCT packet_simulation
-{
-    uint8_t id;
-    uint16_t exptime;
-
-    char name[MAX_SIMULATION_NAME_LENGTH + 1];
-    uint8_t name_length;
-
-    char desc[MAX_SIMULATION_DESC_LENGTH + 1];
-    uint8_t desc_length;
-};
-
-struct PACKED_STRUCT packet_simulation_count
-{
-    uint8_t total;
-    uint8_t active;
-};
-
-struct PACKED_STRUCT packet_set_mode
-{
-    uint8_t id;
-};
-
-struct timer_packet
-{
-    enum packet_state state;
-    enum packet_type type;
-    uint8_t length;
-    uint8_t progress;
-    uint8_t checksum;
-
-    union
-    {
-        // Extra byte allows us to always null-terminate strings for display
-        uint8_t bytes[MAX_DATA_LENGTH+1];
-        struct packet_message message;
-        struct packet_simulation simulation;
-        struct packet_simulation_count count;
-        struct packet_set_mode set_simulation;
-    } data;
-};
+}
 
 static void millisleep(int ms)
 {
@@ -101,6 +57,28 @@ static void millisleep(int ms)
 }
 
 struct packet_simulation_count config;
+bool have_config = false;
+
+struct packet_tick_count last_tick_count;
+bool have_tick_count = false;
+
+struct packet_hello hello;
+bool have_hello = false;
+
+// Full catalog, indexed by id - 1, when the device supports HELLO
+struct packet_simulation *catalog = NULL;
+
+// Store received simulation details in catalog instead of printing them
+bool collecting = false;
+
+static void print_simulation(const struct packet_simulation *sim)
+{
+    printf("   %3hu     %s\n", sim->id, sim->name);
+    printf(" %s  %s\n", sim->id == config.active ? "(active)" : "        ", sim->desc);
+    printf("           Recommended exposure time: ~%gs\n", sim->exptime / 1000.0f);
+    printf("\n");
+}
+
 static void parse_packet(struct timer_packet *p)
 {
     // Handle packet
@@ -116,18 +94,116 @@ static void parse_packet(struct timer_packet *p)
         case SIMULATION_TYPE:
         {
             struct packet_simulation *sim = &p->data.simulation;
-            printf("    %2hhu     %s\n", sim->id, sim->name);
-            printf(" %s  %s\n", sim->id == config.active ? "(active)" : "        ", sim->desc);
-            printf("           Recommended exposure time: ~%gs\n", sim->exptime / 1000.0f);
-            printf("\n");
+            if (collecting)
+            {
+                if (sim->id >= 1 && sim->id <= hello.total)
+                    catalog[sim->id - 1] = *sim;
+            }
+            else
+                print_simulation(sim);
+            break;
+        }
+        case SIMULATION_NAME:
+        {
+            struct packet_simulation_name *sim = &p->data.name;
+            if (sim->name_length > MAX_SIMULATION_NAME_LENGTH)
+                sim->name_length = MAX_SIMULATION_NAME_LENGTH;
+            sim->name[sim->name_length] = '\0';
+            printf(" %s %3hu  %s\n", sim->id == config.active ? "*" : " ", sim->id, sim->name);
             break;
         }
         case SET_MODE:
-            printf("Changed simulation type to %hhu\n", p->data.set_simulation.id);
+            printf("Changed simulation type to %hu\n", p->data.set_simulation.id);
             break;
         case SIMULATION_COUNT:
             config = p->data.count;
+            have_config = true;
+            break;
+        case HELLO:
+        case READY:
+            hello = p->data.hello;
+            have_hello = true;
+            config.total = hello.total;
+            config.active = hello.active;
+            have_config = true;
             break;
+        case TICK_COUNT:
+            last_tick_count = p->data.tick_count;
+            have_tick_count = true;
+            break;
+        case STATS:
+        {
+            struct packet_stats *s = &p->data.stats;
+            if (s->tick_min > s->tick_max)
+                printf("Tick duration:       no ticks measured\n");
+            else
+                printf("Tick duration:       %u - %u us (%u - %u cycles)\n",
+                       s->tick_min * STATS_COUNT_US, s->tick_max * STATS_COUNT_US,
+                       s->tick_min * STATS_COUNT_CYCLES, s->tick_max * STATS_COUNT_CYCLES);
+            printf("Tick overruns:       %hu\n", s->tick_overruns);
+            printf("RX overflows:        %hu\n", s->rx_overflows);
+            printf("TX buffer full:      %hu times, %hu messages dropped\n", s->tx_full, s->tx_dropped);
+            printf("Buffer high water:   %u output, %u input (of 255)\n",
+                   s->output_high_water, s->input_high_water);
+            printf("Parse errors:        %hu checksum, %hu footer, %hu long, %hu unknown type\n",
+                   s->checksum_errors, s->footer_errors, s->long_packets, s->unknown_packets);
+            break;
+        }
+        case TASKS:
+        {
+            struct packet_tasks *t = &p->data.tasks;
+            uint8_t count = t->count < MAX_TASKS ? t->count : MAX_TASKS;
+
+            // Time spent outside the main loop is accounted to the task that was interrupted
+            double total = t->idle;
+            for (uint8_t i = 0; i < count; i++)
+                total += t->tasks[i].time;
+
+            printf("Task        Runs    Time (s)   Load\n");
+            for (uint8_t i = 0; i < count; i++)
+            {
+                struct packet_task *task = &t->tasks[i];
+                printf("%-8.*s  %8u  %10.3f  %5.1f%%\n", TASK_NAME_LENGTH, task->name, task->runs,
+                       task->time * TICK_COUNT_SECONDS, total ? 100 * task->time / total : 0);
+            }
+            printf("%-8s  %8s  %10.3f  %5.1f%%\n", "idle", "-", t->idle * TICK_COUNT_SECONDS,
+                   total ? 100 * t->idle / total : 0);
+            break;
+        }
+        case SET_PARAM:
+            printf("Parameter %s\n", p->data.param.status ? "updated" : "rejected by the device");
+            break;
+        case PLAYLIST:
+        {
+            struct packet_playlist_status *s = &p->data.playlist;
+            struct packet_playlist *list = &s->playlist;
+            if (!s->status)
+                printf("Playlist request rejected by the device\n");
+
+            if (list->count == 0)
+            {
+                printf("No playlist stored\n");
+                break;
+            }
+
+            printf("Playlist%s:\n", list->flags & PLAYLIST_LOOP ? " (looping)" : "");
+            for (uint8_t i = 0; i < list->count && i < MAX_PLAYLIST_ENTRIES; i++)
+            {
+                struct packet_playlist_entry *e = &list->entries[i];
+                printf(" %s %2u  simulation %3hu  ", s->running && s->entry == i ? "*" : " ", i + 1, e->simulation);
+                if (e->duration)
+                    printf("%.1f s\n", e->duration * TICK_TIMER_COUNTS * TICK_COUNT_SECONDS);
+                else
+                    printf("until stopped\n");
+            }
+
+            if (s->running)
+                printf("Playing entry %u, next in %.1f s\n", s->entry + 1,
+                       s->remaining * TICK_TIMER_COUNTS * TICK_COUNT_SECONDS);
+            else
+                printf("Stopped\n");
+            break;
+        }
         default:
             printf("Unknown packet type: %c\n", p->type);
     }
@@ -135,35 +211,15 @@ static void parse_packet(struct timer_packet *p)
 
 static int send_data(struct serial_port *port, uint8_t type, const void *data, uint8_t length)
 {
-    uint8_t *packet = calloc(length + 7, sizeof(uint8_t));
+    uint8_t *packet = calloc(length + PACKET_OVERHEAD, sizeof(uint8_t));
     if (!packet)
     {
         printf("Allocation failure\n");
         return 1;
     }
 
-    // Header
-    size_t i = 0;
-    packet[i++] = '$';
-    packet[i++] = '$';
-    packet[i++] = type;
-    packet[i++] = length;
-
-    // Data
-    uint8_t checksum = 0;
-    for (uint8_t j = 0; j < length; j++)
-    {
-        uint8_t b = ((uint8_t *)data)[j];
-        packet[i++] = b;
-        checksum ^= b;
-    }
-
-    // Footer
-    packet[i++] = checksum;
-    packet[i++] = '\r';
-    packet[i++] = '\n';
-
-    ssize_t error = serial_write(port, packet, length + 7);
+    size_t packet_length = packet_encode(packet, type, data, length);
+    ssize_t error = serial_write(port, packet, packet_length);
     if (error < 0)
         printf("Connection error %zd: %s\n", error, serial_error_string(error));
 
@@ -177,12 +233,45 @@ void clear_buffer(struct serial_port *port)
     while (serial_read(port, &b, 1));
 }
 
-int query_response(struct serial_port *port)
+// Wait for the READY packet that is sent once the board has booted.
+// Anything sent by the previous session or the bootloader is discarded.
+// Returns 0 on success, or 1 if it didn't arrive before the timeout
+static int wait_ready(struct serial_port *port, int timeout)
+{
+    struct timer_packet p = (struct timer_packet){.state = HEADERA};
+    double start = host_time();
+    while (host_time() - start < timeout / 1000.0)
+    {
+        uint8_t b;
+        ssize_t status = serial_read(port, &b, 1);
+        if (status < 0)
+        {
+            printf("Read error (%zd): %s\n", status, serial_error_string(status));
+            return 1;
+        }
+
+        if (status == 0)
+            millisleep(1);
+        else if (packet_parse_byte(&p, b) && p.type == READY)
+        {
+            parse_packet(&p);
+            printf("Device ready after %.0f ms\n", (host_time() - start) * 1000);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Read and handle packets until the given packet type has been
+// handled (or any type, if until is zero) and the connection goes quiet
+static int read_packets(struct serial_port *port, uint8_t until)
 {
     struct timer_packet p = (struct timer_packet){.state = HEADERA};
     uint8_t b;
     ssize_t status;
     size_t timeout = 0;
+    bool done = false;
 
     for (;;)
     {
@@ -192,7 +281,7 @@ int query_response(struct serial_port *port)
         if (status == 0)
         {
             // Assume transmission is complete after 500ms without new data
-            if (timeout >= 500)
+            if (timeout >= 500 || done)
                 break;
 
             timeout += 10;
@@ -209,65 +298,10 @@ int query_response(struct serial_port *port)
             goto error;
         }
 
-        switch (p.state)
+        if (packet_parse_byte(&p, b))
         {
-            case HEADERA:
-            case HEADERB:
-                if (b == '$')
-                    p.state++;
-                else
-                    p.state = HEADERA;
-                break;
-            case TYPE:
-                p.type = b;
-                p.state++;
-                break;
-            case LENGTH:
-                p.length = b;
-                p.progress = 0;
-                p.checksum = 0;
-                if (p.length == 0)
-                    p.state = CHECKSUM;
-                else if (p.length <= sizeof(p.data))
-                    p.state++;
-                else
-                {
-                    printf("Warning: ignoring long packet: %c (length %u)\n", p.type, p.length);
-                    p.state = HEADERA;
-                }
-                break;
-            case DATA:
-                p.checksum ^= b;
-                p.data.bytes[p.progress++] = b;
-                if (p.progress == p.length)
-                    p.state++;
-                break;
-            case CHECKSUM:
-                if (p.checksum == b)
-                    p.state++;
-                else
-                {
-                    printf("Warning: Packet checksum failed. Got 0x%02x, expected 0x%02x.\n", b, p.checksum);
-                    p.state = HEADERA;
-                }
-                break;
-            case FOOTERA:
-                if (b == '\r')
-                    p.state++;
-                else
-                {
-                    printf("Warning: Invalid packet end byte. Got 0x%02x, expected 0x%02x.\n", b, '\r');
-                    p.state = HEADERA;
-                }
-                break;
-            case FOOTERB:
-                if (b == '\n')
-                    parse_packet(&p);
-                else
-                    printf("Warning: Invalid packet end byte. Got 0x%02x, expected 0x%02x.\n", b, '\n');
-
-                p.state = HEADERA;
-                break;
+            parse_packet(&p);
+            done |= until && p.type == until;
         }
     }
 
@@ -277,10 +311,306 @@ error:
     return 1;
 }
 
+int query_response(struct serial_port *port)
+{
+    return read_packets(port, 0);
+}
+
+// Fetch the full simulation catalog, using the on-disk cache if the device
+// firmware matches a previously seen catalog.  Returns 1 on error
+static int load_catalog(struct serial_port *port)
+{
+    catalog = catalog_cache_load(hello.catalog_hash, hello.total);
+    if (catalog || hello.total == 0)
+        return 0;
+
+    catalog = calloc(hello.total, sizeof(struct packet_simulation));
+    if (!catalog)
+    {
+        printf("Allocation failure\n");
+        return 1;
+    }
+
+    struct packet_simulation_range range = { .first = 1, .last = hello.total + 1 };
+    collecting = true;
+    int ret = send_data(port, REQUEST_PAGE, &range, sizeof(struct packet_simulation_range)) ||
+        query_response(port);
+    collecting = false;
+    if (ret)
+        return 1;
+
+    // Don't cache (or trust) a catalog with entries lost to line errors
+    for (uint16_t i = 0; i < hello.total; i++)
+    {
+        if (catalog[i].id != i + 1)
+        {
+            printf("Warning: incomplete simulation catalog received\n");
+            free(catalog);
+            catalog = NULL;
+            return 0;
+        }
+    }
+
+    if (catalog_cache_store(hello.catalog_hash, catalog, hello.total))
+        printf("Warning: failed to cache simulation catalog\n");
+
+    return 0;
+}
+
+// Print simulation details from the cached catalog, with first <= id <= last
+static void describe_cached(int first, int last)
+{
+    if (first < 1)
+        first = 1;
+    if (last > hello.total)
+        last = hello.total;
+
+    for (int id = first; id <= last; id++)
+        print_simulation(&catalog[id - 1]);
+}
+
+// Request the device tick count, returning the device and host times (in seconds)
+// at the midpoint of the request.  Returns 1 on error
+static int sample_clock(struct serial_port *port, double *device, double *host)
+{
+    have_tick_count = false;
+    double start = host_time();
+    if (send_data(port, TICK_COUNT, NULL, 0) || read_packets(port, TICK_COUNT) != 0)
+        return 1;
+
+    if (!have_tick_count)
+    {
+        printf("Device did not respond to tick count request\n");
+        return 1;
+    }
+
+    *host = (start + host_time()) / 2;
+    *device = ((double)last_tick_count.ticks * TICK_TIMER_COUNTS + last_tick_count.counts) * TICK_COUNT_SECONDS;
+    return 0;
+}
+
+// Measure the device crystal error against the host clock with a least squares fit
+// of device time against host time, and store the result as the device trim
+static int calibrate(struct serial_port *port, int duration)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    double host0 = 0, device0 = 0;
+    int samples = duration * 1000 / CALIBRATION_INTERVAL;
+    if (samples < 2)
+        samples = 2;
+
+    printf("Calibrating for %d s...\n", duration);
+    for (int i = 0; i < samples; i++)
+    {
+        double host, device;
+        if (sample_clock(port, &device, &host))
+            return 1;
+
+        if (i == 0)
+        {
+            host0 = host;
+            device0 = device;
+        }
+
+        double x = host - host0;
+        double y = device - device0;
+        sx += x;
+        sy += y;
+        sxx += x*x;
+        sxy += x*y;
+
+        if (i + 1 < samples)
+            millisleep(CALIBRATION_INTERVAL);
+    }
+
+    double slope = (samples*sxy - sx*sy) / (samples*sxx - sx*sx);
+    double ppm = (slope - 1) * 1e6;
+    printf("Device clock error: %+.1f ppm (previous trim %+d ppm)\n", ppm, last_tick_count.trim);
+
+    if (ppm < INT16_MIN || ppm > INT16_MAX)
+    {
+        printf("Measured error is out of range - not storing\n");
+        return 1;
+    }
+
+    struct packet_set_trim trim = { .ppm = (int16_t)(ppm < 0 ? ppm - 0.5 : ppm + 0.5) };
+    have_tick_count = false;
+    if (send_data(port, SET_TRIM, &trim, sizeof(struct packet_set_trim)) ||
+        read_packets(port, TICK_COUNT) != 0)
+        return 1;
+
+    if (!have_tick_count)
+    {
+        printf("Device did not acknowledge the new trim\n");
+        return 1;
+    }
+
+    printf("Stored trim of %+d ppm\n", last_tick_count.trim);
+    return 0;
+}
+
+// Parse "<channel> <name> [<mode>] <value>" or "cloud <name> <value>" into a SET_PARAM
+// request, converting the value into firmware units.  Returns 1 if the command is invalid
+static int parse_param(const char *args, struct packet_set_param *param)
+{
+    char target[8], name[16], first[16], second[16];
+    int fields = sscanf(args, " %7s %15s %15s %15s", target, name, first, second);
+    if (fields < 3)
+        return 1;
+
+    // The value follows the optional mode number
+    const char *value = fields == 4 ? second : first;
+    double v = atof(value);
+    memset(param, 0, sizeof(struct packet_set_param));
+    param->index = fields == 4 ? atoi(first) : 0;
+
+    if (strcmp(target, "cloud") == 0)
+    {
+        if (strcmp(name, "min_period") == 0 || strcmp(name, "max_period") == 0)
+        {
+            param->parameter = name[1] == 'i' ? PARAM_CLOUD_MIN_PERIOD : PARAM_CLOUD_MAX_PERIOD;
+            param->value = lround(v / (TICK_TIMER_COUNTS * TICK_COUNT_SECONDS) * CLOUD_TICK);
+        }
+        else if (strcmp(name, "min") == 0 || strcmp(name, "max") == 0)
+        {
+            param->parameter = name[1] == 'i' ? PARAM_CLOUD_MIN_INTENSITY : PARAM_CLOUD_MAX_INTENSITY;
+            param->value = lround(v * CLOUD_UNITY);
+        }
+        else
+            return 1;
+
+        return 0;
+    }
+
+    param->channel = atoi(target);
+    if (strcmp(name, "duty") == 0)
+    {
+        param->parameter = PARAM_LEVEL;
+        param->value = lround(v * OUTPUT_MAX);
+    }
+    else if (strcmp(name, "current") == 0)
+    {
+        const char *currents[] = { "disabled", "5uA", "50uA", "500uA", "5mA" };
+        const int32_t values[] = { 0, 1, 2, 4, 8 };
+        param->parameter = PARAM_CURRENT;
+        param->value = -1;
+        for (uint8_t i = 0; i < 5; i++)
+            if (strcmp(value, currents[i]) == 0)
+                param->value = values[i];
+
+        if (param->value < 0)
+            return 1;
+    }
+    else if (strcmp(name, "freq") == 0 || strcmp(name, "period") == 0)
+    {
+        // Frequencies are sent as the untrimmed phase increment per tick
+        double freq = name[0] == 'f' ? v : 1 / v;
+        param->parameter = PARAM_FREQUENCY;
+        param->value = (int32_t)(uint32_t)llround(freq * TICK_TIMER_COUNTS * TICK_COUNT_SECONDS * 4294967296.0);
+    }
+    else if (strcmp(name, "mma") == 0 || strcmp(name, "amplitude") == 0)
+    {
+        // Sinusoid amplitudes are given in mma, and pulse amplitudes as a fraction of the level
+        param->parameter = PARAM_AMPLITUDE;
+        param->value = lround(name[0] == 'm' ? v * 1000 : v * 1e6);
+    }
+    else if (strcmp(name, "phase") == 0)
+    {
+        param->parameter = PARAM_PHASE;
+        param->value = (int32_t)(uint32_t)llround((v - floor(v)) * 4294967296.0);
+    }
+    else
+        return 1;
+
+    return 0;
+}
+
+// Parse "<id> <seconds> [<id> <seconds> ...] [loop]" into a SET_PLAYLIST request.
+// Returns the packet length, or 0 if the playlist is invalid
+static uint8_t parse_playlist(char *args, struct packet_playlist *list)
+{
+    memset(list, 0, sizeof(struct packet_playlist));
+    for (char *token = strtok(args, " \t\r\n"); token; token = strtok(NULL, " \t\r\n"))
+    {
+        if (strcmp(token, "loop") == 0)
+        {
+            list->flags |= PLAYLIST_LOOP;
+            continue;
+        }
+
+        char *seconds = strtok(NULL, " \t\r\n");
+        int id = atoi(token);
+        if (!seconds || id <= 0 || id > config.total || list->count == MAX_PLAYLIST_ENTRIES)
+            return 0;
+
+        // Durations are rounded to whole ticks
+        struct packet_playlist_entry *e = &list->entries[list->count++];
+        e->simulation = id;
+        e->duration = lround(atof(seconds) / (TICK_TIMER_COUNTS * TICK_COUNT_SECONDS));
+    }
+
+    if (list->count == 0)
+        return 0;
+
+    return offsetof(struct packet_playlist, entries) + list->count * sizeof(struct packet_playlist_entry);
+}
+
+static void print_help()
+{
+    printf("<number>                      select a simulation\n"
+           "d <number>                    describe a simulation\n"
+           "d <first> <last>              describe a range of simulations\n"
+           "stats [reset]                 show (or reset) the performance counters\n"
+           "tasks                         show the background task runtimes\n"
+           "calibrate [seconds]           measure and store the crystal error\n"
+           "set <channel> <param> [<mode>] <value>\n"
+           "                              adjust duty, current, freq, period, mma,\n"
+           "                              amplitude or phase of the running simulation\n"
+           "set cloud <param> <value>     adjust cloud min, max, min_period or max_period\n"
+           "playlist                      show the stored playlist\n"
+           "playlist start [<entry>]      run the playlist\n"
+           "playlist stop                 stop the playlist\n"
+           "playlist <number> <seconds> [<number> <seconds> ...] [loop]\n"
+           "                              store a new playlist\n");
+}
+
 int main(int argc, char *argv[])
 {
     char *device = "COM6";
 
+    // Apply a single command to several devices at once
+    if (argc >= 2 && strcmp(argv[1], "-m") == 0)
+        return multi_main(argc - 2, argv + 2);
+
+    // Run a simulation in step on several devices
+    if (argc >= 2 && strcmp(argv[1], "-s") == 0)
+        return lockstep_main(argc - 2, argv + 2);
+
+    // Measure protocol latencies
+    if (argc >= 2 && strcmp(argv[1], "-b") == 0)
+        return bench_main(argc - 2, argv + 2);
+
+    // Leave DTR asserted so that this and later connections don't reset the board
+    bool reset = true;
+    const char *capture = NULL;
+    while (argc >= 2)
+    {
+        if (strcmp(argv[1], "-n") == 0)
+            reset = false;
+        else if (strcmp(argv[1], "-c") == 0 && argc >= 3)
+        {
+            // Record the session for replay
+            capture = argv[2];
+            argc--;
+            argv++;
+        }
+        else
+            break;
+
+        argc--;
+        argv++;
+    }
+
     if (argc >= 2)
         device = argv[1];
 
@@ -296,21 +626,178 @@ int main(int argc, char *argv[])
 		return 1;
     }
 
-    millisleep(2000);
+    if (capture && (error = serial_capture(port, capture)) < 0)
+        printf("Unable to capture to %s: %s\n", capture, serial_error_string(error));
+
+    // Opening the port resets the board unless DTR was left asserted
+    serial_set_hangup(port, reset);
+    if (reset && !serial_is_socket(port) && wait_ready(port, READY_TIMEOUT))
+        printf("Device didn't report READY; assuming it has booted\n");
     clear_buffer(port);
 
-    if (send_data(port, REQUEST_MODES, NULL, 0))
+    printf("Querying simulation types...\n\n");
+
+    // Devices that answer HELLO report a catalog hash that keys the on-disk cache
+    if (!have_hello && (send_data(port, HELLO, NULL, 0) || read_packets(port, HELLO) != 0))
         goto error;
 
-    printf("Querying simulation types...\n\n");
+    // The board may still reset the first time DTR is left asserted
+    if (!reset && !have_hello && !wait_ready(port, READY_TIMEOUT))
+        clear_buffer(port);
 
-    if (query_response(port) != 0)
+    if (have_hello && load_catalog(port))
         goto error;
-    
-    printf("Enter simulation number, then press enter to continue: ");
-    
-    char inputbuf[10];
-    int sim = atoi(fgets(inputbuf, 10, stdin));
+
+    if (catalog)
+    {
+        for (uint16_t i = 0; i < hello.total; i++)
+            printf(" %s %3hu  %s\n", catalog[i].id == config.active ? "*" : " ", catalog[i].id, catalog[i].name);
+    }
+    else
+    {
+        // Only fetch the names up front; descriptions are requested on demand
+        if (send_data(port, REQUEST_NAMES, NULL, 0) || query_response(port) != 0)
+            goto error;
+
+        // Older firmware doesn't understand REQUEST_NAMES, and won't have sent a count
+        if (!have_config)
+        {
+            if (send_data(port, REQUEST_MODES, NULL, 0) || query_response(port) != 0)
+                goto error;
+        }
+    }
+
+    int sim;
+    for (;;)
+    {
+        printf("\nEnter simulation number to select it, or 'help' for other commands: ");
+
+        char inputbuf[256];
+        if (!fgets(inputbuf, sizeof(inputbuf), stdin))
+            goto error;
+
+        if (strncmp(inputbuf, "help", 4) == 0)
+        {
+            printf("\n");
+            print_help();
+            continue;
+        }
+
+        if (strncmp(inputbuf, "stats", 5) == 0)
+        {
+            struct packet_stats_request request = { .reset = strstr(inputbuf, "reset") != NULL };
+            printf("\n");
+            if (send_data(port, STATS, &request, sizeof(struct packet_stats_request)) ||
+                query_response(port) != 0)
+                goto error;
+            continue;
+        }
+
+        if (strncmp(inputbuf, "tasks", 5) == 0)
+        {
+            printf("\n");
+            if (send_data(port, TASKS, NULL, 0) || query_response(port) != 0)
+                goto error;
+            continue;
+        }
+
+        int duration = 600;
+        if (strncmp(inputbuf, "calibrate", 9) == 0)
+        {
+            sscanf(inputbuf + 9, "%d", &duration);
+            printf("\n");
+            if (calibrate(port, duration))
+                goto error;
+            continue;
+        }
+
+        if (strncmp(inputbuf, "set", 3) == 0)
+        {
+            struct packet_set_param param;
+            printf("\n");
+            if (!(hello.features & FEATURE_PARAMS))
+                printf("Device firmware doesn't support parameter changes\n");
+            else if (parse_param(inputbuf + 3, &param))
+                printf("Invalid parameter change\n");
+            else if (send_data(port, SET_PARAM, &param, sizeof(struct packet_set_param)) ||
+                     read_packets(port, SET_PARAM) != 0)
+                goto error;
+            continue;
+        }
+
+        if (strncmp(inputbuf, "playlist", 8) == 0)
+        {
+            char *args = inputbuf + 8;
+            struct packet_playlist list;
+            struct packet_start_playlist start = { .entry = 0 };
+            int entry;
+            printf("\n");
+            if (!(hello.features & FEATURE_PLAYLIST))
+                printf("Device firmware doesn't support playlists\n");
+            else if (strspn(args, " \t\r\n") == strlen(args))
+            {
+                if (send_data(port, PLAYLIST, NULL, 0) || read_packets(port, PLAYLIST) != 0)
+                    goto error;
+            }
+            else if (strstr(args, "start"))
+            {
+                // Entries are numbered from 1 for the user
+                if (sscanf(args, " start %d", &entry) == 1 && entry > 0)
+                    start.entry = entry - 1;
+                if (send_data(port, START_PLAYLIST, &start, sizeof(struct packet_start_playlist)) ||
+                    read_packets(port, PLAYLIST) != 0)
+                    goto error;
+            }
+            else if (strstr(args, "stop"))
+            {
+                if (send_data(port, STOP_PLAYLIST, NULL, 0) || read_packets(port, PLAYLIST) != 0)
+                    goto error;
+            }
+            else
+            {
+                uint8_t length = parse_playlist(args, &list);
+                if (!length)
+                    printf("Invalid playlist\n");
+                else if (send_data(port, SET_PLAYLIST, &list, length) || read_packets(port, PLAYLIST) != 0)
+                    goto error;
+            }
+            continue;
+        }
+
+        int first, last;
+        int fields = sscanf(inputbuf, " d %d %d", &first, &last);
+        if (fields >= 1 && catalog)
+        {
+            printf("\n");
+            describe_cached(first, fields == 2 ? last : first);
+            continue;
+        }
+
+        if (fields == 1)
+        {
+            struct packet_set_mode details = { .id = first };
+            printf("\n");
+            if (send_data(port, REQUEST_DETAILS, &details, sizeof(struct packet_set_mode)) ||
+                query_response(port) != 0)
+                goto error;
+            continue;
+        }
+
+        if (fields == 2)
+        {
+            // Ranges are inclusive for the user, but half-open in the protocol
+            struct packet_simulation_range range = { .first = first, .last = last + 1 };
+            printf("\n");
+            if (send_data(port, REQUEST_PAGE, &range, sizeof(struct packet_simulation_range)) ||
+                query_response(port) != 0)
+                goto error;
+            continue;
+        }
+
+        sim = atoi(inputbuf);
+        break;
+    }
+
     if (sim <= 0 || sim > config.total)
     {
         printf("Invalid option selected\n");
@@ -326,14 +813,21 @@ int main(int argc, char *argv[])
         goto error;
 
     // Force a reset to load new profile
-    serial_set_dtr(port, true);
-    millisleep(100);
-    serial_set_dtr(port, false);
+    if (reset)
+    {
+        serial_set_dtr(port, true);
+        millisleep(100);
+        serial_set_dtr(port, false);
+    }
 
 error:
+    if (serial_replay_mismatches(port) > 0)
+        printf("\nWarning: %zd bytes sent differed from the recording\n", serial_replay_mismatches(port));
+
     printf("\n[Press enter to exit]\n");
     getchar();
     
+    free(catalog);
     serial_free(port);
     return 1;
 }
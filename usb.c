@@ -8,6 +8,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <avr/eeprom.h>
@@ -16,10 +17,32 @@
 
 #include "usb.h"
 #include "main.h"
-#include "simulation.h"
+#include "playlist.h"
+#include "scheduler.h"
+#include "sync.h"
 
 #define MAX_DATA_LENGTH 200
 
+// Identifies the firmware build. Set by the Makefile from a checksum of the sources
+#ifndef BUILD_HASH
+#define BUILD_HASH 0
+#endif
+
+// Protocol revision and optional packet groups, reported by HELLO
+#define PROTOCOL_VERSION 2
+#define FEATURE_PAGED_CATALOG 0x0001
+#define FEATURE_STATS         0x0002
+#define FEATURE_TRIM          0x0004
+#define FEATURE_TASKS         0x0008
+#define FEATURE_PARAMS        0x0010
+#define FEATURE_PLAYLIST      0x0020
+#define FEATURE_SYNC          0x0040
+#define FEATURES (FEATURE_PAGED_CATALOG | FEATURE_STATS | FEATURE_TRIM | FEATURE_TASKS | FEATURE_PARAMS | FEATURE_PLAYLIST | FEATURE_SYNC)
+
+// Packets are sent as raw structs, so the layout must match the
+// unpadded AVR layout when the firmware is built for the host emulator
+#define PACKED_STRUCT __attribute__((__packed__))
+
 // Must be less than MAX_DATA_LENGTH - 5
 #define MAX_SIMULATION_NAME_LENGTH 40
 #define MAX_SIMULATION_DESC_LENGTH 150
@@ -32,17 +55,34 @@ enum packet_type
     MESSAGE = 'C',
     SIMULATION_TYPE = 'D',
     SIMULATION_COUNT = 'E',
+    REQUEST_NAMES = 'F',
+    REQUEST_DETAILS = 'G',
+    REQUEST_PAGE = 'H',
+    SIMULATION_NAME = 'I',
+    STATS = 'J',
+    TICK_COUNT = 'K',
+    SET_TRIM = 'L',
+    HELLO = 'N',
+    TASKS = 'O',
+    READY = 'P',
+    SET_PARAM = 'Q',
+    SET_PLAYLIST = 'R',
+    START_PLAYLIST = 'S',
+    STOP_PLAYLIST = 'T',
+    PLAYLIST = 'U',
+    SYNC = 'V',
+    SYNC_STATUS = 'W',
 };
 
-struct packet_message
+struct PACKED_STRUCT packet_message
 {
     uint8_t length;
     char str[MAX_DATA_LENGTH-1];
 };
 
-struct packet_simulation
+struct PACKED_STRUCT packet_simulation
 {
-    uint8_t id;
+    uint16_t id;
     uint16_t exptime;
 
     // Add an extra byte for a null terminator
@@ -53,15 +93,136 @@ struct packet_simulation
     uint8_t desc_length;
 };
 
-struct packet_simulation_count
+// Only the first name_length characters of name are sent
+struct PACKED_STRUCT packet_simulation_name
+{
+    uint16_t id;
+    uint8_t name_length;
+    char name[MAX_SIMULATION_NAME_LENGTH];
+};
+
+struct PACKED_STRUCT packet_simulation_count
+{
+    uint16_t total;
+    uint16_t active;
+};
+
+struct PACKED_STRUCT packet_set_mode
+{
+    uint16_t id;
+};
+
+// Request the performance counters, optionally resetting them afterwards
+struct PACKED_STRUCT packet_stats_request
+{
+    uint8_t reset;
+};
+
+// Elapsed time since power on: ticks whole ticks plus counts 64us timer counts
+struct PACKED_STRUCT packet_tick_count
+{
+    uint32_t ticks;
+    uint8_t counts;
+    int16_t trim;
+};
+
+struct PACKED_STRUCT packet_set_trim
+{
+    int16_t ppm;
+};
+
+struct PACKED_STRUCT packet_hello
 {
-    uint8_t total;
-    uint8_t active;
+    uint32_t build_hash;
+    uint32_t catalog_hash;
+    uint8_t protocol_version;
+    uint16_t features;
+    uint16_t total;
+    uint16_t active;
 };
 
-struct packet_set_mode
+struct PACKED_STRUCT packet_task
 {
-    uint8_t id;
+    char name[TASK_NAME_LENGTH];
+    uint32_t runs;
+    uint32_t time;
+};
+
+// Task runtimes are reported in timer0 counts
+struct PACKED_STRUCT packet_tasks
+{
+    uint32_t idle;
+    uint8_t count;
+    struct packet_task tasks[TASK_COUNT];
+};
+
+// Changes one simulation_parameter of the running simulation.
+// Echoed back with status set to 1 if the change was applied
+struct PACKED_STRUCT packet_set_param
+{
+    uint8_t channel;
+    uint8_t parameter;
+    uint8_t index;
+    int32_t value;
+    uint8_t status;
+};
+
+// Durations are measured in ticks
+struct PACKED_STRUCT packet_playlist_entry
+{
+    uint16_t simulation;
+    uint32_t duration;
+};
+
+// Only the first count entries are sent
+struct PACKED_STRUCT packet_playlist
+{
+    uint8_t flags;
+    uint8_t count;
+    struct packet_playlist_entry entries[PLAYLIST_MAX_ENTRIES];
+};
+
+struct PACKED_STRUCT packet_start_playlist
+{
+    uint8_t entry;
+};
+
+// Reply to the playlist requests, with status set to 1 if the request was
+// applied and the number of ticks remaining in the running entry
+struct PACKED_STRUCT packet_playlist_status
+{
+    uint8_t status;
+    uint8_t running;
+    uint8_t entry;
+    uint32_t remaining;
+    struct packet_playlist playlist;
+};
+
+// Shared time (in ticks and timer0 counts since the host's epoch) when the
+// packet's final byte is received.  The SYNC_START flag loads the simulation
+// with its phases starting at tick 0
+struct PACKED_STRUCT packet_sync
+{
+    uint8_t flags;
+    uint16_t simulation;
+    uint32_t ticks;
+    uint8_t counts;
+};
+
+// Reply to SYNC, with the measured error in timer0 counts (positive if the
+// device was behind) and the frequency correction in 1/65536 counts per tick
+struct PACKED_STRUCT packet_sync_status
+{
+    int32_t error;
+    int32_t rate;
+    uint8_t state;
+};
+
+// Requests simulations with first <= id < last
+struct PACKED_STRUCT packet_simulation_range
+{
+    uint16_t first;
+    uint16_t last;
 };
 
 struct timer_packet
@@ -77,14 +238,23 @@ struct timer_packet
         // Extra byte allows us to always null-terminate strings for display
         uint8_t bytes[MAX_DATA_LENGTH+1];
         struct packet_set_mode mode;
+        struct packet_simulation_range range;
+        struct packet_stats_request stats;
+        struct packet_set_trim trim;
+        struct packet_set_param param;
+        struct packet_playlist playlist;
+        struct packet_start_playlist start;
+        struct packet_sync sync;
     } data;
 };
 
 const char unknown_packet_fmt[]  PROGMEM = "Unknown packet type '%c' - ignoring";
 const char long_packet_fmt[]     PROGMEM = "Ignoring long packet: %c (length %u)";
+const char short_packet_fmt[]    PROGMEM = "Ignoring short packet: %c (length %u)";
 const char checksum_failed_fmt[] PROGMEM = "Packet checksum failed. Got 0x%02x, expected 0x%02x";
 const char invalid_packet_fmt[]  PROGMEM = "Invalid packet end byte. Got 0x%02x, expected 0x%02x";
 const char got_packet_fmt[]      PROGMEM = "Got packet type '%c'";
+const char invalid_id_fmt[]      PROGMEM = "Invalid simulation id %u";
 
 static uint8_t input_buffer[256];
 static uint8_t input_read = 0;
@@ -94,22 +264,80 @@ static uint8_t output_buffer[256];
 static volatile uint8_t output_read = 0;
 static volatile uint8_t output_write = 0;
 
-// Add a byte to the send buffer.
-// Will block if the buffer is full
-void queue_byte(uint8_t b)
+// Free space needed by a deferred packet before the transmit interrupt
+// should wake the usb task, or 0 if nothing is waiting
+static volatile uint8_t output_wanted = 0;
+
+// Local time that the most recent '\n' was received, and its input buffer
+// index.  This is only the arrival time of a SYNC if it ends that packet
+static volatile uint32_t rx_ticks;
+static volatile uint8_t rx_counts;
+static volatile uint8_t rx_index;
+
+// Header, type, length, checksum and footer bytes around the packet data
+#define PACKET_OVERHEAD 7
+
+// A response that is sent a packet at a time as space becomes available
+// in the output buffer.  Further requests are left in the input buffer
+// until the current response has been sent
+struct response
 {
-    // Don't overwrite data that hasn't been sent yet
-    while (output_write == (uint8_t)(output_read - 1));
+    // 0 if there is nothing to send
+    enum packet_type type;
 
-    output_buffer[output_write++] = b;
+    // Simulation count is still to be sent
+    bool header;
 
-    // Enable transmit if necessary
-    UCSR0B |= _BV(UDRIE0);
+    // Simulations still to be sent, the stats reset flag, or the playlist request status
+    uint16_t next;
+    uint16_t last;
+
+    // Result of a SET_PARAM or SYNC request
+    union
+    {
+        struct packet_set_param param;
+        struct packet_sync_status sync;
+    };
+};
+
+static struct response response;
+
+// Notifications that didn't fit in the output buffer when they were raised
+#define NOTIFY_READY   0x01
+#define NOTIFY_CHANGED 0x02
+static uint8_t notify = 0;
+
+static bool send_simulation_type(uint16_t index);
+static bool send_simulation_name(uint16_t index);
+static bool send_simulation_count(uint16_t total, uint16_t active);
+static bool send_simulation_changed();
+static bool send_stats();
+static bool send_tick_count();
+static bool send_hello(uint8_t type);
+static bool send_tasks();
+static bool send_playlist(bool status);
+
+static void queue_byte(uint8_t b)
+{
+    output_buffer[output_write++] = b;
 }
 
-// Send data from RAM
-static void queue_data(uint8_t type, const void *data, uint8_t length)
+// Send data from RAM.  Packets are added whole or not at all, so returns
+// false without blocking if the output buffer doesn't have enough space.
+// The usb task is posted once the space becomes available
+static bool queue_data(uint8_t type, const void *data, uint8_t length)
 {
+    // Register the wait before checking, so the interrupt can't drain the
+    // buffer between the check and the registration without waking us
+    uint8_t wanted = length + PACKET_OVERHEAD;
+    output_wanted = wanted;
+    if ((uint8_t)(UINT8_MAX - (uint8_t)(output_write - output_read)) < wanted)
+    {
+        stats.tx_full++;
+        return false;
+    }
+    output_wanted = 0;
+
     // Header
     queue_byte('$');
     queue_byte('$');
@@ -129,6 +357,14 @@ static void queue_data(uint8_t type, const void *data, uint8_t length)
     queue_byte(checksum);
     queue_byte('\r');
     queue_byte('\n');
+
+    uint8_t used = output_write - output_read;
+    if (used > stats.output_high_water)
+        stats.output_high_water = used;
+
+    // Enable transmit if necessary
+    UCSR0B |= _BV(UDRIE0);
+    return true;
 }
 
 static bool byte_available()
@@ -136,10 +372,9 @@ static bool byte_available()
     return input_write != input_read;
 }
 
+// Callers must check byte_available first
 static uint8_t read_byte()
 {
-    // Loop until data is available
-    while (input_read == input_write);
     return input_buffer[input_read++];
 }
 
@@ -151,11 +386,46 @@ ISR(USART_UDRE_vect)
     // Ran out of data to send - disable the interrupt
     if (output_write == output_read)
         UCSR0B &= ~_BV(UDRIE0);
+
+    // Resume a deferred packet once it fits
+    uint8_t wanted = output_wanted;
+    if (wanted && (uint8_t)(UINT8_MAX - (uint8_t)(output_write - output_read)) >= wanted)
+    {
+        output_wanted = 0;
+        scheduler_post(TASK_USB);
+    }
 }
 
 ISR(USART_RX_vect)
 {
-    input_buffer[(uint8_t)(input_write++)] = UDR0;
+    // The hardware overrun flag must be checked before reading UDR0
+    if (UCSR0A & _BV(DOR0))
+        stats.rx_overflows++;
+
+    uint8_t b = UDR0;
+
+    // Drop the byte rather than overwrite unread data
+    uint8_t used = input_write - input_read;
+    if (used == UINT8_MAX)
+    {
+        stats.rx_overflows++;
+        return;
+    }
+
+    // Packets end with '\n', so this may be the arrival time of a SYNC
+    if (b == '\n')
+    {
+        uint8_t counts;
+        rx_ticks = read_tick_count(&counts);
+        rx_counts = counts;
+        rx_index = input_write;
+    }
+
+    input_buffer[(uint8_t)(input_write++)] = b;
+    if (used + 1 > stats.input_high_water)
+        stats.input_high_water = used + 1;
+
+    scheduler_post(TASK_USB);
 }
 
 void usb_initialize()
@@ -173,35 +443,271 @@ void usb_initialize()
 
     input_read = input_write = 0;
     output_read = output_write = 0;
+    output_wanted = 0;
+    response.type = 0;
+    notify = 0;
+}
+
+// Store the playlist from a SET_PLAYLIST packet.  Returns false if it is invalid
+static bool store_playlist(struct timer_packet *p)
+{
+    struct packet_playlist *list = &p->data.playlist;
+    if (p->length < offsetof(struct packet_playlist, entries) || list->count > PLAYLIST_MAX_ENTRIES ||
+        p->length != offsetof(struct packet_playlist, entries) + list->count * sizeof(struct packet_playlist_entry))
+        return false;
+
+    struct playlist_entry entries[PLAYLIST_MAX_ENTRIES];
+    for (uint8_t i = 0; i < list->count; i++)
+    {
+        entries[i].simulation = list->entries[i].simulation;
+        entries[i].duration = list->entries[i].duration;
+    }
+
+    return playlist_store(list->flags, list->count, entries);
+}
+
+// Parse an optional simulation range, defaulting to the whole catalog
+static void read_range(struct timer_packet *p, uint16_t *first, uint16_t *last)
+{
+    *first = 1;
+    *last = simulation_count + 1;
+    if (p->length < sizeof(struct packet_simulation_range))
+        return;
+
+    if (p->data.range.first > *first)
+        *first = p->data.range.first;
+    if (p->data.range.last < *last)
+        *last = p->data.range.last;
 }
 
 static void parse_packet(struct timer_packet *p)
 {
-    usb_send_message_fmt_P(got_packet_fmt, p->type);
+    // Parameter changes and beacons are acknowledged without the log message
+    // so that the round trip is a single packet in each direction
+    if (p->type != SET_PARAM && p->type != SYNC)
+        usb_send_message_fmt_P(got_packet_fmt, p->type);
+
+    // Requests that change state take effect immediately, and the
+    // response is sent by send_response as output space allows
+    response.type = p->type;
+    response.header = false;
     switch (p->type)
     {
         case REQUEST_MODES:
-        {
             // Simulation numbering starts at 1
-            usb_send_simulation_count(simulation_count, active_simulation);
-            for (uint8_t i = 0; i < simulation_count; i++)
-                usb_send_simulation_type(i+1, &simulation[i]);
+            response.header = true;
+            response.next = 1;
+            response.last = simulation_count + 1;
+            break;
+        case REQUEST_NAMES:
+        case REQUEST_PAGE:
+            response.header = true;
+            read_range(p, &response.next, &response.last);
+            break;
+        case REQUEST_DETAILS:
+            response.next = p->length >= sizeof(struct packet_set_mode) ? p->data.mode.id : 0;
             break;
-        }
         case SET_MODE:
-            // Simulation numbering starts at 1
-            select_simulation(p->data.mode.id);
+        {
+            // Simulation numbering starts at 1.
+            // The change is reported by a SET_MODE notification
+            response.type = 0;
+
+            // Hosts written for 8-bit ids send a single byte
+            uint16_t id;
+            if (p->length >= sizeof(struct packet_set_mode))
+                id = p->data.mode.id;
+            else if (p->length == 1)
+                id = p->data.bytes[0];
+            else
+            {
+                usb_send_message_fmt_P(short_packet_fmt, p->type, p->length);
+                break;
+            }
+
+            // A manual selection overrides the playlist
+            playlist_stop();
+            sync_stop();
+            select_simulation(id);
+            break;
+        }
+        case STATS:
+            response.next = p->length >= sizeof(struct packet_stats_request) && p->data.stats.reset;
+            break;
+        case SET_TRIM:
+            if (p->length >= sizeof(struct packet_set_trim))
+            {
+                sync_stop();
+                set_crystal_trim(p->data.trim.ppm);
+            }
+            response.type = TICK_COUNT;
+            break;
+        case SET_PARAM:
+        {
+            struct packet_set_param *param = &p->data.param;
+            if (p->length >= offsetof(struct packet_set_param, status))
+                param->status = set_parameter(param->channel, param->parameter, param->index, param->value);
+            else
+                memset(param, 0, sizeof(struct packet_set_param));
+            response.param = *param;
+            break;
+        }
+        case SYNC:
+        {
+            struct packet_sync *sync = &p->data.sync;
+            struct packet_sync_status *status = &response.sync;
+            response.type = SYNC_STATUS;
+            if (p->length < sizeof(struct packet_sync))
+            {
+                memset(status, 0, sizeof(struct packet_sync_status));
+                break;
+            }
+
+            // The footer has just been read.  If another '\n' has arrived
+            // since then the arrival time has been lost, so the beacon is ignored
+            uint32_t ticks;
+            uint8_t counts;
+            bool overwritten;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+            {
+                ticks = rx_ticks;
+                counts = rx_counts;
+                overwritten = rx_index != (uint8_t)(input_read - 1);
+            }
+
+            if (overwritten)
+            {
+                memset(status, 0, sizeof(struct packet_sync_status));
+                status->state = SYNC_IGNORED;
+                break;
+            }
+
+            // Synchronized devices don't follow their own playlist
+            if (sync->flags & SYNC_START)
+                playlist_stop();
+
+            int32_t error, rate;
+            status->state = sync_beacon(sync->flags, sync->simulation, sync->ticks, sync->counts,
+                                        ticks, counts, &error, &rate);
+            status->error = error;
+            status->rate = rate;
+            break;
+        }
+        case SET_PLAYLIST:
+            response.type = PLAYLIST;
+            response.next = store_playlist(p);
+            break;
+        case START_PLAYLIST:
+            response.type = PLAYLIST;
+            response.next = playlist_start(p->length >= sizeof(struct packet_start_playlist) ? p->data.start.entry : 0);
+            break;
+        case STOP_PLAYLIST:
+            playlist_stop();
+            // Fall through
+        case PLAYLIST:
+            response.type = PLAYLIST;
+            response.next = true;
+            break;
+        case HELLO:
+        case TASKS:
+        case TICK_COUNT:
             break;
         default:
+            response.type = 0;
+            stats.unknown_packets++;
             usb_send_message_fmt_P(unknown_packet_fmt, p->type);
             break;
     }
 }
 
+// Send as much of the current response as fits in the output buffer.
+// Returns true once the whole response has been sent
+static bool send_response()
+{
+    struct response *r = &response;
+    switch (r->type)
+    {
+        case REQUEST_MODES:
+        case REQUEST_NAMES:
+        case REQUEST_PAGE:
+            if (r->header && !send_simulation_count(simulation_count, active_simulation))
+                return false;
+            r->header = false;
+
+            for (; r->next < r->last; r->next++)
+            {
+                bool sent = r->type == REQUEST_NAMES ? send_simulation_name(r->next) : send_simulation_type(r->next);
+                if (!sent)
+                    return false;
+            }
+            break;
+        case REQUEST_DETAILS:
+            if (r->next > 0 && r->next <= simulation_count)
+            {
+                if (!send_simulation_type(r->next))
+                    return false;
+            }
+            else
+                usb_send_message_fmt_P(invalid_id_fmt, r->next);
+            break;
+        case STATS:
+            if (!send_stats())
+                return false;
+            if (r->next)
+                ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                    stats_reset();
+            break;
+        case HELLO:
+            if (!send_hello(HELLO))
+                return false;
+            break;
+        case TASKS:
+            if (!send_tasks())
+                return false;
+            break;
+        case TICK_COUNT:
+            if (!send_tick_count())
+                return false;
+            break;
+        case SET_PARAM:
+            if (!queue_data(SET_PARAM, &r->param, sizeof(struct packet_set_param)))
+                return false;
+            break;
+        case PLAYLIST:
+            if (!send_playlist(r->next))
+                return false;
+            break;
+        case SYNC_STATUS:
+            if (!queue_data(SYNC_STATUS, &r->sync, sizeof(struct packet_sync_status)))
+                return false;
+            break;
+        default:
+            break;
+    }
+
+    r->type = 0;
+    return true;
+}
+
+// Send the notifications that didn't fit when they were raised.
+// Returns true once they have all been sent
+static bool send_notifications()
+{
+    if ((notify & NOTIFY_READY) && send_hello(READY))
+        notify &= ~NOTIFY_READY;
+
+    if ((notify & NOTIFY_CHANGED) && send_simulation_changed())
+        notify &= ~NOTIFY_CHANGED;
+
+    return !notify;
+}
+
+// Never blocks: when the output buffer fills, the remaining output
+// is sent by a later run after the transmit interrupt posts the task
 void usb_tick()
 {
     static struct timer_packet p = {.state = HEADERA};
-    while (byte_available())
+    while (send_notifications() && send_response() && byte_available())
     {
         uint8_t b = read_byte();
         switch (p.state)
@@ -227,6 +733,7 @@ void usb_tick()
                     p.state++;
                 else
                 {
+                    stats.long_packets++;
                     usb_send_message_fmt_P(long_packet_fmt, p.type, p.length);
                     p.state = HEADERA;
                 }
@@ -242,6 +749,7 @@ void usb_tick()
                     p.state++;
                 else
                 {
+                    stats.checksum_errors++;
                     usb_send_message_fmt_P(checksum_failed_fmt, b, p.checksum);
                     p.state = HEADERA;
                 }
@@ -251,6 +759,7 @@ void usb_tick()
                     p.state++;
                 else
                 {
+                    stats.footer_errors++;
                     usb_send_message_fmt_P(invalid_packet_fmt, b, '\r');
                     p.state = HEADERA;
                 }
@@ -259,7 +768,10 @@ void usb_tick()
                 if (b == '\n')
                     parse_packet(&p);
                 else
+                {
+                    stats.footer_errors++;
                     usb_send_message_fmt_P(invalid_packet_fmt, b, '\n');
+                }
     
                 p.state = HEADERA;
                 break;
@@ -267,6 +779,7 @@ void usb_tick()
     }
 }
 
+// Log messages are dropped rather than deferred if the output buffer is full
 void usb_send_message_P(const char *string)
 {
     struct packet_message msg;
@@ -275,7 +788,8 @@ void usb_send_message_P(const char *string)
         msg.length = MAX_DATA_LENGTH-1;
 
     strncpy_P(msg.str, string, msg.length);
-    queue_data(MESSAGE, &msg, msg.length + 1);
+    if (!queue_data(MESSAGE, &msg, msg.length + 1))
+        stats.tx_dropped++;
 }
 
 void usb_send_message_fmt_P(const char *fmt, ...)
@@ -291,37 +805,141 @@ void usb_send_message_fmt_P(const char *fmt, ...)
         len = MAX_DATA_LENGTH-1;
 
     msg.length = (uint8_t)len;
-    queue_data(MESSAGE, &msg, msg.length + 1);
+    if (!queue_data(MESSAGE, &msg, msg.length + 1))
+        stats.tx_dropped++;
 }
 
-#define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
-void usb_send_simulation_type(uint8_t index, struct simulation_parameters *params)
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+static bool send_simulation_type(uint16_t index)
 {
+    // Catalog entries are read from flash on demand
+    struct simulation_parameters params;
+    read_simulation(index, &params);
+
     struct packet_simulation sim;
     sim.id = index;
-    sim.exptime = params->exptime;
-    sim.name_length = MAX(strlen_P(params->name), MAX_SIMULATION_NAME_LENGTH);
-    sim.desc_length = MAX(strlen_P(params->desc), MAX_SIMULATION_DESC_LENGTH);
+    sim.exptime = params.exptime;
+    sim.name_length = MIN(strlen_P(params.name), MAX_SIMULATION_NAME_LENGTH);
+    sim.desc_length = MIN(strlen_P(params.desc), MAX_SIMULATION_DESC_LENGTH);
 
-    strncpy_P(sim.name, params->name, sim.name_length);
+    strncpy_P(sim.name, params.name, sim.name_length);
     sim.name[sim.name_length] = 0;
-    strncpy_P(sim.desc, params->desc, sim.desc_length);
+    strncpy_P(sim.desc, params.desc, sim.desc_length);
     sim.desc[sim.desc_length] = 0;
 
-    queue_data(SIMULATION_TYPE, &sim, sizeof(struct packet_simulation));
+    return queue_data(SIMULATION_TYPE, &sim, sizeof(struct packet_simulation));
+}
+
+static bool send_simulation_name(uint16_t index)
+{
+    struct simulation_parameters params;
+    read_simulation(index, &params);
+
+    struct packet_simulation_name sim;
+    sim.id = index;
+    sim.name_length = MIN(strlen_P(params.name), MAX_SIMULATION_NAME_LENGTH);
+    strncpy_P(sim.name, params.name, sim.name_length);
+
+    // Trim the unused part of the name buffer
+    return queue_data(SIMULATION_NAME, &sim, offsetof(struct packet_simulation_name, name) + sim.name_length);
 }
 
-void usb_send_simulation_count(uint8_t total, uint8_t active)
+static bool send_simulation_count(uint16_t total, uint16_t active)
 {
     struct packet_simulation_count count;
     count.total = total;
     count.active = active;
-    queue_data(SIMULATION_COUNT, &count, sizeof(struct packet_simulation_count));
+    return queue_data(SIMULATION_COUNT, &count, sizeof(struct packet_simulation_count));
 }
 
-void usb_send_simulation_changed(uint8_t index)
+static bool send_simulation_changed()
 {
     struct packet_set_mode sim;
-    sim.id = index;
-    queue_data(SET_MODE, &sim, sizeof(struct packet_set_mode));
-}
\ No newline at end of file
+    sim.id = active_simulation;
+    return queue_data(SET_MODE, &sim, sizeof(struct packet_set_mode));
+}
+
+static bool send_stats()
+{
+    // The counters are updated from interrupts, so take a consistent snapshot
+    struct performance_stats snapshot;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        snapshot = stats;
+
+    return queue_data(STATS, &snapshot, sizeof(struct performance_stats));
+}
+
+static bool send_tick_count()
+{
+    struct packet_tick_count count;
+    count.ticks = read_tick_count(&count.counts);
+    count.trim = crystal_trim;
+    return queue_data(TICK_COUNT, &count, sizeof(struct packet_tick_count));
+}
+
+static bool send_hello(uint8_t type)
+{
+    struct packet_hello hello;
+    hello.build_hash = BUILD_HASH;
+    hello.catalog_hash = catalog_hash;
+    hello.protocol_version = PROTOCOL_VERSION;
+    hello.features = FEATURES;
+    hello.total = simulation_count;
+    hello.active = active_simulation;
+    return queue_data(type, &hello, sizeof(struct packet_hello));
+}
+
+static bool send_tasks()
+{
+    struct packet_tasks packet;
+    packet.idle = idle_time;
+    packet.count = TASK_COUNT;
+    for (uint8_t i = 0; i < TASK_COUNT; i++)
+    {
+        memcpy_P(packet.tasks[i].name, task_names[i], TASK_NAME_LENGTH);
+        packet.tasks[i].runs = task_stats[i].runs;
+        packet.tasks[i].time = task_stats[i].time;
+    }
+
+    return queue_data(TASKS, &packet, offsetof(struct packet_tasks, tasks) + TASK_COUNT * sizeof(struct packet_task));
+}
+
+static bool send_playlist(bool status)
+{
+    struct packet_playlist_status packet;
+    struct playlist_entry entries[PLAYLIST_MAX_ENTRIES];
+    uint32_t remaining;
+    packet.status = status;
+    packet.running = playlist_status(&packet.entry, &remaining);
+    packet.remaining = remaining;
+    packet.playlist.count = playlist_read(&packet.playlist.flags, entries);
+    for (uint8_t i = 0; i < packet.playlist.count; i++)
+    {
+        packet.playlist.entries[i].simulation = entries[i].simulation;
+        packet.playlist.entries[i].duration = entries[i].duration;
+    }
+
+    uint8_t length = offsetof(struct packet_playlist_status, playlist.entries) +
+        packet.playlist.count * sizeof(struct packet_playlist_entry);
+    return queue_data(PLAYLIST, &packet, length);
+}
+
+// Notifications are sent immediately if possible, and otherwise
+// by the usb task once there is space in the output buffer
+void usb_send_simulation_changed()
+{
+    if (!send_simulation_changed())
+    {
+        notify |= NOTIFY_CHANGED;
+        scheduler_post(TASK_USB);
+    }
+}
+
+void usb_send_ready()
+{
+    if (!send_hello(READY))
+    {
+        notify |= NOTIFY_READY;
+        scheduler_post(TASK_USB);
+    }
+}
@@ -15,11 +15,12 @@
 void usb_initialize();
 void usb_tick();
 
+// Messages are dropped if the output buffer is full
 void usb_send_message_P(const char *string);
 void usb_send_message_fmt_P(const char *fmt, ...);
-void usb_send_raw(uint8_t *data, uint8_t length);
-void usb_send_simulation_type(uint8_t index, struct simulation_parameters *params);
-void usb_send_simulation_count(uint8_t total, uint8_t active);
-void usb_send_simulation_changed(uint8_t index);
+
+// Notifications are deferred until there is space in the output buffer
+void usb_send_simulation_changed();
+void usb_send_ready();
 
 #endif